@@ -4,11 +4,34 @@
  * Exemple: x^2*sin(x) → 2*x*sin(x)+x^2*cos(x)
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "derivative.h"
 
 /* Types de nœuds dans l'arbre d'expression */
 typedef enum {
@@ -25,15 +48,195 @@ typedef enum {
     NODE_LN         // Logarithme naturel
 } NodeType;
 
+/* Variable: le code du caractère pour un nom d'une lettre, SYMBOL_FIRST et
+ * au-delà pour un nom plus long interné dans la table des symboles. Deux
+ * variables se comparent comme deux entiers. */
+typedef uint32_t Symbol;
+#define SYMBOL_FIRST 256
+
 /* Structure d'un nœud de l'arbre d'expression */
 typedef struct Node {
     NodeType type;
+    uint32_t hash;         // Empreinte structurelle (cache de dérivation)
     double value;          // Pour NODE_NUMBER
-    char variable;         // Pour NODE_VARIABLE
+    Symbol variable;       // Pour NODE_VARIABLE
     struct Node *left;     // Fils gauche
     struct Node *right;    // Fils droit
 } Node;
 
+/* Arène de nœuds: allocation par blocs, libération globale par reset */
+#define ARENA_FIRST_CHUNK 1024     // Nœuds dans le premier bloc
+#define ARENA_MAX_CHUNK   65536    // Taille maximale d'un bloc (en nœuds)
+#define ORDER_MAX 16               // Ordre de dérivation maximal (--order)
+#define TAYLOR_MAX 1000            // Ordre maximal des séries de Taylor (--taylor)
+
+/* Règles locales de simplification, dans l'ordre où elles sont essayées */
+typedef enum {
+    RULE_NONE,
+    RULE_ADD_ZERO_LEFT,    // 0 + x = x
+    RULE_ADD_ZERO_RIGHT,   // x + 0 = x
+    RULE_ADD_CONST,        // c1 + c2 = c3
+    RULE_SUB_ZERO_RIGHT,   // x - 0 = x
+    RULE_SUB_ZERO_LEFT,    // 0 - x = -1 * x
+    RULE_SUB_CONST,        // c1 - c2 = c3
+    RULE_MUL_ZERO,         // 0 * x = x * 0 = 0
+    RULE_MUL_ONE_LEFT,     // 1 * x = x
+    RULE_MUL_ONE_RIGHT,    // x * 1 = x
+    RULE_MUL_CONST,        // c1 * c2 = c3
+    RULE_DIV_ZERO,         // 0 / x = 0
+    RULE_DIV_ONE,          // x / 1 = x
+    RULE_DIV_CONST,        // c1 / c2 = c3 (c2 != 0)
+    RULE_POW_ZERO,         // x ^ 0 = 1
+    RULE_POW_ONE,          // x ^ 1 = x
+    RULE_POW_BASE_ZERO,    // 0 ^ x = 0 (si x != 0)
+    RULE_POW_BASE_ONE,     // 1 ^ x = 1
+    RULE_POW_CONST,        // c1 ^ c2 = c3
+    RULE_COUNT
+} SimplifyRule;
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t capacity;       // Nombre de nœuds du bloc
+    size_t used;           // Nœuds déjà distribués
+    Node nodes[];          // Stockage des nœuds
+} ArenaChunk;
+
+typedef struct {
+    size_t bytes;          // Octets réservés auprès de malloc
+    size_t nodes;          // Nœuds vivants
+    size_t high_water;     // Maximum de nœuds vivants atteint
+    size_t allocs;         // Nombre total d'appels à create_node
+    size_t released;       // Nœuds rendus à l'arène par release_node
+    size_t copies;         // Appels à copy_tree
+    size_t shared;         // Nœuds trouvés dans la table d'unicité (mode DAG)
+    size_t memo_hits;      // Dérivées trouvées dans le cache de dérivation
+    size_t memo_misses;    // Dérivées calculées
+    size_t canon_calls;    // Appels à canonicalize
+    size_t canon_passes;   // Passes de forme canonique effectuées
+    size_t canon_nodes_in; // Nœuds reçus par canonicalize
+    size_t canon_nodes_out;// Nœuds rendus par canonicalize
+    size_t flat_nodes;     // Nœuds créés dans les arbres compacts
+    size_t flat_bytes;     // Octets occupés par ces nœuds (tables comprises)
+    size_t order_runs;     // Dérivations d'ordre supérieur (--order)
+    size_t order_nodes[ORDER_MAX + 1]; // Nœuds distincts de la dérivée simplifiée, par ordre
+    size_t rules[RULE_COUNT]; // Applications de chaque règle de simplification
+} ArenaStats;
+
+/* Cache de dérivation: (sous-expression, variable) -> dérivée */
+typedef struct {
+    Node *key;             // Sous-expression dérivée
+    Node *result;          // Sa dérivée
+    uint32_t hash;         // Empreinte de (key, var)
+    Symbol var;
+} DiffEntry;
+
+typedef struct {
+    DiffEntry *entries;
+    size_t capacity;       // Puissance de deux (0 si non allouée)
+    size_t count;
+} DiffCache;
+
+/* Table associative nœud -> nœud (adressage ouvert, clés = pointeurs) */
+typedef struct {
+    Node **keys;
+    Node **values;
+    size_t capacity;       // Puissance de deux (0 si non allouée)
+    size_t count;
+} NodeMap;
+
+/* Pile de travail des parcours itératifs: la profondeur d'un arbre n'est
+ * limitée que par la mémoire, pas par la pile d'appels */
+#define WORK_STACK_LOCAL 64        // Éléments logés sur la pile C avant tout malloc
+
+typedef struct {
+    Node *node;            // Nœud à traiter (ou résultat déjà calculé)
+    union {
+        Node *other;       // Second arbre (comparaison) ou copie en cours
+        Node **slot;       // Emplacement où ranger le résultat
+        int character;     // Caractère à écrire (affichage)
+        uint32_t hash;     // Empreinte déjà calculée (dérivation)
+        uint32_t index;    // Indice dans un arbre compact ou parmi les groupes analysés
+        double number;     // Signe d'un terme ou exposant d'un facteur (forme canonique)
+    } aux;
+    int state;             // Étape du traitement du nœud
+} WorkItem;
+
+typedef struct {
+    WorkItem *items;       // local, puis tableau alloué si la pile déborde
+    size_t count;
+    size_t capacity;
+    WorkItem local[WORK_STACK_LOCAL];
+} WorkStack;
+
+/* Arbre compact (--flat): structure de tableaux, indices 32 bits, nœuds
+ * uniques rangés dans l'ordre topologique (fils avant parents) */
+#define FLAT_NONE UINT32_MAX       // Fils absent
+
+typedef struct {
+    uint8_t *types;        // NodeType de chaque nœud
+    uint32_t *left;        // Fils gauche, indice de literals (nombre) ou caractère (variable)
+    uint32_t *right;       // Fils droit (FLAT_NONE si absent)
+    size_t count;
+    size_t capacity;
+    double *literals;      // Valeurs des constantes
+    size_t literal_count;
+    size_t literal_capacity;
+    uint32_t *intern;      // Table d'unicité: indice + 1 (0 = case libre)
+    size_t intern_capacity;
+    uint32_t *scratch;     // Une valeur par nœud pour les passes linéaires
+    uint8_t *marks;        // Un octet d'état par nœud pour les passes linéaires
+    size_t scratch_capacity;
+} FlatTree;
+
+typedef struct {
+    ArenaChunk *head;      // Premier bloc (conservé entre deux resets)
+    ArenaChunk *current;   // Bloc en cours de remplissage
+    Node *free_list;       // Nœuds rendus par release_node, réutilisables
+    ArenaStats stats;
+    
+    /* Mode DAG: nœuds immuables et uniques (hash-consing) */
+    int hash_consing;
+    Node **intern;         // Table d'unicité structurelle
+    size_t intern_capacity;
+    size_t intern_count;
+    NodeMap simplified;    // Résultats de simplify() déjà calculés
+    DiffCache diff_cache;  // Dérivées déjà calculées
+    
+    /* Arbres compacts (--flat): expression et dérivée, puis forme simplifiée */
+    FlatTree flat[2];
+    
+    /* Table des symboles propre à l'arène (contextes de la bibliothèque),
+     * vidée avec elle; NULL: table partagée par le processus */
+    struct SymbolTable *symbols;
+} Arena;
+
+/* Sous-expressions communes: occurrences de chaque sous-arbre distinct */
+typedef struct {
+    Node *node;            // Représentant (première occurrence)
+    uint32_t hash;         // Empreinte structurelle (ou du pointeur en mode DAG)
+    uint32_t count;        // Occurrences hors des sous-arbres déjà comptés
+    uint32_t id;           // Numéro du temporaire (0 si non nommé)
+} CseEntry;
+
+typedef struct {
+    CseEntry *entries;
+    size_t capacity;       // Puissance de deux
+    size_t count;
+} CseTable;
+
+/* Tampon de texte extensible: la zone initiale est fournie par l'appelant
+ * (souvent sur la pile) et remplacée par un tableau alloué si elle déborde.
+ * En mode mesure, rien n'est écrit: seule la longueur avance. */
+#define STRBUF_LOCAL 4096          // Taille du tampon local des fonctions fprint_*
+
+typedef struct {
+    char *data;            // Zone de l'appelant, puis tableau alloué (NULL en mode mesure)
+    size_t length;         // Octets écrits (ou qui l'auraient été en mode mesure)
+    size_t capacity;
+    int owned;             // data a été alloué par le tampon
+    int measure;           // Mode mesure: compter sans écrire
+} StrBuf;
+
 /* Types de tokens pour le lexeur */
 typedef enum {
     TOKEN_NUMBER,
@@ -56,130 +259,337 @@ typedef enum {
 typedef struct {
     TokenType type;
     double value;
-    char variable;
+    Symbol symbol;         // Pour TOKEN_VARIABLE
 } Token;
 
-/* Variables globales pour le parsing */
-static const char *input_str;
-static int pos;
-static Token current_token;
+/* État du lexeur et du parseur: un contexte par analyse (réentrant) */
+typedef struct {
+    const char *input;     // Texte analysé
+    size_t pos;            // Position courante dans input
+    Token current_token;   // Token en cours
+    size_t token_start;    // Début du token en cours dans input
+    const char *error;     // Premier message d'erreur (NULL si aucun)
+    size_t error_pos;      // Position du token fautif
+} Parser;
+
+/* Groupe analysé: "(...)" ou "f(...)", dont le nœud ne dépend pas du texte
+ * qui l'entoure */
+typedef struct {
+    size_t start;          // Position de '(' ou du nom de la fonction
+    size_t end;            // Position qui suit ')'
+    Node *node;
+} ParseGroup;
+
+/* Analyse incrémentale (session): les groupes de l'analyse précédente dont
+ * le texte n'a pas changé sont repris tels quels au lieu d'être analysés.
+ * Les nœuds doivent rester valides (arène en mode DAG, non vidée). */
+typedef struct {
+    char *text;            // Texte précédent
+    size_t length;
+    size_t text_capacity;
+    ParseGroup *groups;    // Ses groupes, par début croissant
+    size_t count;
+    size_t capacity;
+    ParseGroup *next;      // Groupes de l'analyse en cours
+    size_t next_count;
+    size_t next_capacity;
+    size_t prefix;         // Nouveau texte identique au précédent sur [0, prefix)
+    size_t suffix;         // ... et à partir de suffix (old_suffix dans le précédent)
+    size_t old_suffix;
+} ParseReuse;
+
+/* Bytecode d'évaluation numérique: programme à pile, une instruction par nœud */
+#define EVAL_BLOCK 256             // Points évalués par passage d'une instruction
+#define EVAL_VARS  256             // Liaisons indexées par le caractère de la variable
+#define EVAL_POWI_MAX 64           // Exposant entier maximal compilé en multiplications
+
+typedef enum {
+    OP_CONST,       // Empile constants[arg]
+    OP_VAR,         // Empile la liaison de la variable arg
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_SIN,
+    OP_COS,
+    OP_EXP,
+    OP_LN,
+    OP_POWI         // Sommet ^ arg (exposant entier signé, |arg| <= EVAL_POWI_MAX)
+} OpCode;
+
+/* Jeu d'instructions utilisé par l'interpréteur */
+typedef enum {
+    EVAL_SCALAR,    // Boucles scalaires et libm
+    EVAL_AVX2       // Noyaux vectoriels, 4 doubles par instruction
+} EvalIsa;
+
+typedef struct {
+    uint8_t op;            // OpCode
+    uint32_t arg;          // Indice de constante ou caractère de variable
+} Instr;
+
+typedef struct {
+    Instr *code;
+    size_t count;
+    size_t capacity;
+    double *constants;
+    size_t const_count;
+    size_t const_capacity;
+    size_t depth;          // Profondeur de pile courante (compilation)
+    size_t max_depth;      // Profondeur maximale atteinte par le programme
+} Program;
+
+/* Code natif: f et sa dérivée compilés en C et chargés avec dlopen */
+typedef struct {
+    void *handle;
+    double (*f)(double);
+    double (*df)(double);
+} NativeModule;
+
+/* Arène courante utilisée par create_node (une par thread) */
+static Arena default_arena;
+static __thread Arena *current_arena = &default_arena;
 
 /* Prototypes de fonctions */
+void arena_init(Arena *arena);
+void arena_reset(Arena *arena);
+void arena_destroy(Arena *arena);
+Arena *arena_use(Arena *arena);
+void arena_set_hash_consing(Arena *arena, int enabled);
+void release_node(Node *node);
 Node *create_node(NodeType type);
 Node *create_number(double value);
-Node *create_variable(char var);
+Node *create_variable(Symbol var);
 Node *create_binary(NodeType type, Node *left, Node *right);
 Node *create_unary(NodeType type, Node *child);
 void free_tree(Node *node);
 void print_tree(Node *node);
-Node *differentiate(Node *node, char var);
+void fprint_tree(FILE *out, Node *node);
+void fprint_tree_cse(FILE *out, Node *node);
+size_t serialize_tree(StrBuf *buf, Node *node);
+size_t serialize_tree_cse(StrBuf *buf, Node *node);
+size_t measure_tree(Node *node);
+Node *differentiate(Node *node, Symbol var);
+void gradient(Node *tree, Node **grads, size_t grad_count);
 Node *simplify(Node *node);
+Node *canonicalize(Node *node);
+size_t count_nodes(Node *node);
+size_t tree_shape(Node *node, size_t *nodes);
+
+/* Arbres compacts (structure de tableaux) */
+void flat_clear(FlatTree *tree);
+void flat_free(FlatTree *tree);
+uint32_t flat_from_tree(FlatTree *tree, Node *node);
+uint32_t flat_derive(FlatTree *tree, uint32_t root, Symbol var);
+uint32_t flat_simplify(FlatTree *in, uint32_t root, FlatTree *out);
+size_t flat_serialize(StrBuf *buf, const FlatTree *tree, uint32_t root);
+void flat_print(FILE *out, const FlatTree *tree, uint32_t root);
 Node *copy_tree(Node *node);
 int is_zero(Node *node);
 int is_one(Node *node);
-int is_constant(Node *node, char var);
+int is_constant(Node *node, Symbol var);
+
+/* Évaluation numérique */
+void program_init(Program *prog);
+void program_free(Program *prog);
+void compile_tree(Program *prog, Node *node);
+void program_eval(const Program *prog, const double *const *bindings, size_t n, double *out);
+void program_eval_isa(const Program *prog, const double *const *bindings, size_t n, double *out,
+                      EvalIsa isa);
+EvalIsa eval_detect_isa(void);
+void program_eval_dual(const Program *prog, const double *const *bindings, Symbol var, size_t n,
+                       double *value, double *derivative);
+void program_gradient(const Program *prog, const double *const *bindings, size_t n,
+                      double *value, double *const *grads);
+void program_taylor(const Program *prog, Symbol var, double x0, size_t m, double *coeffs);
+
+/* Génération de code C */
+void emit_c_source(FILE *out, Node *tree, Node *derivative, Symbol var);
+int native_load(NativeModule *module, Node *tree, Node *derivative, Symbol var);
+void native_unload(NativeModule *module);
+
+/* Allocation: fatal() si la mémoire manque */
+static void *xrealloc(void *p, size_t size);
+
+/* Piles de travail */
+static void work_init(WorkStack *stack);
+static void work_free(WorkStack *stack);
+static inline WorkItem *work_push(WorkStack *stack, Node *node, int state);
+
+/* Tampons de texte */
+void strbuf_init(StrBuf *buf, char *data, size_t capacity);
+void strbuf_measure(StrBuf *buf);
+void strbuf_free(StrBuf *buf);
+void strbuf_reserve(StrBuf *buf, size_t size);
+void strbuf_write_to(const StrBuf *buf, FILE *out);
+
+/* Table des symboles (variables de plusieurs lettres) */
+Symbol symbol_intern(const char *name, size_t length);
+const char *symbol_text(Symbol symbol, char letter[2]);
+size_t symbol_count(void);
+int symbol_compare(Symbol a, Symbol b);
 
 /* Fonctions du lexeur */
-void next_char(void);
-void skip_whitespace(void);
-Token get_next_token(void);
+void next_char(Parser *p);
+void skip_whitespace(Parser *p);
+Token get_next_token(Parser *p);
 
 /* Fonctions du parseur */
-Node *parse_expression(void);
-Node *parse_term(void);
-Node *parse_factor(void);
-Node *parse_power(void);
-Node *parse_primary(void);
+Node *parse_string(Parser *p, const char *text);
+Node *parse_incremental(Parser *p, const char *text, ParseReuse *reuse);
+void parse_reuse_clear(ParseReuse *reuse);
+void parse_reuse_free(ParseReuse *reuse);
 
 /* === LEXEUR === */
 
-void next_char(void) {
-    pos++;
+/* Classes de caractères: une lecture de table par caractère */
+typedef enum {
+    CHAR_OTHER,            // Caractère invalide
+    CHAR_END,              // Fin du texte ou de la ligne
+    CHAR_SPACE,            // Espace ou tabulation
+    CHAR_DIGIT,            // Chiffre: début de nombre, suite d'identificateur
+    CHAR_POINT,            // Point décimal: début de nombre
+    CHAR_LETTER,           // Lettre ou '_': début ou suite d'identificateur
+    CHAR_OPERATOR          // Token d'un caractère (voir char_tokens)
+} CharClass;
+
+static const uint8_t char_classes[256] = {
+    ['\0'] = CHAR_END, ['\n'] = CHAR_END, ['\r'] = CHAR_END, [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['.'] = CHAR_POINT,
+    ['+'] = CHAR_OPERATOR, ['-'] = CHAR_OPERATOR, ['*'] = CHAR_OPERATOR, ['/'] = CHAR_OPERATOR,
+    ['^'] = CHAR_OPERATOR, ['('] = CHAR_OPERATOR, [')'] = CHAR_OPERATOR,
+    ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT,
+    ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT,
+    ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+    ['a'] = CHAR_LETTER, ['b'] = CHAR_LETTER, ['c'] = CHAR_LETTER, ['d'] = CHAR_LETTER,
+    ['e'] = CHAR_LETTER, ['f'] = CHAR_LETTER, ['g'] = CHAR_LETTER, ['h'] = CHAR_LETTER,
+    ['i'] = CHAR_LETTER, ['j'] = CHAR_LETTER, ['k'] = CHAR_LETTER, ['l'] = CHAR_LETTER,
+    ['m'] = CHAR_LETTER, ['n'] = CHAR_LETTER, ['o'] = CHAR_LETTER, ['p'] = CHAR_LETTER,
+    ['q'] = CHAR_LETTER, ['r'] = CHAR_LETTER, ['s'] = CHAR_LETTER, ['t'] = CHAR_LETTER,
+    ['u'] = CHAR_LETTER, ['v'] = CHAR_LETTER, ['w'] = CHAR_LETTER, ['x'] = CHAR_LETTER,
+    ['y'] = CHAR_LETTER, ['z'] = CHAR_LETTER, ['A'] = CHAR_LETTER, ['B'] = CHAR_LETTER,
+    ['C'] = CHAR_LETTER, ['D'] = CHAR_LETTER, ['E'] = CHAR_LETTER, ['F'] = CHAR_LETTER,
+    ['G'] = CHAR_LETTER, ['H'] = CHAR_LETTER, ['I'] = CHAR_LETTER, ['J'] = CHAR_LETTER,
+    ['K'] = CHAR_LETTER, ['L'] = CHAR_LETTER, ['M'] = CHAR_LETTER, ['N'] = CHAR_LETTER,
+    ['O'] = CHAR_LETTER, ['P'] = CHAR_LETTER, ['Q'] = CHAR_LETTER, ['R'] = CHAR_LETTER,
+    ['S'] = CHAR_LETTER, ['T'] = CHAR_LETTER, ['U'] = CHAR_LETTER, ['V'] = CHAR_LETTER,
+    ['W'] = CHAR_LETTER, ['X'] = CHAR_LETTER, ['Y'] = CHAR_LETTER, ['Z'] = CHAR_LETTER,
+    ['_'] = CHAR_LETTER
+};
+
+/* Token des caractères de classe CHAR_OPERATOR */
+static const uint8_t char_tokens[256] = {
+    ['+'] = TOKEN_PLUS, ['-'] = TOKEN_MINUS, ['*'] = TOKEN_MULT, ['/'] = TOKEN_DIV,
+    ['^'] = TOKEN_POW, ['('] = TOKEN_LPAREN, [')'] = TOKEN_RPAREN
+};
+
+/* Mots-clés, rangés selon un hachage parfait minimal: KEYWORD_SLOT donne
+ * une case distincte à chacun; le texte de la case est ensuite comparé */
+#define KEYWORD_SLOT(name, length) \
+    ((2 * (unsigned char)(name)[0] + 3 * (unsigned char)(name)[(length) - 1] + (length)) & 3)
+
+static const struct {
+    const char *name;
+    size_t length;
+    TokenType type;
+} keywords[4] = {
+    {"ln", 2, TOKEN_LN}, {"exp", 3, TOKEN_EXP}, {"cos", 3, TOKEN_COS}, {"sin", 3, TOKEN_SIN}
+};
+
+/* Token d'un identificateur: fonction, sinon variable */
+static TokenType keyword_type(const char *name, size_t length) {
+    size_t slot = KEYWORD_SLOT(name, length);
+    
+    if (keywords[slot].length == length && memcmp(keywords[slot].name, name, length) == 0) {
+        return keywords[slot].type;
+    }
+    return TOKEN_VARIABLE;
 }
 
-void skip_whitespace(void) {
-    while (input_str[pos] == ' ' || input_str[pos] == '\t') {
-        next_char();
+static CharClass char_class(char c) {
+    return (CharClass)char_classes[(unsigned char)c];
+}
+
+/* Symbole de la variable name, un identificateur qui n'est pas un nom de
+ * fonction; renvoie 0 si name n'en est pas un */
+static int variable_symbol(const char *name, Symbol *symbol) {
+    size_t length = 0;
+    
+    while (char_class(name[length]) == CHAR_LETTER ||
+           (length > 0 && char_class(name[length]) == CHAR_DIGIT)) {
+        length++;
+    }
+    if (length == 0 || name[length] != '\0' || keyword_type(name, length) != TOKEN_VARIABLE) {
+        return 0;
     }
+    *symbol = symbol_intern(name, length);
+    return 1;
 }
 
-Token get_next_token(void) {
-    Token token;
-    skip_whitespace();
-    
-    if (input_str[pos] == '\0') {
-        token.type = TOKEN_END;
-        return token;
-    }
-    
-    /* Nombres */
-    if (isdigit(input_str[pos]) || input_str[pos] == '.') {
-        char *endptr;
-        token.type = TOKEN_NUMBER;
-        token.value = strtod(&input_str[pos], &endptr);
-        pos = endptr - input_str;
-        return token;
-    }
-    
-    /* Fonctions et variables */
-    if (isalpha(input_str[pos])) {
-        char buffer[10];
-        int i = 0;
-        while (isalpha(input_str[pos]) && i < 9) {
-            buffer[i++] = input_str[pos++];
-        }
-        buffer[i] = '\0';
-        
-        if (strcmp(buffer, "sin") == 0) {
-            token.type = TOKEN_SIN;
-        } else if (strcmp(buffer, "cos") == 0) {
-            token.type = TOKEN_COS;
-        } else if (strcmp(buffer, "exp") == 0) {
-            token.type = TOKEN_EXP;
-        } else if (strcmp(buffer, "ln") == 0) {
-            token.type = TOKEN_LN;
-        } else if (strlen(buffer) == 1) {
-            token.type = TOKEN_VARIABLE;
-            token.variable = buffer[0];
-        } else {
-            token.type = TOKEN_ERROR;
-        }
-        return token;
+void next_char(Parser *p) {
+    p->pos++;
+}
+
+void skip_whitespace(Parser *p) {
+    while (char_class(p->input[p->pos]) == CHAR_SPACE) {
+        next_char(p);
     }
+}
+
+Token get_next_token(Parser *p) {
+    Token token;
+    skip_whitespace(p);
+    p->token_start = p->pos;
     
-    /* Opérateurs */
-    switch (input_str[pos]) {
-        case '+':
-            token.type = TOKEN_PLUS;
-            next_char();
-            break;
-        case '-':
-            token.type = TOKEN_MINUS;
-            next_char();
-            break;
-        case '*':
-            token.type = TOKEN_MULT;
-            next_char();
-            break;
-        case '/':
-            token.type = TOKEN_DIV;
-            next_char();
+    switch (char_class(p->input[p->pos])) {
+        case CHAR_END:
+            token.type = TOKEN_END;
             break;
-        case '^':
-            token.type = TOKEN_POW;
-            next_char();
+            
+        /* Nombres */
+        case CHAR_DIGIT:
+        case CHAR_POINT: {
+            char *endptr;
+            token.type = TOKEN_NUMBER;
+            token.value = strtod(&p->input[p->pos], &endptr);
+            if (endptr == &p->input[p->pos]) {
+                /* '.' seul: rien n'est lu, le token doit quand même avancer */
+                token.type = TOKEN_ERROR;
+                next_char(p);
+                break;
+            }
+            p->pos = endptr - p->input;
             break;
-        case '(':
-            token.type = TOKEN_LPAREN;
-            next_char();
+        }
+            
+        /* Fonctions et variables: l'identificateur entier, de longueur
+         * quelconque; une variable est internée en symbole */
+        case CHAR_LETTER: {
+            const char *name = &p->input[p->pos];
+            size_t length;
+            CharClass next;
+            
+            do {
+                next_char(p);
+                next = char_class(p->input[p->pos]);
+            } while (next == CHAR_LETTER || next == CHAR_DIGIT);
+            length = (size_t)(&p->input[p->pos] - name);
+            
+            token.type = keyword_type(name, length);
+            if (token.type == TOKEN_VARIABLE) token.symbol = symbol_intern(name, length);
             break;
-        case ')':
-            token.type = TOKEN_RPAREN;
-            next_char();
+        }
+            
+        /* Opérateurs et parenthèses */
+        case CHAR_OPERATOR:
+            token.type = (TokenType)char_tokens[(unsigned char)p->input[p->pos]];
+            next_char(p);
             break;
+            
         default:
             token.type = TOKEN_ERROR;
-            next_char();
+            next_char(p);
+            break;
     }
     
     return token;
@@ -187,646 +597,8025 @@ Token get_next_token(void) {
 
 /* === PARSEUR === */
 
-/* expression = term (('+' | '-') term)* */
-Node *parse_expression(void) {
-    Node *left = parse_term();
-    
-    while (current_token.type == TOKEN_PLUS || current_token.type == TOKEN_MINUS) {
-        TokenType op = current_token.type;
-        current_token = get_next_token();
-        Node *right = parse_term();
-        
-        if (op == TOKEN_PLUS) {
-            left = create_binary(NODE_ADD, left, right);
-        } else {
-            left = create_binary(NODE_SUB, left, right);
-        }
+/* Enregistre une erreur de syntaxe; les appelants propagent NULL */
+static Node *parse_fail(Parser *p, const char *message) {
+    if (p->error == NULL) {
+        p->error = message;
+        p->error_pos = p->token_start;
+    }
+    return NULL;
+}
+
+/* Précédence d'un opérateur binaire (0 pour les parenthèses et fonctions) */
+static int precedence(TokenType type) {
+    switch (type) {
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+            return 1;
+        case TOKEN_MULT:
+        case TOKEN_DIV:
+            return 2;
+        case TOKEN_POW:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static NodeType token_node_type(TokenType type) {
+    switch (type) {
+        case TOKEN_PLUS:  return NODE_ADD;
+        case TOKEN_MINUS: return NODE_SUB;
+        case TOKEN_MULT:  return NODE_MUL;
+        case TOKEN_DIV:   return NODE_DIV;
+        case TOKEN_POW:   return NODE_POW;
+        case TOKEN_SIN:   return NODE_SIN;
+        case TOKEN_COS:   return NODE_COS;
+        case TOKEN_EXP:   return NODE_EXP;
+        default:          return NODE_LN;
     }
+}
+
+static int is_function_token(TokenType type) {
+    return type == TOKEN_SIN || type == TOKEN_COS || type == TOKEN_EXP || type == TOKEN_LN;
+}
+
+/* Remplace les deux opérandes du sommet par l'application de l'opérateur */
+static void reduce_operator(WorkStack *operators, WorkStack *operands) {
+    TokenType op = (TokenType)operators->items[--operators->count].state;
+    Node *right = operands->items[--operands->count].node;
+    Node *left = operands->items[operands->count - 1].node;
     
-    return left;
+    operands->items[operands->count - 1].node = create_binary(token_node_type(op), left, right);
+}
+
+/* Longueur d'une expression: elle s'arrête au premier '\0', '\n' ou '\r' */
+static size_t expression_length(const char *text) {
+    return strcspn(text, "\r\n");
 }
 
-/* term = factor (('*' | '/') factor)* */
-Node *parse_term(void) {
-    Node *left = parse_factor();
+/* Compare le nouveau texte au précédent: préfixe et suffixe communs */
+static void reuse_begin(ParseReuse *reuse, const char *text) {
+    size_t length = expression_length(text);
+    size_t common = length < reuse->length ? length : reuse->length;
+    size_t prefix = 0, suffix = 0;
     
-    while (current_token.type == TOKEN_MULT || current_token.type == TOKEN_DIV) {
-        TokenType op = current_token.type;
-        current_token = get_next_token();
-        Node *right = parse_factor();
-        
-        if (op == TOKEN_MULT) {
-            left = create_binary(NODE_MUL, left, right);
-        } else {
-            left = create_binary(NODE_DIV, left, right);
-        }
+    while (prefix < common && text[prefix] == reuse->text[prefix]) prefix++;
+    while (suffix < common - prefix &&
+           text[length - 1 - suffix] == reuse->text[reuse->length - 1 - suffix]) {
+        suffix++;
     }
-    
-    return left;
+    reuse->prefix = prefix;
+    reuse->suffix = length - suffix;
+    reuse->old_suffix = reuse->length - suffix;
+    reuse->next_count = 0;
 }
 
-/* factor = power */
-Node *parse_factor(void) {
-    return parse_power();
+static ParseGroup *reuse_push(ParseReuse *reuse, size_t start, size_t end, Node *node) {
+    ParseGroup *group;
+    
+    if (reuse->next_count == reuse->next_capacity) {
+        reuse->next_capacity = reuse->next_capacity ? 2 * reuse->next_capacity : 64;
+        reuse->next = (ParseGroup *)xrealloc(reuse->next, reuse->next_capacity * sizeof(ParseGroup));
+    }
+    group = &reuse->next[reuse->next_count++];
+    group->start = start;
+    group->end = end;
+    group->node = node;
+    return group;
 }
 
-/* power = primary ('^' power)? */
-Node *parse_power(void) {
-    Node *left = parse_primary();
+/* Nœud du groupe qui commence en start dans le nouveau texte, si ce groupe
+ * est entièrement dans le préfixe ou le suffixe commun; *end reçoit la
+ * position qui le suit. Le groupe et ceux qu'il contient sont reportés dans
+ * l'analyse en cours, décalés. */
+static Node *reuse_group(ParseReuse *reuse, size_t start, size_t *end) {
+    size_t old, lo = 0, hi = reuse->count;
+    const ParseGroup *group;
+    
+    if (start < reuse->prefix) {
+        old = start;
+    } else if (start >= reuse->suffix) {
+        old = start - reuse->suffix + reuse->old_suffix;
+    } else {
+        return NULL;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (reuse->groups[mid].start < old) lo = mid + 1; else hi = mid;
+    }
+    if (lo == reuse->count || reuse->groups[lo].start != old) return NULL;
+    group = &reuse->groups[lo];
+    if (start < reuse->prefix && group->end > reuse->prefix) return NULL;
     
-    if (current_token.type == TOKEN_POW) {
-        current_token = get_next_token();
-        Node *right = parse_power();
-        left = create_binary(NODE_POW, left, right);
+    *end = group->end - old + start;
+    for (hi = lo; hi < reuse->count && reuse->groups[hi].start < group->end; hi++) {
+        reuse_push(reuse, reuse->groups[hi].start - old + start, reuse->groups[hi].end - old + start,
+                   reuse->groups[hi].node);
     }
+    return group->node;
+}
+
+/* Analyse réussie: ses groupes et son texte servent à la suivante */
+static void reuse_commit(ParseReuse *reuse, const char *text) {
+    ParseGroup *groups = reuse->groups;
+    size_t capacity = reuse->capacity;
+    size_t length = expression_length(text);
     
-    return left;
+    reuse->groups = reuse->next;
+    reuse->count = reuse->next_count;
+    reuse->capacity = reuse->next_capacity;
+    reuse->next = groups;
+    reuse->next_count = 0;
+    reuse->next_capacity = capacity;
+    
+    if (length > reuse->text_capacity) {
+        reuse->text_capacity = length;
+        reuse->text = (char *)xrealloc(reuse->text, length);
+    }
+    memcpy(reuse->text, text, length);
+    reuse->length = length;
+}
+
+/* Oublie l'analyse précédente (ses nœuds ne sont plus valides) */
+void parse_reuse_clear(ParseReuse *reuse) {
+    reuse->length = 0;
+    reuse->count = 0;
+    reuse->next_count = 0;
 }
 
-/* primary = NUMBER | VARIABLE | function '(' expression ')' | '(' expression ')' */
-Node *parse_primary(void) {
-    Node *node = NULL;
+void parse_reuse_free(ParseReuse *reuse) {
+    free(reuse->text);
+    free(reuse->groups);
+    free(reuse->next);
+    memset(reuse, 0, sizeof(*reuse));
+}
+
+Node *parse_string(Parser *p, const char *text) {
+    return parse_incremental(p, text, NULL);
+}
+
+/* Analyse une expression complète. Renvoie NULL en cas d'erreur, le message
+ * étant alors disponible dans p->error.
+ *
+ * Analyse par précédence d'opérateurs (shunting-yard) avec des piles
+ * explicites, pour la grammaire:
+ *   expression = term (('+' | '-') term)*
+ *   term       = power (('*' | '/') power)*
+ *   power      = primary ('^' power)?
+ *   primary    = NUMBER | VARIABLE | function '(' expression ')' | '(' expression ')'
+ * Les parenthèses ouvertes et les fonctions en attente restent sur la pile
+ * des opérateurs comme marques de groupe. Avec reuse (NULL sinon), les
+ * groupes inchangés depuis l'analyse précédente sont repris sans analyse. */
+Node *parse_incremental(Parser *p, const char *text, ParseReuse *reuse) {
+    WorkStack operators, operands;
+    Node *tree = NULL;
+    int expect_operand = 1;
     
-    if (current_token.type == TOKEN_NUMBER) {
-        node = create_number(current_token.value);
-        current_token = get_next_token();
-    } else if (current_token.type == TOKEN_VARIABLE) {
-        node = create_variable(current_token.variable);
-        current_token = get_next_token();
-    } else if (current_token.type == TOKEN_SIN || current_token.type == TOKEN_COS ||
-               current_token.type == TOKEN_EXP || current_token.type == TOKEN_LN) {
-        TokenType func = current_token.type;
-        current_token = get_next_token();
+    p->input = text;
+    p->pos = 0;
+    p->error = NULL;
+    if (reuse != NULL) reuse_begin(reuse, text);
+    p->current_token = get_next_token(p);
+    work_init(&operators);
+    work_init(&operands);
+    
+    for (;;) {
+        TokenType type = p->current_token.type;
         
-        if (current_token.type != TOKEN_LPAREN) {
-            fprintf(stderr, "Erreur: '(' attendu après fonction\n");
-            exit(1);
+        if (expect_operand) {
+            size_t start = p->token_start;
+            Node *group;
+            
+            if (reuse != NULL && (type == TOKEN_LPAREN || is_function_token(type)) &&
+                (group = reuse_group(reuse, start, &p->pos)) != NULL) {
+                work_push(&operands, group, 0);
+                expect_operand = 0;
+            } else if (type == TOKEN_NUMBER) {
+                work_push(&operands, create_number(p->current_token.value), 0);
+                expect_operand = 0;
+            } else if (type == TOKEN_VARIABLE) {
+                work_push(&operands, create_variable(p->current_token.symbol), 0);
+                expect_operand = 0;
+            } else if (is_function_token(type)) {
+                p->current_token = get_next_token(p);
+                if (p->current_token.type != TOKEN_LPAREN) {
+                    parse_fail(p, "Erreur: '(' attendu après fonction");
+                    break;
+                }
+                work_push(&operators, NULL, type)->aux.index =
+                    reuse != NULL ? (uint32_t)(reuse_push(reuse, start, 0, NULL) - reuse->next) : 0;
+            } else if (type == TOKEN_LPAREN) {
+                work_push(&operators, NULL, type)->aux.index =
+                    reuse != NULL ? (uint32_t)(reuse_push(reuse, start, 0, NULL) - reuse->next) : 0;
+            } else {
+                parse_fail(p, "Erreur de syntaxe");
+                break;
+            }
+            p->current_token = get_next_token(p);
+            continue;
         }
-        current_token = get_next_token();
         
-        Node *arg = parse_expression();
+        if (precedence(type) > 0) {
+            /* '+', '-', '*', '/' associent à gauche, '^' à droite */
+            while (operators.count > 0) {
+                int top = precedence((TokenType)operators.items[operators.count - 1].state);
+                if (top < precedence(type) || (top == precedence(type) && type == TOKEN_POW)) break;
+                reduce_operator(&operators, &operands);
+            }
+            work_push(&operators, NULL, type);
+            expect_operand = 1;
+            p->current_token = get_next_token(p);
+            continue;
+        }
         
-        if (current_token.type != TOKEN_RPAREN) {
-            fprintf(stderr, "Erreur: ')' attendu\n");
-            exit(1);
+        /* Fin d'un groupe ou de l'expression: réduire jusqu'à la marque */
+        while (operators.count > 0 &&
+               precedence((TokenType)operators.items[operators.count - 1].state) > 0) {
+            reduce_operator(&operators, &operands);
         }
-        current_token = get_next_token();
         
-        if (func == TOKEN_SIN) {
-            node = create_unary(NODE_SIN, arg);
-        } else if (func == TOKEN_COS) {
-            node = create_unary(NODE_COS, arg);
-        } else if (func == TOKEN_EXP) {
-            node = create_unary(NODE_EXP, arg);
-        } else if (func == TOKEN_LN) {
-            node = create_unary(NODE_LN, arg);
+        if (operators.count == 0) {
+            if (type == TOKEN_END) {
+                tree = operands.items[0].node;
+            } else {
+                parse_fail(p, "Erreur: caractères inattendus à la fin");
+            }
+            break;
+        }
+        if (type != TOKEN_RPAREN) {
+            parse_fail(p, "Erreur: ')' attendu");
+            break;
         }
-    } else if (current_token.type == TOKEN_LPAREN) {
-        current_token = get_next_token();
-        node = parse_expression();
         
-        if (current_token.type != TOKEN_RPAREN) {
-            fprintf(stderr, "Erreur: ')' attendu\n");
-            exit(1);
+        type = (TokenType)operators.items[--operators.count].state;
+        if (type != TOKEN_LPAREN) {
+            Node **arg = &operands.items[operands.count - 1].node;
+            *arg = create_unary(token_node_type(type), *arg);
         }
-        current_token = get_next_token();
-    } else {
-        fprintf(stderr, "Erreur de syntaxe\n");
-        exit(1);
+        if (reuse != NULL) {
+            ParseGroup *group = &reuse->next[operators.items[operators.count].aux.index];
+            group->end = p->pos;
+            group->node = operands.items[operands.count - 1].node;
+        }
+        p->current_token = get_next_token(p);
     }
     
-    return node;
+    if (reuse != NULL && tree != NULL) reuse_commit(reuse, text);
+    work_free(&operators);
+    work_free(&operands);
+    return tree;
 }
 
-/* === GESTION DES NŒUDS === */
+/* === TABLES DE HACHAGE === */
 
-Node *create_node(NodeType type) {
-    Node *node = (Node *)malloc(sizeof(Node));
-    node->type = type;
-    node->value = 0;
-    node->variable = 0;
-    node->left = NULL;
-    node->right = NULL;
-    return node;
+static uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
 }
 
-Node *create_number(double value) {
-    Node *node = create_node(NODE_NUMBER);
-    node->value = value;
-    return node;
+/* Finaliseur de splitmix64: chaque bit d'entrée change la moitié des bits
+ * de sortie. hash_mix seul laisse des empreintes voisines pour des fils
+ * voisins, d'où de longues grappes de sondage après le masquage. */
+static uint64_t hash_finish(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
 }
 
-Node *create_variable(char var) {
-    Node *node = create_node(NODE_VARIABLE);
-    node->variable = var;
-    return node;
+static uint64_t hash_pointer(const void *p) {
+    uint64_t h = (uint64_t)(uintptr_t)p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-Node *create_binary(NodeType type, Node *left, Node *right) {
-    Node *node = create_node(type);
-    node->left = left;
-    node->right = right;
-    return node;
-}
+/* Reprise d'un appel de la bibliothèque en cas d'erreur fatale (NULL hors
+ * bibliothèque: l'erreur termine le programme) */
+static __thread jmp_buf *fatal_jump;
+static __thread const char *fatal_message;
 
-Node *create_unary(NodeType type, Node *child) {
-    Node *node = create_node(type);
-    node->left = child;
-    return node;
+static void fatal(const char *message) {
+    if (fatal_jump != NULL) {
+        fatal_message = message;
+        longjmp(*fatal_jump, 1);
+    }
+    fprintf(stderr, "%s\n", message);
+    exit(1);
 }
 
-void free_tree(Node *node) {
-    if (node == NULL) return;
-    free_tree(node->left);
-    free_tree(node->right);
-    free(node);
+static void *xcalloc(size_t count, size_t size) {
+    void *p = calloc(count, size);
+    if (p == NULL) fatal("Erreur: mémoire insuffisante");
+    return p;
 }
 
-Node *copy_tree(Node *node) {
-    if (node == NULL) return NULL;
-    
-    Node *copy = create_node(node->type);
-    copy->value = node->value;
-    copy->variable = node->variable;
-    copy->left = copy_tree(node->left);
-    copy->right = copy_tree(node->right);
-    
-    return copy;
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) fatal("Erreur: mémoire insuffisante");
+    return p;
 }
 
-/* === AFFICHAGE === */
-
-void print_tree(Node *node) {
-    if (node == NULL) return;
-    
-    switch (node->type) {
-        case NODE_NUMBER:
-            if (node->value == (int)node->value) {
-                printf("%d", (int)node->value);
-            } else {
-                printf("%.2f", node->value);
-            }
-            break;
-            
-        case NODE_VARIABLE:
-            printf("%c", node->variable);
-            break;
-            
-        case NODE_ADD:
-            print_tree(node->left);
-            printf("+");
-            print_tree(node->right);
-            break;
-            
-        case NODE_SUB:
-            print_tree(node->left);
-            printf("-");
-            if (node->right->type == NODE_ADD || node->right->type == NODE_SUB) {
-                printf("(");
-                print_tree(node->right);
-                printf(")");
-            } else {
-                print_tree(node->right);
-            }
-            break;
-            
-        case NODE_MUL:
-            if (node->left->type == NODE_ADD || node->left->type == NODE_SUB) {
-                printf("(");
-                print_tree(node->left);
-                printf(")");
-            } else {
-                print_tree(node->left);
-            }
-            printf("*");
-            if (node->right->type == NODE_ADD || node->right->type == NODE_SUB) {
-                printf("(");
-                print_tree(node->right);
-                printf(")");
-            } else {
-                print_tree(node->right);
-            }
-            break;
-            
-        case NODE_DIV:
-            if (node->left->type == NODE_ADD || node->left->type == NODE_SUB) {
-                printf("(");
-                print_tree(node->left);
-                printf(")");
-            } else {
-                print_tree(node->left);
-            }
-            printf("/");
-            if (node->right->type != NODE_NUMBER && node->right->type != NODE_VARIABLE) {
-                printf("(");
-                print_tree(node->right);
-                printf(")");
-            } else {
-                print_tree(node->right);
-            }
-            break;
-            
-        case NODE_POW:
-            if (node->left->type != NODE_NUMBER && node->left->type != NODE_VARIABLE) {
-                printf("(");
-                print_tree(node->left);
-                printf(")");
-            } else {
-                print_tree(node->left);
-            }
-            printf("^");
-            if (node->right->type != NODE_NUMBER && node->right->type != NODE_VARIABLE) {
-                printf("(");
-                print_tree(node->right);
-                printf(")");
-            } else {
-                print_tree(node->right);
-            }
-            break;
-            
-        case NODE_SIN:
-            printf("sin(");
-            print_tree(node->left);
-            printf(")");
-            break;
-            
-        case NODE_COS:
-            printf("cos(");
-            print_tree(node->left);
-            printf(")");
-            break;
-            
-        case NODE_EXP:
-            printf("exp(");
-            print_tree(node->left);
-            printf(")");
-            break;
-            
-        case NODE_LN:
-            printf("ln(");
-            print_tree(node->left);
-            printf(")");
-            break;
+static void node_map_clear(NodeMap *map) {
+    if (map->keys != NULL) {
+        memset(map->keys, 0, map->capacity * sizeof(Node *));
     }
+    map->count = 0;
 }
 
-/* === UTILITAIRES === */
-
-int is_zero(Node *node) {
-    return node != NULL && node->type == NODE_NUMBER && node->value == 0;
+static void node_map_free(NodeMap *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(*map));
 }
 
-int is_one(Node *node) {
-    return node != NULL && node->type == NODE_NUMBER && node->value == 1;
+static Node *node_map_get(const NodeMap *map, const Node *key) {
+    size_t i;
+    if (map->count == 0) return NULL;
+    for (i = hash_pointer(key) & (map->capacity - 1); map->keys[i] != NULL;
+         i = (i + 1) & (map->capacity - 1)) {
+        if (map->keys[i] == key) return map->values[i];
+    }
+    return NULL;
 }
 
-int is_constant(Node *node, char var) {
-    if (node == NULL) return 1;
+static void node_map_put(NodeMap *map, Node *key, Node *value) {
+    size_t i;
     
-    if (node->type == NODE_NUMBER) return 1;
-    if (node->type == NODE_VARIABLE) return node->variable != var;
+    if (2 * (map->count + 1) > map->capacity) {
+        NodeMap bigger;
+        size_t j;
+        
+        bigger.capacity = map->capacity ? 2 * map->capacity : 64;
+        bigger.count = 0;
+        bigger.keys = (Node **)xcalloc(bigger.capacity, sizeof(Node *));
+        bigger.values = (Node **)xcalloc(bigger.capacity, sizeof(Node *));
+        for (j = 0; j < map->capacity; j++) {
+            if (map->keys[j] != NULL) node_map_put(&bigger, map->keys[j], map->values[j]);
+        }
+        node_map_free(map);
+        *map = bigger;
+    }
     
-    return is_constant(node->left, var) && is_constant(node->right, var);
+    for (i = hash_pointer(key) & (map->capacity - 1); map->keys[i] != NULL;
+         i = (i + 1) & (map->capacity - 1)) {
+        if (map->keys[i] == key) {
+            map->values[i] = value;
+            return;
+        }
+    }
+    map->keys[i] = key;
+    map->values[i] = value;
+    map->count++;
 }
 
-/* === DÉRIVATION === */
+static void diff_cache_clear(DiffCache *cache) {
+    if (cache->entries != NULL) {
+        memset(cache->entries, 0, cache->capacity * sizeof(DiffEntry));
+    }
+    cache->count = 0;
+}
 
-Node *differentiate(Node *node, char var) {
-    if (node == NULL) return NULL;
+/* === SYMBOLES === */
+
+/* Noms des variables de plusieurs lettres. La table partagée sert à tous les
+ * threads: l'insertion se fait sous verrou, et les noms sont rangés dans des
+ * pages qui ne bougent plus, si bien que symbol_text() les lit sans verrou
+ * (le symbole lu ayant été obtenu par symbol_intern(), dont le verrou ordonne
+ * les écritures). Une arène peut avoir sa propre table (voir Arena.symbols):
+ * un seul thread s'en sert, et ses noms disparaissent avec les nœuds. */
+#define SYMBOL_PAGE  1024          // Noms par page
+#define SYMBOL_PAGES 16384         // Pages au plus (16 M de noms)
+
+typedef struct SymbolTable {
+    char **pages[SYMBOL_PAGES];    // Nom du symbole SYMBOL_FIRST + i: pages[i / SYMBOL_PAGE]
+    Symbol *table;                 // Table d'unicité (0 = case libre)
+    size_t capacity;               // Puissance de deux
+    size_t count;                  // Noms internés
+} SymbolTable;
+
+static SymbolTable symbols;
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Table de l'arène courante, sinon table partagée */
+static SymbolTable *symbol_table(void) {
+    return current_arena->symbols != NULL ? current_arena->symbols : &symbols;
+}
+
+static void symbol_lock_table(SymbolTable *table) {
+    if (table == &symbols) pthread_mutex_lock(&symbol_lock);
+}
+
+static void symbol_unlock_table(SymbolTable *table) {
+    if (table == &symbols) pthread_mutex_unlock(&symbol_lock);
+}
+
+static uint32_t symbol_hash(const char *name, size_t length) {
+    uint32_t h = 2166136261u;
+    size_t i;
     
-    switch (node->type) {
-        case NODE_NUMBER:
-            /* d/dx(c) = 0 */
-            return create_number(0);
+    for (i = 0; i < length; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static const char *table_name(const SymbolTable *table, Symbol symbol) {
+    size_t i = symbol - SYMBOL_FIRST;
+    return table->pages[i / SYMBOL_PAGE][i % SYMBOL_PAGE];
+}
+
+/* Nom d'un symbole de la table courante (symbol >= SYMBOL_FIRST) */
+static const char *symbol_name(Symbol symbol) {
+    return table_name(symbol_table(), symbol);
+}
+
+/* Allocation sous le verrou de table: il est rendu avant une erreur fatale */
+static void *symbol_alloc(SymbolTable *table, size_t count, size_t size) {
+    void *p = calloc(count, size);
+    if (p == NULL) {
+        symbol_unlock_table(table);
+        fatal("Erreur: mémoire insuffisante");
+    }
+    return p;
+}
+
+static void symbol_grow(SymbolTable *names) {
+    size_t capacity = names->capacity ? 2 * names->capacity : 256;
+    Symbol *table = (Symbol *)symbol_alloc(names, capacity, sizeof(Symbol));
+    size_t i, j;
+    
+    for (i = 0; i < names->capacity; i++) {
+        const char *name;
+        
+        if (names->table[i] == 0) continue;
+        name = table_name(names, names->table[i]);
+        for (j = symbol_hash(name, strlen(name)) & (capacity - 1); table[j] != 0;
+             j = (j + 1) & (capacity - 1)) {
+        }
+        table[j] = names->table[i];
+    }
+    free(names->table);
+    names->table = table;
+    names->capacity = capacity;
+}
+
+/* Oublie tous les noms d'une table (les symboles attribués deviennent
+ * invalides) */
+static void symbol_table_clear(SymbolTable *names) {
+    size_t page;
+    
+    for (page = 0; page * SYMBOL_PAGE < names->count; page++) {
+        size_t i, end = names->count - page * SYMBOL_PAGE;
+        
+        if (end > SYMBOL_PAGE) end = SYMBOL_PAGE;
+        for (i = 0; i < end; i++) free(names->pages[page][i]);
+        free(names->pages[page]);
+        names->pages[page] = NULL;
+    }
+    free(names->table);
+    names->table = NULL;
+    names->capacity = 0;
+    names->count = 0;
+}
+
+/* Symbole du nom name[0..length): un nom d'une lettre est son propre code,
+ * un nom plus long est interné dans la table de l'arène courante (même nom,
+ * même symbole) */
+Symbol symbol_intern(const char *name, size_t length) {
+    SymbolTable *names;
+    Symbol symbol;
+    size_t i;
+    
+    if (length == 1) return (unsigned char)name[0];
+    
+    names = symbol_table();
+    symbol_lock_table(names);
+    if (2 * (names->count + 1) > names->capacity) symbol_grow(names);
+    for (i = symbol_hash(name, length) & (names->capacity - 1); (symbol = names->table[i]) != 0;
+         i = (i + 1) & (names->capacity - 1)) {
+        const char *other = table_name(names, symbol);
+        if (strncmp(other, name, length) == 0 && other[length] == '\0') break;
+    }
+    if (symbol == 0) {
+        size_t index = names->count;
+        char *copy;
+        
+        if (index == (size_t)SYMBOL_PAGE * SYMBOL_PAGES) {
+            symbol_unlock_table(names);
+            fatal("Erreur: trop de variables distinctes");
+        }
+        if (names->pages[index / SYMBOL_PAGE] == NULL) {
+            names->pages[index / SYMBOL_PAGE] = (char **)symbol_alloc(names, SYMBOL_PAGE, sizeof(char *));
+        }
+        copy = (char *)symbol_alloc(names, length + 1, 1);
+        memcpy(copy, name, length);
+        names->pages[index / SYMBOL_PAGE][index % SYMBOL_PAGE] = copy;
+        symbol = (Symbol)(SYMBOL_FIRST + index);
+        names->table[i] = symbol;
+        names->count++;
+    }
+    symbol_unlock_table(names);
+    return symbol;
+}
+
+/* Nom de la variable; letter sert de stockage pour un nom d'une lettre */
+const char *symbol_text(Symbol symbol, char letter[2]) {
+    if (symbol >= SYMBOL_FIRST) return symbol_name(symbol);
+    letter[0] = (char)symbol;
+    letter[1] = '\0';
+    return letter;
+}
+
+/* Nombre de symboles attribués: tout symbole existant est inférieur */
+size_t symbol_count(void) {
+    SymbolTable *names = symbol_table();
+    size_t count;
+    
+    symbol_lock_table(names);
+    count = SYMBOL_FIRST + names->count;
+    symbol_unlock_table(names);
+    return count;
+}
+
+/* Ordre alphabétique des noms (indépendant de l'ordre d'internement) */
+int symbol_compare(Symbol a, Symbol b) {
+    char letter_a[2], letter_b[2];
+    
+    if (a < SYMBOL_FIRST && b < SYMBOL_FIRST) return (int)a - (int)b;
+    return strcmp(symbol_text(a, letter_a), symbol_text(b, letter_b));
+}
+
+/* === PILES DE TRAVAIL === */
+
+static void work_init(WorkStack *stack) {
+    stack->items = stack->local;
+    stack->count = 0;
+    stack->capacity = WORK_STACK_LOCAL;
+}
+
+static void work_free(WorkStack *stack) {
+    if (stack->items != stack->local) free(stack->items);
+}
+
+static void work_grow(WorkStack *stack) {
+    WorkItem *items = (WorkItem *)xrealloc(stack->items == stack->local ? NULL : stack->items,
+                                           2 * stack->capacity * sizeof(WorkItem));
+    if (stack->items == stack->local) memcpy(items, stack->local, sizeof(stack->local));
+    stack->items = items;
+    stack->capacity *= 2;
+}
+
+/* Empile un élément et le renvoie (pour renseigner aux) */
+static inline WorkItem *work_push(WorkStack *stack, Node *node, int state) {
+    WorkItem *item;
+    
+    if (stack->count == stack->capacity) work_grow(stack);
+    item = &stack->items[stack->count++];
+    item->node = node;
+    item->state = state;
+    return item;
+}
+
+static inline WorkItem work_pop(WorkStack *stack) {
+    return stack->items[--stack->count];
+}
+
+/* === ARÈNE === */
+
+void arena_init(Arena *arena) {
+    memset(arena, 0, sizeof(*arena));
+}
+
+/* Rend tous les nœuds de l'arène d'un coup; les blocs sont conservés */
+void arena_reset(Arena *arena) {
+    ArenaChunk *chunk;
+    for (chunk = arena->head; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->head;
+    arena->free_list = NULL;
+    arena->stats.nodes = 0;
+    
+    if (arena->intern != NULL) {
+        memset(arena->intern, 0, arena->intern_capacity * sizeof(Node *));
+    }
+    arena->intern_count = 0;
+    node_map_clear(&arena->simplified);
+    diff_cache_clear(&arena->diff_cache);
+    flat_clear(&arena->flat[0]);
+    flat_clear(&arena->flat[1]);
+    if (arena->symbols != NULL) symbol_table_clear(arena->symbols);
+}
+
+void arena_destroy(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    int hash_consing = arena->hash_consing;
+    
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->intern);
+    node_map_free(&arena->simplified);
+    free(arena->diff_cache.entries);
+    flat_free(&arena->flat[0]);
+    flat_free(&arena->flat[1]);
+    if (arena->symbols != NULL) {
+        symbol_table_clear(arena->symbols);
+        free(arena->symbols);
+    }
+    arena_init(arena);
+    arena->hash_consing = hash_consing;
+}
+
+/* Active le partage des sous-expressions identiques (à faire sur une arène vide) */
+void arena_set_hash_consing(Arena *arena, int enabled) {
+    arena->hash_consing = enabled;
+}
+
+/* Change l'arène courante et renvoie la précédente */
+Arena *arena_use(Arena *arena) {
+    Arena *previous = current_arena;
+    current_arena = arena;
+    return previous;
+}
+
+static Node *arena_alloc(Arena *arena) {
+    Node *node;
+    
+    if (arena->free_list != NULL) {
+        node = arena->free_list;
+        arena->free_list = node->left;
+    } else {
+        ArenaChunk *chunk = arena->current;
+        
+        /* Passer au bloc suivant (déjà réservé) ou en créer un nouveau */
+        while (chunk != NULL && chunk->used == chunk->capacity) {
+            chunk = chunk->next;
+        }
+        if (chunk == NULL) {
+            size_t capacity = ARENA_FIRST_CHUNK;
+            ArenaChunk *last = arena->head;
             
-        case NODE_VARIABLE:
-            /* d/dx(x) = 1, d/dx(y) = 0 */
-            if (node->variable == var) {
-                return create_number(1);
-            } else {
-                return create_number(0);
+            while (last != NULL && last->next != NULL) {
+                last = last->next;
+            }
+            if (last != NULL) {
+                capacity = last->capacity * 2;
+                if (capacity > ARENA_MAX_CHUNK) capacity = ARENA_MAX_CHUNK;
             }
             
-        case NODE_ADD:
-            /* d/dx(f + g) = f' + g' */
-            return create_binary(NODE_ADD,
-                                differentiate(node->left, var),
-                                differentiate(node->right, var));
-            
-        case NODE_SUB:
-            /* d/dx(f - g) = f' - g' */
-            return create_binary(NODE_SUB,
-                                differentiate(node->left, var),
-                                differentiate(node->right, var));
-            
-        case NODE_MUL:
-            /* d/dx(f * g) = f' * g + f * g' */
-            return create_binary(NODE_ADD,
-                                create_binary(NODE_MUL,
-                                             differentiate(node->left, var),
-                                             copy_tree(node->right)),
-                                create_binary(NODE_MUL,
-                                             copy_tree(node->left),
-                                             differentiate(node->right, var)));
-            
-        case NODE_DIV:
-            /* d/dx(f / g) = (f' * g - f * g') / g^2 */
-            return create_binary(NODE_DIV,
-                                create_binary(NODE_SUB,
-                                             create_binary(NODE_MUL,
-                                                          differentiate(node->left, var),
-                                                          copy_tree(node->right)),
-                                             create_binary(NODE_MUL,
-                                                          copy_tree(node->left),
-                                                          differentiate(node->right, var))),
-                                create_binary(NODE_POW,
-                                             copy_tree(node->right),
-                                             create_number(2)));
-            
-        case NODE_POW:
-            /* d/dx(f^n) = n * f^(n-1) * f' (si n est constant) */
-            if (is_constant(node->right, var)) {
-                return create_binary(NODE_MUL,
-                                    create_binary(NODE_MUL,
-                                                 copy_tree(node->right),
-                                                 create_binary(NODE_POW,
-                                                              copy_tree(node->left),
-                                                              create_binary(NODE_SUB,
-                                                                           copy_tree(node->right),
-                                                                           create_number(1)))),
-                                    differentiate(node->left, var));
+            chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + capacity * sizeof(Node));
+            if (chunk == NULL) fatal("Erreur: mémoire insuffisante");
+            chunk->next = NULL;
+            chunk->capacity = capacity;
+            chunk->used = 0;
+            if (last != NULL) {
+                last->next = chunk;
             } else {
-                /* Cas général: d/dx(f^g) = f^g * (g' * ln(f) + g * f'/f) */
-                return create_binary(NODE_MUL,
-                                    copy_tree(node),
-                                    create_binary(NODE_ADD,
-                                                 create_binary(NODE_MUL,
-                                                              differentiate(node->right, var),
-                                                              create_unary(NODE_LN, copy_tree(node->left))),
-                                                 create_binary(NODE_MUL,
-                                                              copy_tree(node->right),
-                                                              create_binary(NODE_DIV,
-                                                                           differentiate(node->left, var),
-                                                                           copy_tree(node->left)))));
+                arena->head = chunk;
             }
-            
-        case NODE_SIN:
-            /* d/dx(sin(f)) = cos(f) * f' */
-            return create_binary(NODE_MUL,
-                                create_unary(NODE_COS, copy_tree(node->left)),
-                                differentiate(node->left, var));
-            
-        case NODE_COS:
-            /* d/dx(cos(f)) = -sin(f) * f' */
-            return create_binary(NODE_MUL,
-                                create_binary(NODE_MUL,
-                                             create_number(-1),
-                                             create_unary(NODE_SIN, copy_tree(node->left))),
-                                differentiate(node->left, var));
-            
-        case NODE_EXP:
-            /* d/dx(exp(f)) = exp(f) * f' */
-            return create_binary(NODE_MUL,
-                                create_unary(NODE_EXP, copy_tree(node->left)),
-                                differentiate(node->left, var));
-            
-        case NODE_LN:
-            /* d/dx(ln(f)) = f' / f */
-            return create_binary(NODE_DIV,
-                                differentiate(node->left, var),
-                                copy_tree(node->left));
+            arena->stats.bytes += sizeof(ArenaChunk) + capacity * sizeof(Node);
+        }
+        arena->current = chunk;
+        node = &chunk->nodes[chunk->used++];
+    }
+    
+    arena->stats.allocs++;
+    if (++arena->stats.nodes > arena->stats.high_water) {
+        arena->stats.high_water = arena->stats.nodes;
+    }
+    return node;
+}
+
+/* Rend un nœud isolé à l'arène courante (ses fils ne sont pas touchés) */
+void release_node(Node *node) {
+    /* En mode DAG un nœud peut être partagé: il vit jusqu'au reset */
+    if (node == NULL || current_arena->hash_consing) return;
+    node->left = current_arena->free_list;
+    current_arena->free_list = node;
+    current_arena->stats.nodes--;
+    current_arena->stats.released++;
+}
+
+/* === UNICITÉ DES NŒUDS (HASH-CONSING) === */
+
+static uint64_t hash_fields(NodeType type, double value, Symbol variable,
+                            const Node *left, const Node *right) {
+    uint64_t bits;
+    uint64_t h = (uint64_t)type;
+    
+    memcpy(&bits, &value, sizeof(bits));
+    h = hash_mix(h, bits);
+    h = hash_mix(h, (uint64_t)variable);
+    h = hash_mix(h, hash_pointer(left));
+    h = hash_mix(h, hash_pointer(right));
+    return hash_finish(h);
+}
+
+static int same_fields(const Node *node, NodeType type, double value, Symbol variable,
+                       const Node *left, const Node *right) {
+    return node->type == type && memcmp(&node->value, &value, sizeof(value)) == 0 &&
+           node->variable == variable && node->left == left && node->right == right;
+}
+
+static void intern_grow(Arena *arena) {
+    Node **old = arena->intern;
+    size_t old_capacity = arena->intern_capacity;
+    size_t i;
+    
+    arena->intern_capacity = old_capacity ? 2 * old_capacity : 1024;
+    arena->intern = (Node **)xcalloc(arena->intern_capacity, sizeof(Node *));
+    for (i = 0; i < old_capacity; i++) {
+        Node *node = old[i];
+        size_t j;
+        
+        if (node == NULL) continue;
+        j = hash_fields(node->type, node->value, node->variable, node->left, node->right) &
+            (arena->intern_capacity - 1);
+        while (arena->intern[j] != NULL) {
+            j = (j + 1) & (arena->intern_capacity - 1);
+        }
+        arena->intern[j] = node;
+    }
+    free(old);
+}
+
+/* Renvoie l'unique nœud ayant ces champs, en le créant si nécessaire */
+static Node *intern_node(NodeType type, double value, Symbol variable, Node *left, Node *right) {
+    Arena *arena = current_arena;
+    Node *node;
+    size_t i;
+    
+    if (2 * (arena->intern_count + 1) > arena->intern_capacity) {
+        intern_grow(arena);
+    }
+    
+    i = hash_fields(type, value, variable, left, right) & (arena->intern_capacity - 1);
+    while (arena->intern[i] != NULL) {
+        if (same_fields(arena->intern[i], type, value, variable, left, right)) {
+            arena->stats.shared++;
+            return arena->intern[i];
+        }
+        i = (i + 1) & (arena->intern_capacity - 1);
+    }
+    
+    node = create_node(type);
+    node->value = value;
+    node->variable = variable;
+    node->left = left;
+    node->right = right;
+    arena->intern[i] = node;
+    arena->intern_count++;
+    return node;
+}
+
+/* === GESTION DES NŒUDS === */
+
+Node *create_node(NodeType type) {
+    Node *node = arena_alloc(current_arena);
+    node->type = type;
+    node->value = 0;
+    node->variable = 0;
+    node->left = NULL;
+    node->right = NULL;
+    return node;
+}
+
+Node *create_number(double value) {
+    if (current_arena->hash_consing) return intern_node(NODE_NUMBER, value, 0, NULL, NULL);
+    
+    Node *node = create_node(NODE_NUMBER);
+    node->value = value;
+    return node;
+}
+
+Node *create_variable(Symbol var) {
+    if (current_arena->hash_consing) return intern_node(NODE_VARIABLE, 0, var, NULL, NULL);
+    
+    Node *node = create_node(NODE_VARIABLE);
+    node->variable = var;
+    return node;
+}
+
+Node *create_binary(NodeType type, Node *left, Node *right) {
+    if (current_arena->hash_consing) return intern_node(type, 0, 0, left, right);
+    
+    Node *node = create_node(type);
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+Node *create_unary(NodeType type, Node *child) {
+    if (current_arena->hash_consing) return intern_node(type, 0, 0, child, NULL);
+    
+    Node *node = create_node(type);
+    node->left = child;
+    return node;
+}
+
+void free_tree(Node *node) {
+    WorkStack stack;
+    
+    /* En mode DAG les nœuds sont partagés et libérés par arena_reset() */
+    if (node == NULL || current_arena->hash_consing) return;
+    if (node->left == NULL) {
+        release_node(node);
+        return;
+    }
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        Node *children[2];
+        int i;
+        
+        node = work_pop(&stack).node;
+        children[0] = node->left;
+        children[1] = node->right;
+        release_node(node);
+        
+        /* Les feuilles sont rendues sans passer par la pile */
+        for (i = 0; i < 2; i++) {
+            if (children[i] == NULL) continue;
+            if (children[i]->left == NULL) {
+                release_node(children[i]);
+            } else {
+                work_push(&stack, children[i], 0);
+            }
+        }
+    }
+    work_free(&stack);
+}
+
+static Node *copy_node(const Node *node) {
+    Node *copy = create_node(node->type);
+    copy->value = node->value;
+    copy->variable = node->variable;
+    return copy;
+}
+
+Node *copy_tree(Node *node) {
+    WorkStack stack;
+    Node *root;
+    
+    if (node == NULL) return NULL;
+    current_arena->stats.copies++;
+    
+    /* En mode DAG les nœuds sont immuables: on partage au lieu de copier */
+    if (current_arena->hash_consing) return node;
+    
+    root = copy_node(node);
+    if (node->left == NULL) return root;
+    
+    /* Chaque nœud interne est copié avant d'être empilé, ses fils après:
+     * seuls les nœuds internes passent par la pile */
+    work_init(&stack);
+    work_push(&stack, node, 0)->aux.other = root;
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        Node *copy = item.aux.other;
+        
+        copy->left = copy_node(item.node->left);
+        if (item.node->left->left != NULL) work_push(&stack, item.node->left, 0)->aux.other = copy->left;
+        if (item.node->right != NULL) {
+            copy->right = copy_node(item.node->right);
+            if (item.node->right->left != NULL) {
+                work_push(&stack, item.node->right, 0)->aux.other = copy->right;
+            }
+        }
+    }
+    work_free(&stack);
+    
+    return root;
+}
+
+/* === TAMPONS DE TEXTE === */
+
+/* data peut être NULL: le tampon est alors alloué à la première écriture */
+void strbuf_init(StrBuf *buf, char *data, size_t capacity) {
+    buf->data = data;
+    buf->length = 0;
+    buf->capacity = data != NULL ? capacity : 0;
+    buf->owned = 0;
+    buf->measure = 0;
+}
+
+/* Tampon qui ne fait que compter: length donne la taille de la sortie */
+void strbuf_measure(StrBuf *buf) {
+    strbuf_init(buf, NULL, 0);
+    buf->measure = 1;
+}
+
+void strbuf_free(StrBuf *buf) {
+    if (buf->owned) free(buf->data);
+    strbuf_init(buf, NULL, 0);
+}
+
+void strbuf_write_to(const StrBuf *buf, FILE *out) {
+    if (!buf->measure && buf->length > 0) fwrite(buf->data, 1, buf->length, out);
+}
+
+/* Fait de la place pour extra octets; renvoie 0 en mode mesure */
+static int strbuf_grow(StrBuf *buf, size_t extra) {
+    size_t capacity = 2 * buf->capacity;
+    char *data;
+    
+    if (buf->measure) return 0;
+    if (capacity < buf->length + extra) capacity = buf->length + extra;
+    if (capacity < 256) capacity = 256;
+    data = (char *)xrealloc(buf->owned ? buf->data : NULL, capacity);
+    if (!buf->owned && buf->length > 0) memcpy(data, buf->data, buf->length);
+    buf->data = data;
+    buf->capacity = capacity;
+    buf->owned = 1;
+    return 1;
+}
+
+/* Réserve de quoi écrire size octets de plus sans réallocation */
+void strbuf_reserve(StrBuf *buf, size_t size) {
+    if (buf->length + size > buf->capacity) strbuf_grow(buf, size);
+}
+
+static inline void strbuf_putc(StrBuf *buf, int character) {
+    if (buf->length >= buf->capacity && !strbuf_grow(buf, 1)) {
+        buf->length++;
+        return;
+    }
+    buf->data[buf->length++] = (char)character;
+}
+
+static void strbuf_write(StrBuf *buf, const char *text, size_t length) {
+    if (buf->length + length > buf->capacity && !strbuf_grow(buf, length)) {
+        buf->length += length;
+        return;
+    }
+    memcpy(buf->data + buf->length, text, length);
+    buf->length += length;
+}
+
+static void strbuf_puts(StrBuf *buf, const char *text) {
+    strbuf_write(buf, text, strlen(text));
+}
+
+static void strbuf_uint(StrBuf *buf, uint64_t value) {
+    char digits[20];
+    size_t n = sizeof(digits);
+    
+    do {
+        digits[--n] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    strbuf_write(buf, digits + n, sizeof(digits) - n);
+}
+
+static void strbuf_symbol(StrBuf *buf, Symbol symbol) {
+    if (symbol < SYMBOL_FIRST) {
+        strbuf_putc(buf, (int)symbol);
+    } else {
+        strbuf_puts(buf, symbol_name(symbol));
+    }
+}
+
+/* Même texte que printf("%d") pour une valeur entière, "%.2f" sinon, sans
+ * passer par printf: les centièmes sont value * 100 arrondi. Le produit est
+ * exact à 2^-16 près sous 10^9; quand il tombe à moins de 10^-4 d'un
+ * demi-centième, ainsi que pour les grandes valeurs et les non-finis,
+ * snprintf tranche. */
+static void strbuf_number(StrBuf *buf, double value) {
+    double magnitude = fabs(value);
+    
+    if (value >= INT_MIN && value <= INT_MAX && value == (int)value) {
+        if (value < 0) strbuf_putc(buf, '-');
+        strbuf_uint(buf, (uint64_t)magnitude);
+        return;
+    }
+    if (magnitude < 1e9) {
+        double scaled = magnitude * 100.0;
+        double whole = floor(scaled);
+        double fraction = scaled - whole;
+        
+        if (fabs(fraction - 0.5) > 1e-4) {
+            uint64_t cents = (uint64_t)whole + (fraction > 0.5);
+            char decimals[3] = {'.', (char)('0' + cents / 10 % 10), (char)('0' + cents % 10)};
+            
+            if (signbit(value)) strbuf_putc(buf, '-');
+            strbuf_uint(buf, cents / 100);
+            strbuf_write(buf, decimals, sizeof(decimals));
+            return;
+        }
+    }
+    {
+        char text[320];    // "%.2f" de DBL_MAX: 309 chiffres, le signe et 3 décimales
+        int length = snprintf(text, sizeof(text), "%.2f", value);
+        
+        strbuf_write(buf, text, (size_t)length);
+    }
+}
+
+/* === AFFICHAGE === */
+
+void print_tree(Node *node) {
+    fprint_tree(stdout, node);
+}
+
+static void serialize_expr(StrBuf *buf, Node *node, const CseTable *cse);
+
+/* Numéro du temporaire qui nomme node (0 si aucun) */
+static uint32_t cse_id(const CseTable *cse, const Node *node);
+
+/* Type vu par le parent pour le parenthésage: un nœud nommé est une feuille */
+static NodeType print_type(const Node *node, const CseTable *cse) {
+    if (cse != NULL && cse_id(cse, node) != 0) return NODE_VARIABLE;
+    return node->type;
+}
+
+/* Ajoute node au tampon; renvoie le nombre d'octets ajoutés */
+size_t serialize_tree(StrBuf *buf, Node *node) {
+    size_t start = buf->length;
+    
+    serialize_expr(buf, node, NULL);
+    return buf->length - start;
+}
+
+/* Longueur du texte de node, sans l'écrire */
+size_t measure_tree(Node *node) {
+    StrBuf buf;
+    
+    strbuf_measure(&buf);
+    return serialize_tree(&buf, node);
+}
+
+/* Le texte est construit dans un tampon local (étendu sur le tas si besoin)
+ * puis écrit d'un seul fwrite */
+void fprint_tree(FILE *out, Node *node) {
+    char local[STRBUF_LOCAL];
+    StrBuf buf;
+    
+    strbuf_init(&buf, local, sizeof(local));
+    serialize_tree(&buf, node);
+    strbuf_write_to(&buf, out);
+    strbuf_free(&buf);
+}
+
+/* Éléments de la pile d'affichage */
+enum {
+    PRINT_CHAR,            // Caractère fixe (opérateur, parenthèse)
+    PRINT_OPERAND,         // Opérande: le nom de son temporaire, ou son expression
+    PRINT_PARENS,          // Opérande entre parenthèses
+    PRINT_EXPR             // Expression du nœud, même s'il est nommé
+};
+
+/* Empile un opérande, entre parenthèses si parens */
+static void push_operand(WorkStack *stack, Node *node, int parens) {
+    work_push(stack, node, parens ? PRINT_PARENS : PRINT_OPERAND);
+}
+
+/* Écrit une feuille (jamais nommée ni parenthésée) */
+static void print_leaf(StrBuf *buf, const Node *node) {
+    if (node->type == NODE_VARIABLE) {
+        strbuf_symbol(buf, node->variable);
+    } else {
+        strbuf_number(buf, node->value);
+    }
+}
+
+/* Parenthèses des opérandes d'un opérateur binaire, selon leurs types */
+static void operand_parens(NodeType type, NodeType left, NodeType right,
+                           int *parens_left, int *parens_right) {
+    switch (type) {
+        case NODE_ADD:
+            *parens_left = *parens_right = 0;
+            break;
+        case NODE_SUB:
+            *parens_left = 0;
+            *parens_right = right == NODE_ADD || right == NODE_SUB;
+            break;
+        case NODE_MUL:
+            *parens_left = left == NODE_ADD || left == NODE_SUB;
+            *parens_right = right == NODE_ADD || right == NODE_SUB;
+            break;
+        case NODE_DIV:
+            *parens_left = left == NODE_ADD || left == NODE_SUB;
+            *parens_right = right != NODE_NUMBER && right != NODE_VARIABLE;
+            break;
+        default:
+            *parens_left = left != NODE_NUMBER && left != NODE_VARIABLE;
+            *parens_right = right != NODE_NUMBER && right != NODE_VARIABLE;
+            break;
+    }
+}
+
+static void push_char(WorkStack *stack, int character) {
+    work_push(stack, NULL, PRINT_CHAR)->aux.character = character;
+}
+
+/* Écrit l'expression de gauche à droite: les éléments sont empilés dans
+ * l'ordre inverse de leur écriture */
+static void serialize_expr(StrBuf *buf, Node *node, const CseTable *cse) {
+    static const char operators[] = "+-*/^";
+    static const char *const functions[] = {"sin(", "cos(", "exp(", "ln("};
+    WorkStack stack;
+    
+    if (node == NULL) return;
+    
+    work_init(&stack);
+    work_push(&stack, node, PRINT_EXPR);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        int parens_left, parens_right;
+        
+        node = item.node;
+        if (item.state == PRINT_CHAR) {
+            strbuf_putc(buf, item.aux.character);
+            continue;
+        }
+        if (item.state != PRINT_EXPR) {
+            uint32_t id = cse != NULL ? cse_id(cse, node) : 0;
+            
+            if (id != 0) {
+                strbuf_putc(buf, 't');
+                strbuf_uint(buf, id);
+                continue;
+            }
+            if (item.state == PRINT_PARENS) {
+                strbuf_putc(buf, '(');
+                push_char(&stack, ')');
+            }
+        }
+        
+        switch (node->type) {
+            case NODE_NUMBER:
+            case NODE_VARIABLE:
+                print_leaf(buf, node);
+                continue;
+                
+            case NODE_SIN:
+            case NODE_COS:
+            case NODE_EXP:
+            case NODE_LN:
+                strbuf_puts(buf, functions[node->type - NODE_SIN]);
+                if (node->left->left == NULL) {
+                    print_leaf(buf, node->left);
+                    strbuf_putc(buf, ')');
+                } else {
+                    push_char(&stack, ')');
+                    push_operand(&stack, node->left, 0);
+                }
+                continue;
+                
+            default:
+                break;
+        }
+        
+        operand_parens(node->type, print_type(node->left, cse), print_type(node->right, cse),
+                       &parens_left, &parens_right);
+        
+        /* Les feuilles sont écrites directement, sans passer par la pile */
+        if (node->left->left == NULL) {
+            print_leaf(buf, node->left);
+            strbuf_putc(buf, operators[node->type - NODE_ADD]);
+            if (node->right->left == NULL) {
+                print_leaf(buf, node->right);
+            } else {
+                push_operand(&stack, node->right, parens_right);
+            }
+        } else {
+            push_operand(&stack, node->right, parens_right);
+            push_char(&stack, operators[node->type - NODE_ADD]);
+            push_operand(&stack, node->left, parens_left);
+        }
+    }
+    work_free(&stack);
+}
+
+/* === UTILITAIRES === */
+
+int is_zero(Node *node) {
+    return node != NULL && node->type == NODE_NUMBER && node->value == 0;
+}
+
+int is_one(Node *node) {
+    return node != NULL && node->type == NODE_NUMBER && node->value == 1;
+}
+
+int is_constant(Node *node, Symbol var) {
+    WorkStack stack;
+    int constant = 1;
+    
+    if (node == NULL || node->type == NODE_NUMBER) return 1;
+    if (node->type == NODE_VARIABLE) return node->variable != var;
+    
+    /* Parcours en profondeur, arrêté à la première occurrence de var */
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0 && constant) {
+        node = work_pop(&stack).node;
+        if (node->type == NODE_VARIABLE) {
+            constant = node->variable != var;
+        } else {
+            if (node->right != NULL) work_push(&stack, node->right, 0);
+            if (node->left != NULL) work_push(&stack, node->left, 0);
+        }
+    }
+    work_free(&stack);
+    return constant;
+}
+
+/* Durée de from à to, en nanosecondes */
+static double elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+/* === DÉRIVATION === */
+
+/* Applique la règle de dérivation du nœud. dl et dr sont les dérivées des
+ * fils; pour NODE_POW, dr est NULL si l'exposant ne dépend pas de var. */
+static Node *derive_rule(Node *node, Symbol var, Node *dl, Node *dr) {
+    switch (node->type) {
+        case NODE_NUMBER:
+            /* d/dx(c) = 0 */
+            return create_number(0);
+            
+        case NODE_VARIABLE:
+            /* d/dx(x) = 1, d/dx(y) = 0 */
+            if (node->variable == var) {
+                return create_number(1);
+            } else {
+                return create_number(0);
+            }
+            
+        case NODE_ADD:
+            /* d/dx(f + g) = f' + g' */
+            return create_binary(NODE_ADD,
+                                dl,
+                                dr);
+            
+        case NODE_SUB:
+            /* d/dx(f - g) = f' - g' */
+            return create_binary(NODE_SUB,
+                                dl,
+                                dr);
+            
+        case NODE_MUL:
+            /* d/dx(f * g) = f' * g + f * g' */
+            return create_binary(NODE_ADD,
+                                create_binary(NODE_MUL,
+                                             dl,
+                                             copy_tree(node->right)),
+                                create_binary(NODE_MUL,
+                                             copy_tree(node->left),
+                                             dr));
+            
+        case NODE_DIV:
+            /* d/dx(f / g) = (f' * g - f * g') / g^2 */
+            return create_binary(NODE_DIV,
+                                create_binary(NODE_SUB,
+                                             create_binary(NODE_MUL,
+                                                          dl,
+                                                          copy_tree(node->right)),
+                                             create_binary(NODE_MUL,
+                                                          copy_tree(node->left),
+                                                          dr)),
+                                create_binary(NODE_POW,
+                                             copy_tree(node->right),
+                                             create_number(2)));
+            
+        case NODE_POW:
+            /* d/dx(f^n) = n * f^(n-1) * f' (si n est constant) */
+            if (dr == NULL) {
+                return create_binary(NODE_MUL,
+                                    create_binary(NODE_MUL,
+                                                 copy_tree(node->right),
+                                                 create_binary(NODE_POW,
+                                                              copy_tree(node->left),
+                                                              create_binary(NODE_SUB,
+                                                                           copy_tree(node->right),
+                                                                           create_number(1)))),
+                                    dl);
+            } else {
+                /* Cas général: d/dx(f^g) = f^g * (g' * ln(f) + g * f'/f) */
+                return create_binary(NODE_MUL,
+                                    copy_tree(node),
+                                    create_binary(NODE_ADD,
+                                                 create_binary(NODE_MUL,
+                                                              dr,
+                                                              create_unary(NODE_LN, copy_tree(node->left))),
+                                                 create_binary(NODE_MUL,
+                                                              copy_tree(node->right),
+                                                              create_binary(NODE_DIV,
+                                                                           dl,
+                                                                           copy_tree(node->left)))));
+            }
+            
+        case NODE_SIN:
+            /* d/dx(sin(f)) = cos(f) * f' */
+            return create_binary(NODE_MUL,
+                                create_unary(NODE_COS, copy_tree(node->left)),
+                                dl);
+            
+        case NODE_COS:
+            /* d/dx(cos(f)) = -sin(f) * f' */
+            return create_binary(NODE_MUL,
+                                create_binary(NODE_MUL,
+                                             create_number(-1),
+                                             create_unary(NODE_SIN, copy_tree(node->left))),
+                                dl);
+            
+        case NODE_EXP:
+            /* d/dx(exp(f)) = exp(f) * f' */
+            return create_binary(NODE_MUL,
+                                create_unary(NODE_EXP, copy_tree(node->left)),
+                                dl);
+            
+        case NODE_LN:
+            /* d/dx(ln(f)) = f' / f */
+            return create_binary(NODE_DIV,
+                                dl,
+                                copy_tree(node->left));
+    }
+    
+    return NULL;
+}
+
+/* Empreinte d'un nœud dont les fils ont déjà la leur */
+static void set_hash(Node *node) {
+    uint64_t h = hash_fields(node->type, node->value, node->variable, NULL, NULL);
+    h = hash_mix(h, node->left != NULL ? node->left->hash : 0);
+    h = hash_finish(hash_mix(h, node->right != NULL ? node->right->hash : 0));
+    node->hash = (uint32_t)(h ^ (h >> 32));
+}
+
+/* Empreinte structurelle de chaque sous-arbre, rangée dans node->hash
+ * (parcours postfixe: les fils avant le parent, les feuilles sans pile) */
+static uint32_t hash_tree(Node *node) {
+    WorkStack stack;
+    
+    if (node == NULL) return 0;
+    if (node->left == NULL) {
+        set_hash(node);
+        return node->hash;
+    }
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        Node *n = item.node;
+        
+        if (item.state == 1) {
+            set_hash(n);
+            continue;
+        }
+        work_push(&stack, n, 1);
+        if (n->right != NULL) {
+            if (n->right->left == NULL) {
+                set_hash(n->right);
+            } else {
+                work_push(&stack, n->right, 0);
+            }
+        }
+        if (n->left->left == NULL) {
+            set_hash(n->left);
+        } else {
+            work_push(&stack, n->left, 0);
+        }
+    }
+    work_free(&stack);
+    return node->hash;
+}
+
+static int same_fields_as(const Node *a, const Node *b) {
+    return a->hash == b->hash && a->type == b->type && a->variable == b->variable &&
+           memcmp(&a->value, &b->value, sizeof(a->value)) == 0;
+}
+
+/* Égalité structurelle (en mode DAG, l'unicité la ramène à l'identité) */
+static int same_tree(const Node *a, const Node *b) {
+    WorkStack stack;
+    int same = 1;
+    
+    if (a == b) return 1;
+    if (a == NULL || b == NULL || current_arena->hash_consing) return 0;
+    if (!same_fields_as(a, b)) return 0;
+    if (a->left == NULL) return 1;
+    
+    /* Paires de nœuds internes dont les champs sont égaux: restent leurs
+     * fils à comparer */
+    work_init(&stack);
+    work_push(&stack, (Node *)a, 0)->aux.other = (Node *)b;
+    while (stack.count > 0 && same) {
+        WorkItem item = work_pop(&stack);
+        const Node *pairs[2][2];
+        int i;
+        
+        pairs[0][0] = item.node->left;
+        pairs[0][1] = item.aux.other->left;
+        pairs[1][0] = item.node->right;
+        pairs[1][1] = item.aux.other->right;
+        for (i = 0; i < 2 && same; i++) {
+            a = pairs[i][0];
+            b = pairs[i][1];
+            if (a == b) continue;
+            if (a == NULL || b == NULL || !same_fields_as(a, b)) {
+                same = 0;
+            } else if (a->left != NULL) {
+                work_push(&stack, (Node *)a, 0)->aux.other = (Node *)b;
+            }
+        }
+    }
+    work_free(&stack);
+    return same;
+}
+
+static uint32_t diff_key(const Node *node, Symbol var) {
+    uint64_t h = current_arena->hash_consing ? hash_pointer(node) : node->hash;
+    h = hash_finish(hash_mix(h, (uint64_t)var));
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void diff_cache_put(DiffCache *cache, Node *key, Symbol var, uint32_t hash, Node *result) {
+    size_t i;
+    
+    if (2 * (cache->count + 1) > cache->capacity) {
+        DiffEntry *old = cache->entries;
+        size_t old_capacity = cache->capacity;
+        
+        cache->capacity = old_capacity ? 2 * old_capacity : 256;
+        cache->entries = (DiffEntry *)xcalloc(cache->capacity, sizeof(DiffEntry));
+        cache->count = 0;
+        for (i = 0; i < old_capacity; i++) {
+            if (old[i].key != NULL) {
+                diff_cache_put(cache, old[i].key, old[i].var, old[i].hash, old[i].result);
+            }
+        }
+        free(old);
+    }
+    
+    for (i = hash & (cache->capacity - 1); cache->entries[i].key != NULL;
+         i = (i + 1) & (cache->capacity - 1)) {
+    }
+    cache->entries[i].key = key;
+    cache->entries[i].result = result;
+    cache->entries[i].hash = hash;
+    cache->entries[i].var = var;
+    cache->count++;
+}
+
+static Node *diff_cache_find(const DiffCache *cache, const Node *node, Symbol var, uint32_t hash) {
+    size_t i;
+    
+    if (cache->count == 0) return NULL;
+    for (i = hash & (cache->capacity - 1); cache->entries[i].key != NULL;
+         i = (i + 1) & (cache->capacity - 1)) {
+        const DiffEntry *entry = &cache->entries[i];
+        if (entry->hash == hash && entry->var == var && same_tree(entry->key, node)) {
+            return entry->result;
+        }
+    }
+    return NULL;
+}
+
+/* Étapes de la dérivation d'un nœud */
+enum {
+    DERIVE_ENTER,          // Chercher dans le cache, sinon dériver les fils
+    DERIVE_UNARY,          // Dérivée du fils gauche prête
+    DERIVE_BINARY          // Dérivées des deux fils prêtes
+};
+
+/* Dérive une feuille tout de suite, ou empile le nœud à dériver */
+static void push_derivative(WorkStack *work, WorkStack *results, Node *node, Symbol var) {
+    if (node->left == NULL) {
+        work_push(results, derive_rule(node, var, NULL, NULL), 0);
+    } else {
+        work_push(work, node, DERIVE_ENTER);
+    }
+}
+
+/* Dérivée mémoïsée: chaque sous-expression distincte n'est dérivée qu'une
+ * fois. Parcours postfixe: les dérivées des fils s'accumulent sur results
+ * avant l'application de la règle du parent. */
+static Node *derive(Node *node, Symbol var) {
+    DiffCache *cache = &current_arena->diff_cache;
+    WorkStack work, results;
+    Node *result;
+    
+    if (node == NULL) return NULL;
+    
+    /* Les feuilles sont plus rapides à dériver qu'à chercher */
+    if (node->left == NULL) return derive_rule(node, var, NULL, NULL);
+    
+    work_init(&work);
+    work_init(&results);
+    work_push(&work, node, DERIVE_ENTER);
+    while (work.count > 0) {
+        WorkItem item = work_pop(&work);
+        Node *dl, *dr = NULL;
+        
+        node = item.node;
+        if (item.state == DERIVE_ENTER) {
+            uint32_t hash;
+            int binary;
+            
+            if (node->left == NULL) {
+                work_push(&results, derive_rule(node, var, NULL, NULL), 0);
+                continue;
+            }
+            
+            hash = diff_key(node, var);
+            result = diff_cache_find(cache, node, var, hash);
+            if (result != NULL) {
+                current_arena->stats.memo_hits++;
+                /* Un arbre ne peut pas être partagé: on en donne une copie */
+                work_push(&results, copy_tree(result), 0);
+                continue;
+            }
+            current_arena->stats.memo_misses++;
+            
+            /* f^n avec n constant: la dérivée de l'exposant est inutile */
+            binary = node->right != NULL &&
+                     (node->type != NODE_POW || !is_constant(node->right, var));
+            work_push(&work, node, binary ? DERIVE_BINARY : DERIVE_UNARY)->aux.hash = hash;
+            
+            /* Les fils feuilles sont dérivés tout de suite, dans l'ordre où
+             * leurs dérivées doivent apparaître sur results */
+            if (node->left->left == NULL) {
+                work_push(&results, derive_rule(node->left, var, NULL, NULL), 0);
+                if (binary) push_derivative(&work, &results, node->right, var);
+            } else {
+                if (binary) work_push(&work, node->right, DERIVE_ENTER);
+                work_push(&work, node->left, DERIVE_ENTER);
+            }
+            continue;
+        }
+        
+        if (item.state == DERIVE_BINARY) dr = work_pop(&results).node;
+        dl = work_pop(&results).node;
+        result = derive_rule(node, var, dl, dr);
+        diff_cache_put(cache, node, var, item.aux.hash, result);
+        work_push(&results, result, 0);
+    }
+    
+    result = results.items[0].node;
+    work_free(&work);
+    work_free(&results);
+    return result;
+}
+
+Node *differentiate(Node *node, Symbol var) {
+    Node *result;
+    
+    if (node == NULL) return NULL;
+    
+    /* En mode DAG les nœuds sont immuables: le cache reste valide jusqu'au
+     * reset. Pour un arbre, les dérivées rangées font partie du résultat et
+     * seront modifiées par simplify(): le cache ne vit que le temps d'un appel. */
+    if (current_arena->hash_consing) return derive(node, var);
+    
+    hash_tree(node);
+    result = derive(node, var);
+    diff_cache_clear(&current_arena->diff_cache);
+    return result;
+}
+
+/* === GRADIENT (MODE INVERSE) === */
+
+/* Ajoute node et ses descendants à order, fils avant parents (un nœud
+ * partagé n'apparaît qu'une fois). État 0: marquer le nœud et empiler ses
+ * fils; état 1: fils rangés, ranger le nœud. */
+static void topo_collect(Node *node, NodeMap *seen, Node ***order, size_t *count, size_t *capacity) {
+    WorkStack stack;
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        
+        node = item.node;
+        if (item.state == 0) {
+            if (node == NULL || node_map_get(seen, node) != NULL) continue;
+            node_map_put(seen, node, node);
+            work_push(&stack, node, 1);
+            work_push(&stack, node->right, 0);
+            work_push(&stack, node->left, 0);
+            continue;
+        }
+        
+        if (*count == *capacity) {
+            *capacity = *capacity ? 2 * *capacity : 256;
+            *order = (Node **)xrealloc(*order, *capacity * sizeof(Node *));
+        }
+        (*order)[(*count)++] = node;
+    }
+    work_free(&stack);
+}
+
+/* Ajoute une contribution à l'adjoint d'un nœud */
+static void add_adjoint(NodeMap *adjoints, Node *node, Node *contribution) {
+    Node *adjoint = node_map_get(adjoints, node);
+    node_map_put(adjoints, node,
+                 adjoint == NULL ? contribution : create_binary(NODE_ADD, adjoint, contribution));
+}
+
+/* Dérivées partielles de tree par rapport à toutes ses variables, en un
+ * passage descendant: l'adjoint de chaque nœud (dérivée de la racine par
+ * rapport à ce nœud) est calculé une fois et propagé à ses fils. grads[c]
+ * reçoit la dérivée (non simplifiée) par rapport à la variable de symbole c,
+ * NULL si c n'apparaît pas; grads a grad_count >= symbol_count() entrées.
+ * En mode DAG les adjoints sont partagés entre toutes les composantes. */
+void gradient(Node *tree, Node **grads, size_t grad_count) {
+    NodeMap seen, varying, adjoints;
+    Node **order = NULL;
+    size_t count = 0, capacity = 0;
+    size_t i;
+    
+    memset(grads, 0, grad_count * sizeof(Node *));
+    memset(&seen, 0, sizeof(seen));
+    memset(&varying, 0, sizeof(varying));
+    memset(&adjoints, 0, sizeof(adjoints));
+    topo_collect(tree, &seen, &order, &count, &capacity);
+    
+    /* Passage montant: sous-expressions qui dépendent d'une variable */
+    for (i = 0; i < count; i++) {
+        Node *node = order[i];
+        if (node->type == NODE_VARIABLE || node_map_get(&varying, node->left) != NULL ||
+            node_map_get(&varying, node->right) != NULL) {
+            node_map_put(&varying, node, node);
+        }
+    }
+    
+    /* Passage descendant: parents avant fils */
+    if (count > 0) node_map_put(&adjoints, tree, create_number(1));
+    for (i = count; i-- > 0;) {
+        Node *node = order[i];
+        Node *adj = node_map_get(&adjoints, node);
+        Node *left = node->left, *right = node->right;
+        int vary_left = node_map_get(&varying, left) != NULL;
+        int vary_right = node_map_get(&varying, right) != NULL;
+        
+        if (adj == NULL || node_map_get(&varying, node) == NULL) continue;
+        
+        switch (node->type) {
+            case NODE_NUMBER:
+                break;
+                
+            case NODE_VARIABLE: {
+                Node **grad = &grads[node->variable];
+                *grad = *grad == NULL ? adj : create_binary(NODE_ADD, *grad, adj);
+                break;
+            }
+                
+            case NODE_ADD:
+                /* adj(f) += adj, adj(g) += adj */
+                if (vary_left) add_adjoint(&adjoints, left, adj);
+                if (vary_right) add_adjoint(&adjoints, right, vary_left ? copy_tree(adj) : adj);
+                break;
+                
+            case NODE_SUB:
+                /* adj(f) += adj, adj(g) += -adj */
+                if (vary_left) add_adjoint(&adjoints, left, adj);
+                if (vary_right) {
+                    add_adjoint(&adjoints, right,
+                                create_binary(NODE_MUL, create_number(-1),
+                                              vary_left ? copy_tree(adj) : adj));
+                }
+                break;
+                
+            case NODE_MUL:
+                /* adj(f) += adj * g, adj(g) += adj * f */
+                if (vary_left) {
+                    add_adjoint(&adjoints, left, create_binary(NODE_MUL, adj, copy_tree(right)));
+                }
+                if (vary_right) {
+                    add_adjoint(&adjoints, right,
+                                create_binary(NODE_MUL, vary_left ? copy_tree(adj) : adj,
+                                              copy_tree(left)));
+                }
+                break;
+                
+            case NODE_DIV:
+                /* adj(f) += adj / g, adj(g) += -adj * f / g^2 */
+                if (vary_left) {
+                    add_adjoint(&adjoints, left, create_binary(NODE_DIV, adj, copy_tree(right)));
+                }
+                if (vary_right) {
+                    add_adjoint(&adjoints, right,
+                                create_binary(NODE_MUL, create_number(-1),
+                                              create_binary(NODE_DIV,
+                                                            create_binary(NODE_MUL,
+                                                                          vary_left ? copy_tree(adj) : adj,
+                                                                          copy_tree(left)),
+                                                            create_binary(NODE_POW, copy_tree(right),
+                                                                          create_number(2)))));
+                }
+                break;
+                
+            case NODE_POW:
+                /* adj(f) += adj * g * f^(g-1), adj(g) += adj * f^g * ln(f) */
+                if (vary_left) {
+                    add_adjoint(&adjoints, left,
+                                create_binary(NODE_MUL, adj,
+                                              create_binary(NODE_MUL, copy_tree(right),
+                                                            create_binary(NODE_POW, copy_tree(left),
+                                                                          create_binary(NODE_SUB,
+                                                                                        copy_tree(right),
+                                                                                        create_number(1))))));
+                }
+                if (vary_right) {
+                    add_adjoint(&adjoints, right,
+                                create_binary(NODE_MUL, vary_left ? copy_tree(adj) : adj,
+                                              create_binary(NODE_MUL, copy_tree(node),
+                                                            create_unary(NODE_LN, copy_tree(left)))));
+                }
+                break;
+                
+            case NODE_SIN:
+                /* adj(f) += adj * cos(f) */
+                add_adjoint(&adjoints, left,
+                            create_binary(NODE_MUL, adj, create_unary(NODE_COS, copy_tree(left))));
+                break;
+                
+            case NODE_COS:
+                /* adj(f) += adj * -sin(f) */
+                add_adjoint(&adjoints, left,
+                            create_binary(NODE_MUL, adj,
+                                          create_binary(NODE_MUL, create_number(-1),
+                                                        create_unary(NODE_SIN, copy_tree(left)))));
+                break;
+                
+            case NODE_EXP:
+                /* adj(f) += adj * exp(f) */
+                add_adjoint(&adjoints, left,
+                            create_binary(NODE_MUL, adj, create_unary(NODE_EXP, copy_tree(left))));
+                break;
+                
+            case NODE_LN:
+                /* adj(f) += adj / f */
+                add_adjoint(&adjoints, left, create_binary(NODE_DIV, adj, copy_tree(left)));
+                break;
+        }
+    }
+    
+    free(order);
+    node_map_free(&seen);
+    node_map_free(&varying);
+    node_map_free(&adjoints);
+}
+
+/* === SIMPLIFICATION === */
+
+/* Effet d'une règle sur le nœud */
+typedef enum {
+    EFFECT_NONE,           // Le nœud est conservé
+    EFFECT_LEFT,           // Le nœud est remplacé par son fils gauche
+    EFFECT_RIGHT,          // Le nœud est remplacé par son fils droit
+    EFFECT_CONST,          // Le nœud devient une constante
+    EFFECT_NEGATE          // Le nœud devient -1 * (fils droit)
+} RuleEffect;
+
+static const RuleEffect rule_effects[] = {
+    EFFECT_NONE,
+    EFFECT_RIGHT, EFFECT_LEFT, EFFECT_CONST,
+    EFFECT_LEFT, EFFECT_NEGATE, EFFECT_CONST,
+    EFFECT_CONST, EFFECT_RIGHT, EFFECT_LEFT, EFFECT_CONST,
+    EFFECT_CONST, EFFECT_LEFT, EFFECT_CONST,
+    EFFECT_CONST, EFFECT_LEFT, EFFECT_CONST, EFFECT_CONST, EFFECT_CONST
+};
+
+/* Cherche la règle applicable à un nœud dont les fils sont déjà simplifiés.
+ * Pour EFFECT_CONST, la valeur de la constante est écrite dans *value. */
+static SimplifyRule match_rule(NodeType type, Node *left, Node *right, double *value) {
+    int constants = left != NULL && right != NULL &&
+                    left->type == NODE_NUMBER && right->type == NODE_NUMBER;
+    
+    switch (type) {
+        case NODE_ADD:
+            if (is_zero(left)) return RULE_ADD_ZERO_LEFT;
+            if (is_zero(right)) return RULE_ADD_ZERO_RIGHT;
+            if (constants) {
+                *value = left->value + right->value;
+                return RULE_ADD_CONST;
+            }
+            break;
+            
+        case NODE_SUB:
+            if (is_zero(right)) return RULE_SUB_ZERO_RIGHT;
+            if (is_zero(left)) return RULE_SUB_ZERO_LEFT;
+            if (constants) {
+                *value = left->value - right->value;
+                return RULE_SUB_CONST;
+            }
+            break;
+            
+        case NODE_MUL:
+            if (is_zero(left) || is_zero(right)) {
+                *value = 0;
+                return RULE_MUL_ZERO;
+            }
+            if (is_one(left)) return RULE_MUL_ONE_LEFT;
+            if (is_one(right)) return RULE_MUL_ONE_RIGHT;
+            if (constants) {
+                *value = left->value * right->value;
+                return RULE_MUL_CONST;
+            }
+            break;
+            
+        case NODE_DIV:
+            if (is_zero(left)) {
+                *value = 0;
+                return RULE_DIV_ZERO;
+            }
+            if (is_one(right)) return RULE_DIV_ONE;
+            if (constants && right->value != 0) {
+                *value = left->value / right->value;
+                return RULE_DIV_CONST;
+            }
+            break;
+            
+        case NODE_POW:
+            if (is_zero(right)) {
+                *value = 1;
+                return RULE_POW_ZERO;
+            }
+            if (is_one(right)) return RULE_POW_ONE;
+            if (is_zero(left) && !is_zero(right)) {
+                *value = 0;
+                return RULE_POW_BASE_ZERO;
+            }
+            if (is_one(left)) {
+                *value = 1;
+                return RULE_POW_BASE_ONE;
+            }
+            if (constants) {
+                *value = pow(left->value, right->value);
+                return RULE_POW_CONST;
+            }
+            break;
+            
+        default:
+            break;
+    }
+    
+    return RULE_NONE;
+}
+
+/* Applique au nœud, dont les fils sont déjà simplifiés, les règles jusqu'à
+ * ce qu'aucune ne s'applique. Libère ce qui n'est plus utilisé (arbre). */
+static Node *simplify_node(Node *node) {
+    Node *result;
+    double value = 0;
+    
+    for (;;) {
+        SimplifyRule rule = match_rule(node->type, node->left, node->right, &value);
+        
+        current_arena->stats.rules[rule]++;
+        switch (rule_effects[rule]) {
+            case EFFECT_LEFT:
+                result = node->left;
+                free_tree(node->right);
+                release_node(node);
+                return result;
+                
+            case EFFECT_RIGHT:
+                result = node->right;
+                free_tree(node->left);
+                release_node(node);
+                return result;
+                
+            case EFFECT_CONST:
+                free_tree(node->left);
+                free_tree(node->right);
+                node->left = NULL;
+                node->right = NULL;
+                node->type = NODE_NUMBER;
+                node->value = value;
+                return node;
+                
+            case EFFECT_NEGATE:
+                /* -1 * x: les fils sont simplifiés, seul le nouveau nœud reste à voir */
+                result = create_binary(NODE_MUL, create_number(-1), node->right);
+                release_node(node->left);
+                release_node(node);
+                node = result;
+                break;
+                
+            default:
+                return node;
+        }
+    }
+}
+
+/* Équivalent de simplify_node pour le mode DAG: node n'est jamais modifié,
+ * left et right sont ses fils simplifiés */
+static Node *simplify_shared_node(Node *node, Node *left, Node *right) {
+    double value = 0;
+    SimplifyRule rule = match_rule(node->type, left, right, &value);
+    
+    current_arena->stats.rules[rule]++;
+    switch (rule_effects[rule]) {
+        case EFFECT_LEFT:
+            return left;
+        case EFFECT_RIGHT:
+            return right;
+        case EFFECT_CONST:
+            return create_number(value);
+        case EFFECT_NEGATE: {
+            Node *negated = create_binary(NODE_MUL, create_number(-1), right);
+            Node *result = simplify_shared_node(negated, negated->left, right);
+            node_map_put(&current_arena->simplified, negated, result);
+            return result;
+        }
+        default:
+            if (left == node->left && right == node->right) return node;
+            return create_binary(node->type, left, right);
+    }
+}
+
+/* Version fonctionnelle pour le mode DAG: les nœuds partagés ne sont jamais
+ * modifiés et chaque nœud n'est simplifié qu'une fois par arène. */
+static Node *simplify_shared(Node *node) {
+    NodeMap *simplified = &current_arena->simplified;
+    WorkStack work, results;
+    Node *result;
+    
+    work_init(&work);
+    work_init(&results);
+    work_push(&work, node, 0);
+    while (work.count > 0) {
+        WorkItem item = work_pop(&work);
+        Node *left = NULL, *right = NULL;
+        
+        node = item.node;
+        if (item.state == 0) {
+            result = node->left == NULL ? node : node_map_get(simplified, node);
+            if (result != NULL) {
+                work_push(&results, result, 0);
+                continue;
+            }
+            work_push(&work, node, 1);
+            
+            /* Une feuille est sa propre forme simplifiée: elle va directement
+             * sur results si l'ordre des résultats le permet */
+            if (node->left->left == NULL) {
+                work_push(&results, node->left, 0);
+                if (node->right != NULL) {
+                    if (node->right->left == NULL) {
+                        work_push(&results, node->right, 0);
+                    } else {
+                        work_push(&work, node->right, 0);
+                    }
+                }
+            } else {
+                if (node->right != NULL) work_push(&work, node->right, 0);
+                work_push(&work, node->left, 0);
+            }
+            continue;
+        }
+        
+        if (node->right != NULL) right = work_pop(&results).node;
+        left = work_pop(&results).node;
+        result = simplify_shared_node(node, left, right);
+        node_map_put(simplified, node, result);
+        work_push(&results, result, 0);
+    }
+    
+    result = results.items[0].node;
+    work_free(&work);
+    work_free(&results);
+    return result;
+}
+
+/* Simplification ascendante: chaque nœud est simplifié après ses fils, en
+ * place, et le résultat est rangé dans l'emplacement qui le référence */
+Node *simplify(Node *node) {
+    WorkStack stack;
+    Node *root = node;
+    
+    if (node == NULL) return NULL;
+    if (current_arena->hash_consing) return simplify_shared(node);
+    if (node->left == NULL) return node;
+    
+    work_init(&stack);
+    work_push(&stack, node, 0)->aux.slot = &root;
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        
+        node = item.node;
+        if (item.state == 0 && node->left != NULL) {
+            work_push(&stack, node, 1)->aux.slot = item.aux.slot;
+            if (node->right != NULL) work_push(&stack, node->right, 0)->aux.slot = &node->right;
+            work_push(&stack, node->left, 0)->aux.slot = &node->left;
+        } else if (item.state == 1) {
+            *item.aux.slot = simplify_node(node);
+        }
+    }
+    work_free(&stack);
+    
+    return root;
+}
+
+/* === FORME CANONIQUE === */
+
+#define CANON_MAX_PASSES 8         // Passes au plus pour atteindre le point fixe
+#define CANON_EXPAND_TERMS 32      // Termes au plus d'une somme distribuée sur un produit
+
+/* Terme d'une somme: coef * monôme (monôme NULL pour une constante) */
+typedef struct {
+    double coef;
+    Node *node;
+} Term;
+
+/* Facteur d'un produit: base ^ exposant */
+typedef struct {
+    Node *base;
+    double exponent;
+} Factor;
+
+/* Somme ou produit en cours de collecte */
+typedef struct {
+    Term *terms;           // Termes (somme)
+    Factor *factors;       // Facteurs (produit)
+    size_t count;
+    size_t capacity;
+    double coef;           // Coefficient cumulé (produit)
+} Collector;
+
+/* Ordre total sur les expressions canoniques: par type, puis par valeur, par
+ * variable ou par fils (gauche d'abord) */
+static int compare_nodes(const Node *a, const Node *b) {
+    WorkStack stack;
+    int order = 0;
+    
+    if (a == b) return 0;
+    
+    work_init(&stack);
+    work_push(&stack, (Node *)a, 0)->aux.other = (Node *)b;
+    while (stack.count > 0 && order == 0) {
+        WorkItem item = work_pop(&stack);
+        
+        a = item.node;
+        b = item.aux.other;
+        if (a == b) continue;
+        if (a == NULL || b == NULL) {
+            order = a == NULL ? -1 : 1;
+        } else if (a->type != b->type) {
+            order = a->type < b->type ? -1 : 1;
+        } else if (a->type == NODE_NUMBER) {
+            order = a->value < b->value ? -1 : a->value > b->value;
+        } else if (a->type == NODE_VARIABLE) {
+            order = symbol_compare(a->variable, b->variable);
+        } else {
+            work_push(&stack, a->right, 0)->aux.other = b->right;
+            work_push(&stack, a->left, 0)->aux.other = b->left;
+        }
+    }
+    work_free(&stack);
+    return order;
+}
+
+/* Constantes en dernier, monômes dans l'ordre de compare_nodes */
+static int compare_terms(const void *a, const void *b) {
+    const Term *x = (const Term *)a, *y = (const Term *)b;
+    if (x->node == NULL || y->node == NULL) return (x->node == NULL) - (y->node == NULL);
+    return compare_nodes(x->node, y->node);
+}
+
+static int compare_factors(const void *a, const void *b) {
+    return compare_nodes(((const Factor *)a)->base, ((const Factor *)b)->base);
+}
+
+static void *grow_array(void *items, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) return items;
+    *capacity = *capacity ? 2 * *capacity : 8;
+    return xrealloc(items, *capacity * size);
+}
+
+/* Ajoute à la somme le terme canonique c (sign = 1 ou -1) */
+static void add_term(Collector *sum, double sign, Node *c) {
+    Term term;
+    
+    if (c->type == NODE_NUMBER) {
+        term.coef = sign * c->value;
+        term.node = NULL;
+        release_node(c);
+    } else if (c->type == NODE_MUL && c->left->type == NODE_NUMBER) {
+        /* Forme canonique d'un produit: coefficient * reste */
+        term.coef = sign * c->left->value;
+        term.node = c->right;
+        release_node(c->left);
+        release_node(c);
+    } else {
+        term.coef = sign;
+        term.node = c;
+    }
+    
+    sum->terms = (Term *)grow_array(sum->terms, &sum->capacity, sum->count, sizeof(Term));
+    sum->terms[sum->count++] = term;
+}
+
+static void add_factor(Collector *product, Node *base, double exponent) {
+    product->factors = (Factor *)grow_array(product->factors, &product->capacity, product->count,
+                                            sizeof(Factor));
+    product->factors[product->count].base = base;
+    product->factors[product->count].exponent = exponent;
+    product->count++;
+}
+
+/* Somme n-aire: termes triés, termes semblables regroupés */
+static Node *finish_sum(Collector *sum) {
+    Term *terms = sum->terms;
+    size_t count = sum->count, kept = 0;
+    Node *result = NULL;
+    size_t i;
+    int pass;
+    
+    qsort(terms, count, sizeof(Term), compare_terms);
+    
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && compare_terms(&terms[kept - 1], &terms[i]) == 0) {
+            terms[kept - 1].coef += terms[i].coef;
+            free_tree(terms[i].node);
+        } else {
+            terms[kept++] = terms[i];
+        }
+    }
+    for (i = 0; i < kept; i++) {
+        if (terms[i].coef == 0) free_tree(terms[i].node);
+    }
+    
+    /* Termes positifs d'abord: un terme négatif devient une soustraction */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < kept; i++) {
+            double coef = fabs(terms[i].coef);
+            Node *term;
+            
+            if (terms[i].coef == 0 || (terms[i].coef > 0) != (pass == 0)) continue;
+            
+            if (result == NULL && terms[i].coef < 0) coef = -coef;
+            if (terms[i].node == NULL) {
+                term = create_number(coef);
+            } else if (coef == 1) {
+                term = terms[i].node;
+            } else {
+                term = create_binary(NODE_MUL, create_number(coef), terms[i].node);
+            }
+            
+            if (result == NULL) {
+                result = term;
+            } else {
+                result = create_binary(pass == 0 ? NODE_ADD : NODE_SUB, result, term);
+            }
+        }
+    }
+    
+    free(terms);
+    return result != NULL ? result : create_number(0);
+}
+
+/* Nombre de termes d'une somme canonique (0 si node n'est pas une somme) */
+static size_t sum_length(const Node *node) {
+    size_t count = 0;
+    
+    if (node->type != NODE_ADD && node->type != NODE_SUB) return 0;
+    for (; node->type == NODE_ADD || node->type == NODE_SUB; node = node->left) count++;
+    return count + 1;
+}
+
+/* sum * rest, développé en somme de termes term * rest (rest est copié pour
+ * chaque terme sauf le dernier). Les termes ne sont pas canoniques: la passe
+ * suivante de canonicalize() les aplatit et regroupe les termes semblables. */
+static Node *distribute(Node *sum, Node *rest) {
+    Node *result = NULL, *spine = sum;
+    
+    while (spine->type == NODE_ADD || spine->type == NODE_SUB) {
+        Node *next = spine->left;
+        Node *term = create_binary(NODE_MUL, spine->right, copy_tree(rest));
+        
+        if (result == NULL) {
+            result = spine->type == NODE_ADD ? term : create_binary(NODE_MUL, create_number(-1), term);
+        } else {
+            result = create_binary(spine->type, result, term);
+        }
+        release_node(spine);
+        spine = next;
+    }
+    spine = create_binary(NODE_MUL, spine, rest);
+    return result == NULL ? spine : create_binary(NODE_ADD, spine, result);
+}
+
+static Node *power_of(Node *base, double exponent) {
+    return exponent == 1 ? base : create_binary(NODE_POW, base, create_number(exponent));
+}
+
+/* Produit n-aire: coefficient en tête, facteurs triés, exposants cumulés,
+ * exposants négatifs au dénominateur. Un produit dont un seul facteur est
+ * une somme (d'au plus CANON_EXPAND_TERMS termes, à l'exposant 1) est
+ * développé: 2*(x+sin(x))*exp(x) donne 2*x*exp(x)+2*sin(x)*exp(x). Les
+ * produits de plusieurs sommes restent factorisés. */
+static Node *finish_product(Collector *product) {
+    Factor *factors = product->factors;
+    size_t count = product->count, kept = 0;
+    Node *numerator = NULL, *denominator = NULL, *result, *sum = NULL;
+    double coef = product->coef;
+    size_t i, sums = 0, expand = 0;
+    
+    qsort(factors, count, sizeof(Factor), compare_factors);
+    
+    for (i = 0; i < count; i++) {
+        if (kept > 0 && compare_factors(&factors[kept - 1], &factors[i]) == 0) {
+            factors[kept - 1].exponent += factors[i].exponent;
+            free_tree(factors[i].base);
+        } else {
+            factors[kept++] = factors[i];
+        }
+    }
+    
+    for (i = 0; i < kept; i++) {
+        if (sum_length(factors[i].base) == 0) continue;
+        sums++;
+        expand = i;
+    }
+    if (sums == 1 && coef != 0 && factors[expand].exponent == 1 &&
+        sum_length(factors[expand].base) <= CANON_EXPAND_TERMS) {
+        sum = factors[expand].base;
+        factors[expand] = factors[--kept];
+    }
+    
+    for (i = 0; i < kept; i++) {
+        Node **side = factors[i].exponent > 0 ? &numerator : &denominator;
+        Node *power;
+        
+        if (factors[i].exponent == 0 || coef == 0) {
+            free_tree(factors[i].base);
+            continue;
+        }
+        power = power_of(factors[i].base, fabs(factors[i].exponent));
+        *side = *side == NULL ? power : create_binary(NODE_MUL, *side, power);
+    }
+    free(factors);
+    
+    if (coef == 0) return create_number(0);
+    if (numerator == NULL && denominator == NULL) {
+        result = create_number(coef);
+        return sum != NULL ? distribute(sum, result) : result;
+    }
+    
+    if (numerator == NULL) {
+        result = create_binary(NODE_DIV, create_number(coef), denominator);
+        coef = 1;
+    } else if (denominator != NULL) {
+        result = create_binary(NODE_DIV, numerator, denominator);
+    } else {
+        result = numerator;
+    }
+    if (coef != 1) result = create_binary(NODE_MUL, create_number(coef), result);
+    return sum != NULL ? distribute(sum, result) : result;
+}
+
+/* Fonctions: valeurs exactes en 0 et 1, ln(exp(u)) = u */
+static Node *canon_function(NodeType type, Node *arg) {
+    Node *result;
+    
+    if (type == NODE_LN && arg->type == NODE_EXP) {
+        result = arg->left;
+    } else if (is_zero(arg) && type != NODE_LN) {
+        result = create_number(type == NODE_SIN ? 0 : 1);
+    } else if (is_one(arg) && type == NODE_LN) {
+        result = create_number(0);
+    } else {
+        return create_unary(type, arg);
+    }
+    release_node(arg);
+    return result;
+}
+
+/* Ouvre une somme ou un produit vide */
+static Collector *open_collector(Collector *open, size_t *depth, size_t *capacity) {
+    open = (Collector *)grow_array(open, capacity, *depth, sizeof(Collector));
+    memset(&open[*depth], 0, sizeof(Collector));
+    open[(*depth)++].coef = 1;
+    return open;
+}
+
+/* Étapes de la forme canonique. Un élément SUM_* ou PRODUCT_* alimente la
+ * collecte ouverte la plus récente; aux.number porte le signe du terme ou
+ * l'exposant du facteur. */
+enum {
+    CANON_ENTER,           // Chercher dans memo, sinon traiter le nœud
+    CANON_SUM,             // Termes de la somme collectés
+    CANON_PRODUCT,         // Facteurs du produit collectés
+    CANON_POW_EXPONENT,    // Exposant canonique prêt
+    CANON_POW_BASE,        // Base canonique prête (exposant dans aux.other)
+    CANON_FUNCTION,        // Argument canonique prêt
+    SUM_ENTER,             // Sous-somme à aplatir ou terme à canoniser
+    SUM_TERM,              // Terme canonique prêt
+    PRODUCT_ENTER,         // Sous-produit à aplatir ou facteur à canoniser
+    PRODUCT_EXPONENT,      // Exposant canonique d'une puissance prêt
+    PRODUCT_BASE,          // Base d'une puissance non entière prête
+    PRODUCT_FACTOR,        // Facteur canonique prêt
+    PRODUCT_FREE           // Produit canonique ré-aplati, à libérer
+};
+
+/* Forme canonique d'un nœud; l'arbre d'entrée n'est ni modifié ni réutilisé
+ * (sauf en mode DAG, où memo évite de traiter deux fois un nœud partagé).
+ * Parcours itératif: chaque forme canonique calculée est rangée dans ret
+ * pour l'élément qui l'attend juste en dessous sur la pile. */
+static Node *canon(Node *node, NodeMap *memo) {
+    WorkStack work;
+    Collector *open = NULL;
+    size_t depth = 0, capacity = 0;
+    Node *ret = NULL, *result;
+    
+    work_init(&work);
+    work_push(&work, node, CANON_ENTER);
+    while (work.count > 0) {
+        WorkItem item = work_pop(&work);
+        Collector *top = depth > 0 ? &open[depth - 1] : NULL;
+        double number = item.aux.number;
+        
+        node = item.node;
+        switch (item.state) {
+            case CANON_ENTER:
+                if (memo != NULL && (ret = node_map_get(memo, node)) != NULL) continue;
+                
+                switch (node->type) {
+                    case NODE_NUMBER:
+                    case NODE_VARIABLE:
+                        result = copy_tree(node);
+                        break;
+                        
+                    case NODE_ADD:
+                    case NODE_SUB:
+                        open = open_collector(open, &depth, &capacity);
+                        work_push(&work, node, CANON_SUM);
+                        work_push(&work, node, SUM_ENTER)->aux.number = 1;
+                        continue;
+                        
+                    case NODE_MUL:
+                    case NODE_DIV:
+                        open = open_collector(open, &depth, &capacity);
+                        work_push(&work, node, CANON_PRODUCT);
+                        work_push(&work, node, PRODUCT_ENTER)->aux.number = 1;
+                        continue;
+                        
+                    case NODE_POW:
+                        work_push(&work, node, CANON_POW_EXPONENT);
+                        work_push(&work, node->right, CANON_ENTER);
+                        continue;
+                        
+                    default:
+                        work_push(&work, node, CANON_FUNCTION);
+                        work_push(&work, node->left, CANON_ENTER);
+                        continue;
+                }
+                break;
+                
+            case CANON_SUM:
+                result = finish_sum(top);
+                depth--;
+                break;
+                
+            case CANON_PRODUCT:
+                result = finish_product(top);
+                depth--;
+                break;
+                
+            case CANON_POW_EXPONENT:
+                if (ret->type == NODE_NUMBER) {
+                    free_tree(ret);
+                    open = open_collector(open, &depth, &capacity);
+                    work_push(&work, node, CANON_PRODUCT);
+                    work_push(&work, node, PRODUCT_ENTER)->aux.number = 1;
+                    continue;
+                }
+                work_push(&work, node, CANON_POW_BASE)->aux.other = ret;
+                work_push(&work, node->left, CANON_ENTER);
+                continue;
+                
+            case CANON_POW_BASE:
+                if (is_one(ret)) {
+                    free_tree(item.aux.other);
+                    result = ret;
+                } else {
+                    result = create_binary(NODE_POW, ret, item.aux.other);
+                }
+                break;
+                
+            case CANON_FUNCTION:
+                result = canon_function(node->type, ret);
+                break;
+                
+            case SUM_ENTER:
+                if (node->type == NODE_ADD || node->type == NODE_SUB) {
+                    work_push(&work, node->right, SUM_ENTER)->aux.number =
+                        node->type == NODE_ADD ? number : -number;
+                    work_push(&work, node->left, SUM_ENTER)->aux.number = number;
+                } else {
+                    work_push(&work, node, SUM_TERM)->aux.number = number;
+                    work_push(&work, node, CANON_ENTER);
+                }
+                continue;
+                
+            case SUM_TERM:
+                add_term(top, number, ret);
+                continue;
+                
+            case PRODUCT_ENTER:
+                /* Les puissances entières sont distribuées, les autres
+                 * restent des facteurs */
+                if (node->type == NODE_MUL || node->type == NODE_DIV) {
+                    work_push(&work, node->right, PRODUCT_ENTER)->aux.number =
+                        node->type == NODE_MUL ? number : -number;
+                    work_push(&work, node->left, PRODUCT_ENTER)->aux.number = number;
+                    continue;
+                }
+                if (node->type == NODE_NUMBER && (node->value != 0 || number > 0)) {
+                    top->coef *= pow(node->value, number);
+                    continue;
+                }
+                work_push(&work, node, node->type == NODE_POW ? PRODUCT_EXPONENT : PRODUCT_FACTOR)
+                    ->aux.number = number;
+                work_push(&work, node->type == NODE_POW ? node->right : node, CANON_ENTER);
+                continue;
+                
+            case PRODUCT_EXPONENT:
+                if (ret->type == NODE_NUMBER) {
+                    double k = ret->value;
+                    
+                    free_tree(ret);
+                    if (k == floor(k)) {
+                        work_push(&work, node->left, PRODUCT_ENTER)->aux.number = number * k;
+                    } else {
+                        work_push(&work, node, PRODUCT_BASE)->aux.number = number * k;
+                        work_push(&work, node->left, CANON_ENTER);
+                    }
+                    continue;
+                }
+                free_tree(ret);
+                work_push(&work, node, PRODUCT_FACTOR)->aux.number = number;
+                work_push(&work, node, CANON_ENTER);
+                continue;
+                
+            case PRODUCT_BASE:
+                add_factor(top, ret, number);
+                continue;
+                
+            case PRODUCT_FACTOR:
+                if ((ret->type == NODE_NUMBER || ret->type == NODE_MUL || ret->type == NODE_DIV ||
+                     (ret->type == NODE_POW && ret->right->type == NODE_NUMBER)) &&
+                    (ret->type != NODE_NUMBER || ret->value != 0 || number > 0)) {
+                    /* Une somme canonique peut se réduire à un produit: on
+                     * l'aplatit, puis on le libère */
+                    work_push(&work, ret, PRODUCT_FREE);
+                    work_push(&work, ret, PRODUCT_ENTER)->aux.number = number;
+                } else {
+                    add_factor(top, ret, number);
+                }
+                continue;
+                
+            default:
+                free_tree(node);
+                continue;
+        }
+        
+        if (memo != NULL) node_map_put(memo, node, result);
+        ret = result;
+    }
+    
+    work_free(&work);
+    free(open);
+    return ret;
+}
+
+/* Nombre de nœuds distincts (les nœuds partagés comptent une fois) */
+size_t count_nodes(Node *node) {
+    NodeMap seen;
+    WorkStack stack;
+    size_t count = 0;
+    
+    memset(&seen, 0, sizeof(seen));
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        node = work_pop(&stack).node;
+        if (node == NULL || node_map_get(&seen, node) != NULL) continue;
+        node_map_put(&seen, node, node);
+        count++;
+        work_push(&stack, node->right, 0);
+        work_push(&stack, node->left, 0);
+    }
+    work_free(&stack);
+    node_map_free(&seen);
+    return count;
+}
+
+/* Profondeur de l'arbre (une feuille: 1) et nombre de nœuds distincts. La
+ * profondeur de chaque nœud visité est rangée dans la table, à la place du
+ * pointeur: un nœud partagé n'est parcouru qu'une fois. */
+size_t tree_shape(Node *node, size_t *nodes) {
+    Node *root = node;
+    NodeMap depths;
+    WorkStack stack;
+    size_t depth;
+    
+    memset(&depths, 0, sizeof(depths));
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        WorkItem *item = &stack.items[stack.count - 1];
+        size_t left, right = 0;
+        
+        node = item->node;
+        if (node_map_get(&depths, node) != NULL) {
+            stack.count--;
+            continue;
+        }
+        if (item->state == 0 && node->left != NULL) {
+            item->state = 1;
+            if (node->right != NULL) work_push(&stack, node->right, 0);
+            work_push(&stack, node->left, 0);
+            continue;
+        }
+        stack.count--;
+        left = node->left == NULL ? 0 : (size_t)(uintptr_t)node_map_get(&depths, node->left);
+        if (node->right != NULL) right = (size_t)(uintptr_t)node_map_get(&depths, node->right);
+        node_map_put(&depths, node, (Node *)(uintptr_t)(1 + (left > right ? left : right)));
+    }
+    
+    depth = (size_t)(uintptr_t)node_map_get(&depths, root);
+    *nodes = depths.count;
+    work_free(&stack);
+    node_map_free(&depths);
+    return depth;
+}
+
+/* Simplification canonique: sommes et produits n-aires, termes triés,
+ * coefficients et exposants regroupés, répétée jusqu'au point fixe. Consomme
+ * node (en mode arbre) et renvoie la forme canonique. */
+Node *canonicalize(Node *node) {
+    ArenaStats *stats = &current_arena->stats;
+    int dag = current_arena->hash_consing;
+    int pass;
+    
+    if (node == NULL) return NULL;
+    stats->canon_calls++;
+    stats->canon_nodes_in += count_nodes(node);
+    
+    for (pass = 0; pass < CANON_MAX_PASSES; pass++) {
+        NodeMap memo;
+        Node *next;
+        int same;
+        
+        memset(&memo, 0, sizeof(memo));
+        next = canon(node, dag ? &memo : NULL);
+        node_map_free(&memo);
+        stats->canon_passes++;
+        
+        if (!dag) {
+            hash_tree(node);
+            hash_tree(next);
+        }
+        same = same_tree(node, next);
+        free_tree(node);
+        node = next;
+        if (same) break;
+    }
+    
+    stats->canon_nodes_out += count_nodes(node);
+    return node;
+}
+
+/* === SOUS-EXPRESSIONS COMMUNES === */
+
+static uint32_t cse_hash(const Node *node) {
+    uint64_t h;
+    
+    if (!current_arena->hash_consing) return node->hash;
+    h = hash_pointer(node);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Entrée du sous-arbre structurellement égal à node (ou entrée libre) */
+static CseEntry *cse_find(const CseTable *cse, const Node *node) {
+    uint32_t hash = cse_hash(node);
+    size_t i;
+    
+    for (i = hash & (cse->capacity - 1); cse->entries[i].node != NULL;
+         i = (i + 1) & (cse->capacity - 1)) {
+        CseEntry *entry = &cse->entries[i];
+        if (entry->hash == hash && same_tree(entry->node, node)) return entry;
+    }
+    return &cse->entries[i];
+}
+
+static uint32_t cse_id(const CseTable *cse, const Node *node) {
+    if (node->left == NULL) return 0;
+    return cse_find(cse, node)->id;
+}
+
+/* Variables de plusieurs lettres de l'expression, triées et sans doublon:
+ * les noms des temporaires et du résultat les évitent */
+typedef struct {
+    Symbol *symbols;
+    size_t count;
+    size_t capacity;
+} CseNames;
+
+static int compare_symbols(const void *a, const void *b) {
+    return symbol_compare(*(const Symbol *)a, *(const Symbol *)b);
+}
+
+static void cse_names_sort(CseNames *names) {
+    size_t i, kept = 0;
+    
+    qsort(names->symbols, names->count, sizeof(Symbol), compare_symbols);
+    for (i = 0; i < names->count; i++) {
+        if (kept == 0 || names->symbols[kept - 1] != names->symbols[i]) {
+            names->symbols[kept++] = names->symbols[i];
+        }
+    }
+    names->count = kept;
+}
+
+/* Vrai si prefix suivi de number (prefix seul pour 0) est une variable de
+ * l'expression */
+static int cse_name_taken(const CseNames *names, const char *prefix, uint32_t number) {
+    char name[32];
+    size_t low = 0, high = names->count;
+    
+    if (names->count == 0) return 0;
+    if (number == 0) {
+        snprintf(name, sizeof(name), "%s", prefix);
+    } else {
+        snprintf(name, sizeof(name), "%s%lu", prefix, (unsigned long)number);
+    }
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int order = strcmp(symbol_name(names->symbols[mid]), name);
+        
+        if (order == 0) return 1;
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return 0;
+}
+
+/* Compte les occurrences des sous-arbres non feuilles. Une occurrence
+ * répétée n'est pas parcourue: ses sous-arbres sont déjà comptés. */
+static void cse_grow(CseTable *cse) {
+    if (2 * (cse->count + 1) > cse->capacity) {
+        CseTable bigger;
+        size_t i;
+        
+        bigger.capacity = cse->capacity ? 2 * cse->capacity : 256;
+        bigger.count = cse->count;
+        bigger.entries = (CseEntry *)xcalloc(bigger.capacity, sizeof(CseEntry));
+        for (i = 0; i < cse->capacity; i++) {
+            if (cse->entries[i].node != NULL) *cse_find(&bigger, cse->entries[i].node) = cse->entries[i];
+        }
+        free(cse->entries);
+        *cse = bigger;
+    }
+}
+
+static void cse_count(CseTable *cse, CseNames *names, Node *node) {
+    WorkStack stack;
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        CseEntry *entry;
+        
+        node = work_pop(&stack).node;
+        if (node == NULL) continue;
+        if (node->type == NODE_VARIABLE && node->variable >= SYMBOL_FIRST &&
+            (names->count == 0 || names->symbols[names->count - 1] != node->variable)) {
+            names->symbols = (Symbol *)grow_array(names->symbols, &names->capacity, names->count,
+                                                  sizeof(Symbol));
+            names->symbols[names->count++] = node->variable;
+        }
+        if (node->left == NULL) continue;
+        
+        cse_grow(cse);
+        entry = cse_find(cse, node);
+        if (entry->node != NULL) {
+            entry->count++;
+            continue;
+        }
+        entry->node = node;
+        entry->hash = cse_hash(node);
+        entry->count = 1;
+        cse->count++;
+        work_push(&stack, node->right, 0);
+        work_push(&stack, node->left, 0);
+    }
+    work_free(&stack);
+}
+
+/* Écrit les définitions des temporaires de node, sous-expressions d'abord */
+static void cse_define(StrBuf *buf, CseTable *cse, const CseNames *names, Node *node,
+                       uint32_t *next_id) {
+    WorkStack stack;
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        CseEntry *entry;
+        
+        node = item.node;
+        if (node == NULL || node->left == NULL) continue;
+        
+        entry = cse_find(cse, node);
+        if (item.state == 0) {
+            if (entry->id != 0) continue;
+            work_push(&stack, node, 1);
+            work_push(&stack, node->right, 0);
+            work_push(&stack, node->left, 0);
+        } else if (entry->count >= 2) {
+            while (cse_name_taken(names, "t", *next_id)) (*next_id)++;
+            strbuf_putc(buf, 't');
+            strbuf_uint(buf, *next_id);
+            strbuf_write(buf, " = ", 3);
+            serialize_expr(buf, node, cse);
+            strbuf_write(buf, "; ", 2);
+            entry->id = (*next_id)++;
+        }
+    }
+    work_free(&stack);
+}
+
+/* Ajoute node au tampon en nommant les sous-expressions répétées: "t1 = ...;
+ * t2 = ...; result = ..." (sans temporaire: l'expression seule, comme
+ * serialize_tree); renvoie le nombre d'octets ajoutés. Un nom pris par une
+ * variable de l'expression est sauté: t2 si t1 en est une, result2 pour
+ * result. */
+size_t serialize_tree_cse(StrBuf *buf, Node *node) {
+    size_t start = buf->length;
+    CseTable cse;
+    CseNames names;
+    uint32_t next_id = 1;
+    
+    if (node == NULL) return 0;
+    memset(&cse, 0, sizeof(cse));
+    memset(&names, 0, sizeof(names));
+    if (!current_arena->hash_consing) hash_tree(node);
+    cse_count(&cse, &names, node);
+    cse_names_sort(&names);
+    cse_define(buf, &cse, &names, node, &next_id);
+    
+    if (next_id > 1) {
+        uint32_t label = 0;
+        
+        while (cse_name_taken(&names, "result", label)) label = label == 0 ? 2 : label + 1;
+        strbuf_write(buf, "result", 6);
+        if (label != 0) strbuf_uint(buf, label);
+        strbuf_write(buf, " = ", 3);
+    }
+    serialize_expr(buf, node, &cse);
+    free(cse.entries);
+    free(names.symbols);
+    return buf->length - start;
+}
+
+void fprint_tree_cse(FILE *out, Node *node) {
+    char local[STRBUF_LOCAL];
+    StrBuf buf;
+    
+    strbuf_init(&buf, local, sizeof(local));
+    serialize_tree_cse(&buf, node);
+    strbuf_write_to(&buf, out);
+    strbuf_free(&buf);
+}
+
+/* === ARBRE COMPACT (STRUCTURE DE TABLEAUX) === */
+
+/* Un nœud occupe 9 octets (type, deux indices) plus sa part de la table
+ * d'unicité, contre 40 pour un Node; les constantes ont leur propre tableau.
+ * Les fils précèdent toujours leur parent: dériver et simplifier sont des
+ * parcours linéaires des tableaux, sans pile ni récursion. */
+
+void flat_clear(FlatTree *tree) {
+    tree->count = 0;
+    tree->literal_count = 0;
+    if (tree->intern != NULL) memset(tree->intern, 0, tree->intern_capacity * sizeof(uint32_t));
+}
+
+void flat_free(FlatTree *tree) {
+    free(tree->types);
+    free(tree->left);
+    free(tree->right);
+    free(tree->literals);
+    free(tree->intern);
+    free(tree->scratch);
+    free(tree->marks);
+    memset(tree, 0, sizeof(*tree));
+}
+
+/* Octets occupés par les nœuds et les constantes */
+static size_t flat_bytes(const FlatTree *tree) {
+    return tree->count * (sizeof(uint8_t) + 2 * sizeof(uint32_t)) + tree->literal_count * sizeof(double);
+}
+
+static uint64_t flat_hash(NodeType type, uint64_t left, uint32_t right) {
+    uint64_t h = hash_mix((uint64_t)type, left);
+    h = hash_mix(h, right);
+    return hash_finish(h);
+}
+
+/* Clé de hachage du fils gauche: la valeur pour une constante */
+static uint64_t flat_left_key(const FlatTree *tree, uint32_t i) {
+    uint64_t bits;
+    
+    if (tree->types[i] != NODE_NUMBER) return tree->left[i];
+    memcpy(&bits, &tree->literals[tree->left[i]], sizeof(bits));
+    return bits;
+}
+
+static void flat_intern_grow(FlatTree *tree) {
+    size_t i;
+    
+    free(tree->intern);
+    tree->intern_capacity = tree->intern_capacity ? 2 * tree->intern_capacity : 256;
+    tree->intern = (uint32_t *)xcalloc(tree->intern_capacity, sizeof(uint32_t));
+    for (i = 0; i < tree->count; i++) {
+        size_t slot = flat_hash((NodeType)tree->types[i], flat_left_key(tree, i), tree->right[i]);
+        while (tree->intern[slot & (tree->intern_capacity - 1)] != 0) slot++;
+        tree->intern[slot & (tree->intern_capacity - 1)] = (uint32_t)i + 1;
+    }
+}
+
+/* Indice du nœud (type, left, right), créé s'il n'existe pas encore. Pour
+ * une constante, left est ignoré et value identifie le nœud. */
+static uint32_t flat_node(FlatTree *tree, NodeType type, uint32_t left, uint32_t right,
+                          double value) {
+    uint64_t key = left;
+    size_t mask, slot;
+    uint32_t i;
+    
+    if (type == NODE_NUMBER) memcpy(&key, &value, sizeof(key));
+    if (2 * (tree->count + 1) > tree->intern_capacity) flat_intern_grow(tree);
+    
+    mask = tree->intern_capacity - 1;
+    for (slot = flat_hash(type, key, right); tree->intern[slot & mask] != 0; slot++) {
+        i = tree->intern[slot & mask] - 1;
+        if (tree->types[i] == type && tree->right[i] == right && flat_left_key(tree, i) == key) {
+            return i;
+        }
+    }
+    
+    if (tree->count == tree->capacity) {
+        tree->capacity = tree->capacity ? 2 * tree->capacity : 1024;
+        tree->types = (uint8_t *)xrealloc(tree->types, tree->capacity * sizeof(uint8_t));
+        tree->left = (uint32_t *)xrealloc(tree->left, tree->capacity * sizeof(uint32_t));
+        tree->right = (uint32_t *)xrealloc(tree->right, tree->capacity * sizeof(uint32_t));
+    }
+    if (type == NODE_NUMBER) {
+        if (tree->literal_count == tree->literal_capacity) {
+            tree->literal_capacity = tree->literal_capacity ? 2 * tree->literal_capacity : 256;
+            tree->literals = (double *)xrealloc(tree->literals,
+                                                tree->literal_capacity * sizeof(double));
+        }
+        tree->literals[tree->literal_count] = value;
+        left = (uint32_t)tree->literal_count++;
+    }
+    
+    i = (uint32_t)tree->count++;
+    tree->types[i] = (uint8_t)type;
+    tree->left[i] = left;
+    tree->right[i] = right;
+    tree->intern[slot & mask] = i + 1;
+    return i;
+}
+
+static uint32_t flat_number(FlatTree *tree, double value) {
+    return flat_node(tree, NODE_NUMBER, 0, FLAT_NONE, value);
+}
+
+static uint32_t flat_binary(FlatTree *tree, NodeType type, uint32_t left, uint32_t right) {
+    return flat_node(tree, type, left, right, 0);
+}
+
+static uint32_t flat_unary(FlatTree *tree, NodeType type, uint32_t child) {
+    return flat_node(tree, type, child, FLAT_NONE, 0);
+}
+
+/* Tableaux de travail pour les nœuds 0..count-1 */
+static void flat_reserve_scratch(FlatTree *tree, size_t count) {
+    if (count <= tree->scratch_capacity) return;
+    tree->scratch_capacity = count;
+    tree->scratch = (uint32_t *)xrealloc(tree->scratch, count * sizeof(uint32_t));
+    tree->marks = (uint8_t *)xrealloc(tree->marks, count);
+}
+
+/* Marque (bit mark) les nœuds atteignables depuis root: un seul parcours
+ * descendant, puisque les fils ont des indices inférieurs */
+static void flat_mark_reachable(FlatTree *tree, uint32_t root, uint8_t mark) {
+    uint32_t i;
+    
+    tree->marks[root] |= mark;
+    for (i = root + 1; i-- > 0;) {
+        if (!(tree->marks[i] & mark) || tree->types[i] < NODE_ADD) continue;
+        tree->marks[tree->left[i]] |= mark;
+        if (tree->right[i] != FLAT_NONE) tree->marks[tree->right[i]] |= mark;
+    }
+}
+
+/* Profondeur de root et nombre de nœuds atteignables: un parcours montant,
+ * la profondeur de chaque nœud dans scratch */
+static size_t flat_shape(FlatTree *tree, uint32_t root, size_t *nodes) {
+    uint32_t i;
+    
+    flat_reserve_scratch(tree, (size_t)root + 1);
+    memset(tree->marks, 0, (size_t)root + 1);
+    flat_mark_reachable(tree, root, 1);
+    *nodes = 0;
+    for (i = 0; i <= root; i++) {
+        uint32_t depth = 0;
+        
+        if (!tree->marks[i]) continue;
+        (*nodes)++;
+        if (tree->types[i] >= NODE_ADD) {
+            depth = tree->scratch[tree->left[i]];
+            if (tree->right[i] != FLAT_NONE && tree->scratch[tree->right[i]] > depth) {
+                depth = tree->scratch[tree->right[i]];
+            }
+        }
+        tree->scratch[i] = depth + 1;
+    }
+    return tree->scratch[root];
+}
+
+/* Ajoute l'arbre node (parcours postfixe) et renvoie l'indice de sa racine */
+uint32_t flat_from_tree(FlatTree *tree, Node *node) {
+    WorkStack work, results;
+    uint32_t root;
+    
+    work_init(&work);
+    work_init(&results);
+    work_push(&work, node, 0);
+    while (work.count > 0) {
+        WorkItem item = work_pop(&work);
+        uint32_t left, right = FLAT_NONE;
+        
+        node = item.node;
+        if (node->type == NODE_NUMBER) {
+            work_push(&results, NULL, 0)->aux.index = flat_number(tree, node->value);
+            continue;
+        }
+        if (node->type == NODE_VARIABLE) {
+            work_push(&results, NULL, 0)->aux.index =
+                flat_node(tree, NODE_VARIABLE, node->variable, FLAT_NONE, 0);
+            continue;
+        }
+        if (item.state == 0) {
+            work_push(&work, node, 1);
+            if (node->right != NULL) work_push(&work, node->right, 0);
+            work_push(&work, node->left, 0);
+            continue;
+        }
+        
+        if (node->right != NULL) right = work_pop(&results).aux.index;
+        left = work_pop(&results).aux.index;
+        work_push(&results, NULL, 0)->aux.index = flat_node(tree, node->type, left, right, 0);
+    }
+    
+    root = results.items[0].aux.index;
+    work_free(&work);
+    work_free(&results);
+    return root;
+}
+
+/* Bits de marks pendant la dérivation */
+#define FLAT_DEPENDS 1             // Le sous-arbre contient la variable
+#define FLAT_NEEDED  2             // Sa dérivée est nécessaire
+
+/* Ajoute la dérivée de root par rapport à var et renvoie son indice. Trois
+ * parcours linéaires: dépendance à var (montant), dérivées utiles
+ * (descendant), puis règles de dérivation (montant). Les règles sont celles
+ * de derive_rule(); les sous-expressions sont partagées, jamais copiées. */
+uint32_t flat_derive(FlatTree *tree, uint32_t root, Symbol var) {
+    uint32_t i;
+    
+    flat_reserve_scratch(tree, (size_t)root + 1);
+    
+    for (i = 0; i <= root; i++) {
+        uint8_t depends;
+        
+        if (tree->types[i] == NODE_NUMBER) {
+            depends = 0;
+        } else if (tree->types[i] == NODE_VARIABLE) {
+            depends = tree->left[i] == var;
+        } else {
+            depends = tree->marks[tree->left[i]] & FLAT_DEPENDS;
+            if (tree->right[i] != FLAT_NONE) depends |= tree->marks[tree->right[i]] & FLAT_DEPENDS;
+        }
+        tree->marks[i] = depends ? FLAT_DEPENDS : 0;
+    }
+    
+    /* f^n avec n constant: la dérivée de l'exposant est inutile */
+    tree->marks[root] |= FLAT_NEEDED;
+    for (i = root + 1; i-- > 0;) {
+        uint32_t right = tree->right[i];
+        
+        if (!(tree->marks[i] & FLAT_NEEDED) || tree->types[i] < NODE_ADD) continue;
+        tree->marks[tree->left[i]] |= FLAT_NEEDED;
+        if (right != FLAT_NONE &&
+            (tree->types[i] != NODE_POW || (tree->marks[right] & FLAT_DEPENDS))) {
+            tree->marks[right] |= FLAT_NEEDED;
+        }
+    }
+    
+    for (i = 0; i <= root; i++) {
+        uint32_t f = tree->left[i], g = tree->right[i];
+        uint32_t df = 0, dg = FLAT_NONE;
+        uint32_t result;
+        
+        if (!(tree->marks[i] & FLAT_NEEDED)) continue;
+        if (tree->types[i] >= NODE_ADD) {
+            df = tree->scratch[f];
+            if (g != FLAT_NONE && (tree->types[i] != NODE_POW || (tree->marks[g] & FLAT_DEPENDS))) {
+                dg = tree->scratch[g];
+            }
+        }
+        
+        switch ((NodeType)tree->types[i]) {
+            case NODE_NUMBER:
+                result = flat_number(tree, 0);
+                break;
+            case NODE_VARIABLE:
+                result = flat_number(tree, f == var ? 1 : 0);
+                break;
+            case NODE_ADD:
+            case NODE_SUB:
+                result = flat_binary(tree, (NodeType)tree->types[i], df, dg);
+                break;
+            case NODE_MUL:
+                result = flat_binary(tree, NODE_ADD, flat_binary(tree, NODE_MUL, df, g),
+                                     flat_binary(tree, NODE_MUL, f, dg));
+                break;
+            case NODE_DIV:
+                result = flat_binary(tree, NODE_DIV,
+                                     flat_binary(tree, NODE_SUB, flat_binary(tree, NODE_MUL, df, g),
+                                                 flat_binary(tree, NODE_MUL, f, dg)),
+                                     flat_binary(tree, NODE_POW, g, flat_number(tree, 2)));
+                break;
+            case NODE_POW:
+                if (dg == FLAT_NONE) {
+                    uint32_t power = flat_binary(tree, NODE_POW, f,
+                                                 flat_binary(tree, NODE_SUB, g, flat_number(tree, 1)));
+                    result = flat_binary(tree, NODE_MUL, flat_binary(tree, NODE_MUL, g, power), df);
+                } else {
+                    uint32_t terms = flat_binary(
+                        tree, NODE_ADD, flat_binary(tree, NODE_MUL, dg, flat_unary(tree, NODE_LN, f)),
+                        flat_binary(tree, NODE_MUL, g, flat_binary(tree, NODE_DIV, df, f)));
+                    result = flat_binary(tree, NODE_MUL, i, terms);
+                }
+                break;
+            case NODE_SIN:
+                result = flat_binary(tree, NODE_MUL, flat_unary(tree, NODE_COS, f), df);
+                break;
+            case NODE_COS:
+                result = flat_binary(tree, NODE_MUL,
+                                     flat_binary(tree, NODE_MUL, flat_number(tree, -1),
+                                                 flat_unary(tree, NODE_SIN, f)),
+                                     df);
+                break;
+            case NODE_EXP:
+                result = flat_binary(tree, NODE_MUL, flat_unary(tree, NODE_EXP, f), df);
+                break;
+            default:
+                result = flat_binary(tree, NODE_DIV, df, f);
+                break;
+        }
+        tree->scratch[i] = result;
+    }
+    
+    return tree->scratch[root];
+}
+
+/* Vue Node d'un nœud compact, le temps d'appeler match_rule() */
+static Node *flat_view(const FlatTree *tree, uint32_t i, Node *view) {
+    if (i == FLAT_NONE) return NULL;
+    view->type = (NodeType)tree->types[i];
+    view->value = view->type == NODE_NUMBER ? tree->literals[tree->left[i]] : 0;
+    return view;
+}
+
+/* Règles de simplification sur un nœud dont les fils sont simplifiés */
+static uint32_t flat_simplify_node(FlatTree *out, NodeType type, uint32_t left, uint32_t right) {
+    Node left_view, right_view;
+    double value = 0;
+    SimplifyRule rule = match_rule(type, flat_view(out, left, &left_view),
+                                   flat_view(out, right, &right_view), &value);
+    
+    current_arena->stats.rules[rule]++;
+    switch (rule_effects[rule]) {
+        case EFFECT_LEFT:
+            return left;
+        case EFFECT_RIGHT:
+            return right;
+        case EFFECT_CONST:
+            return flat_number(out, value);
+        case EFFECT_NEGATE:
+            return flat_simplify_node(out, NODE_MUL, flat_number(out, -1), right);
+        default:
+            return flat_node(out, type, left, right, 0);
+    }
+}
+
+/* Écrit dans out (vidé) la forme simplifiée de root: un parcours descendant
+ * marque les nœuds atteignables, un parcours montant les simplifie. out ne
+ * contient ensuite que des nœuds utiles. */
+uint32_t flat_simplify(FlatTree *in, uint32_t root, FlatTree *out) {
+    uint32_t i;
+    
+    flat_clear(out);
+    flat_reserve_scratch(in, (size_t)root + 1);
+    memset(in->marks, 0, (size_t)root + 1);
+    flat_mark_reachable(in, root, 1);
+    
+    for (i = 0; i <= root; i++) {
+        NodeType type = (NodeType)in->types[i];
+        
+        if (!in->marks[i]) continue;
+        if (type == NODE_NUMBER) {
+            in->scratch[i] = flat_number(out, in->literals[in->left[i]]);
+        } else if (type == NODE_VARIABLE) {
+            in->scratch[i] = flat_node(out, NODE_VARIABLE, in->left[i], FLAT_NONE, 0);
+        } else {
+            uint32_t right = in->right[i] == FLAT_NONE ? FLAT_NONE : in->scratch[in->right[i]];
+            in->scratch[i] = flat_simplify_node(out, type, in->scratch[in->left[i]], right);
+        }
+    }
+    
+    return in->scratch[root];
+}
+
+static void flat_print_leaf(StrBuf *buf, const FlatTree *tree, uint32_t i) {
+    if (tree->types[i] == NODE_VARIABLE) {
+        strbuf_symbol(buf, tree->left[i]);
+    } else {
+        strbuf_number(buf, tree->literals[tree->left[i]]);
+    }
+}
+
+static void flat_push(WorkStack *stack, uint32_t index, int state) {
+    work_push(stack, NULL, state)->aux.index = index;
+}
+
+/* Même texte que serialize_tree(), sur un arbre compact; renvoie le nombre
+ * d'octets ajoutés */
+size_t flat_serialize(StrBuf *buf, const FlatTree *tree, uint32_t root) {
+    static const char operators[] = "+-*/^";
+    static const char *const functions[] = {"sin(", "cos(", "exp(", "ln("};
+    size_t start = buf->length;
+    WorkStack stack;
+    
+    work_init(&stack);
+    flat_push(&stack, root, PRINT_EXPR);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        uint32_t i = item.aux.index;
+        NodeType type;
+        int parens_left, parens_right;
+        
+        if (item.state == PRINT_CHAR) {
+            strbuf_putc(buf, (int)i);
+            continue;
+        }
+        if (item.state == PRINT_PARENS) {
+            strbuf_putc(buf, '(');
+            flat_push(&stack, ')', PRINT_CHAR);
+        }
+        
+        type = (NodeType)tree->types[i];
+        if (type < NODE_ADD) {
+            flat_print_leaf(buf, tree, i);
+        } else if (type >= NODE_SIN) {
+            strbuf_puts(buf, functions[type - NODE_SIN]);
+            flat_push(&stack, ')', PRINT_CHAR);
+            flat_push(&stack, tree->left[i], PRINT_EXPR);
+        } else {
+            operand_parens(type, (NodeType)tree->types[tree->left[i]],
+                           (NodeType)tree->types[tree->right[i]], &parens_left, &parens_right);
+            flat_push(&stack, tree->right[i], parens_right ? PRINT_PARENS : PRINT_EXPR);
+            flat_push(&stack, (uint32_t)operators[type - NODE_ADD], PRINT_CHAR);
+            flat_push(&stack, tree->left[i], parens_left ? PRINT_PARENS : PRINT_EXPR);
+        }
+    }
+    work_free(&stack);
+    return buf->length - start;
+}
+
+void flat_print(FILE *out, const FlatTree *tree, uint32_t root) {
+    char local[STRBUF_LOCAL];
+    StrBuf buf;
+    
+    strbuf_init(&buf, local, sizeof(local));
+    flat_serialize(&buf, tree, root);
+    strbuf_write_to(&buf, out);
+    strbuf_free(&buf);
+}
+
+/* === DÉRIVATION D'UNE EXPRESSION === */
+
+/* Options de dérivation communes aux modes interactif et batch */
+typedef struct {
+    Symbol var;            // Variable de dérivation
+    int cse;               // Nommer les sous-expressions répétées (--cse)
+    int canonical;         // Mettre la dérivée sous forme canonique (--canonical)
+    int flat;              // Dériver et simplifier sur un arbre compact (--flat)
+    size_t max_output;     // Taille maximale d'une dérivée écrite (0: sans limite)
+    int order;             // Ordre de dérivation (--order, 1 par défaut)
+    int stats;             // Mesures de chaque expression en JSON (--stats)
+} DeriveOptions;
+
+/* Mesures d'une expression (--stats). Les phases ne sont chronométrées, et
+ * les arbres mesurés, que si l'option est active. */
+typedef struct {
+    ArenaStats before;     // Compteurs de l'arène avant l'analyse
+    struct timespec clock; // Fin de la dernière phase chronométrée
+    double parse_ns;
+    double derive_ns;
+    double simplify_ns;    // Forme canonique comprise
+    double print_ns;
+    size_t nodes, depth;   // Expression analysée
+    size_t derivative_nodes, derivative_depth; // Dérivée avant simplification
+    size_t simplified_nodes, simplified_depth; // Dérivée simplifiée
+    size_t output_bytes;
+} ExprStats;
+
+/* Noms JSON des règles de simplification */
+static const char *const rule_names[RULE_COUNT] = {
+    NULL,
+    "add_zero_gauche", "add_zero_droite", "add_const",
+    "sub_zero_droite", "sub_zero_gauche", "sub_const",
+    "mul_zero", "mul_un_gauche", "mul_un_droite", "mul_const",
+    "div_zero", "div_un", "div_const",
+    "pow_zero", "pow_un", "pow_base_zero", "pow_base_un", "pow_const"
+};
+
+/* Ajoute à *phase le temps écoulé depuis la fin de la phase précédente */
+static void expr_lap(ExprStats *expr, double *phase) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *phase += elapsed_ns(&expr->clock, &now);
+    expr->clock = now;
+}
+
+/* Dérivée d'ordre order de tree, simplifiée (et canonique si demandé) après
+ * chaque ordre. Au-delà du premier ordre l'arène est en mode DAG: le cache
+ * de dérivation et les nœuds uniques sont réutilisés d'un ordre à l'autre, et
+ * la forme canonique est toujours appliquée: sans regroupement des termes
+ * semblables, chaque ordre doublerait à peu près la taille du texte. */
+static Node *derive_order(Node *tree, const DeriveOptions *options, ExprStats *expr) {
+    ArenaStats *stats = &current_arena->stats;
+    int k;
+    
+    for (k = 1; k <= options->order; k++) {
+        tree = differentiate(tree, options->var);
+        if (expr != NULL) {
+            /* Mesurée avant simplify(), qui modifie l'arbre sur place */
+            expr_lap(expr, &expr->derive_ns);
+            expr->derivative_depth = tree_shape(tree, &expr->derivative_nodes);
+            clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+        }
+        tree = simplify(tree);
+        if (options->canonical || options->order > 1) tree = canonicalize(tree);
+        if (expr != NULL) expr_lap(expr, &expr->simplify_ns);
+        if (options->order > 1) stats->order_nodes[k] += count_nodes(tree);
+    }
+    if (options->order > 1) stats->order_runs++;
+    if (expr != NULL) {
+        expr->simplified_depth = tree_shape(tree, &expr->simplified_nodes);
+        clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+    }
+    return tree;
+}
+
+/* Dérivation sur les arbres compacts de l'arène: expression et dérivée dans
+ * flat[0], forme simplifiée dans flat[1]; renvoie sa racine. Pour les ordres
+ * suivants, les deux arbres sont échangés: la dérivée simplifiée est dérivée
+ * sur place dans flat[0], puis simplifiée dans flat[1]. */
+static uint32_t flat_derivative(Node *tree, Symbol var, int order, ExprStats *expr) {
+    FlatTree *flat = current_arena->flat;
+    ArenaStats *stats = &current_arena->stats;
+    uint32_t root = flat_from_tree(&flat[0], tree);
+    size_t nodes;
+    int k;
+    
+    for (k = 1; k <= order; k++) {
+        if (k > 1) {
+            FlatTree swap = flat[0];
+            
+            flat_shape(&flat[1], root, &nodes);
+            stats->order_nodes[k - 1] += nodes;
+            flat[0] = flat[1];
+            flat[1] = swap;
+        }
+        root = flat_derive(&flat[0], root, var);
+        if (expr != NULL) {
+            expr_lap(expr, &expr->derive_ns);
+            expr->derivative_depth = flat_shape(&flat[0], root, &expr->derivative_nodes);
+            clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+        }
+        root = flat_simplify(&flat[0], root, &flat[1]);
+        if (expr != NULL) expr_lap(expr, &expr->simplify_ns);
+        if (k == 1) {
+            stats->flat_nodes += flat[0].count;
+            stats->flat_bytes += flat_bytes(&flat[0]);
+        }
+        stats->flat_nodes += flat[1].count;
+        stats->flat_bytes += flat_bytes(&flat[1]);
+    }
+    if (order > 1) {
+        flat_shape(&flat[1], root, &nodes);
+        stats->order_nodes[order] += nodes;
+        stats->order_runs++;
+    }
+    if (expr != NULL) {
+        expr->simplified_depth = flat_shape(&flat[1], root, &expr->simplified_nodes);
+        clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+    }
+    return root;
+}
+
+/* Ajoute au tampon la dérivée déjà calculée (l'arbre derivative, ou la
+ * racine root de flat[1] avec --flat) */
+static void serialize_derivative(StrBuf *buf, Node *derivative, uint32_t root,
+                                 const DeriveOptions *options) {
+    if (options->flat) {
+        flat_serialize(buf, &current_arena->flat[1], root);
+    } else if (options->cse) {
+        serialize_tree_cse(buf, derivative);
+    } else {
+        serialize_tree(buf, derivative);
+    }
+}
+
+/* Dérive et simplifie tree selon les options, puis ajoute la dérivée à
+ * out; expr (NULL sans --stats) reçoit les mesures de ces phases. Renvoie
+ * la longueur de la dérivée: au-delà de max_output, elle n'est pas écrite. */
+static size_t render_derivative(StrBuf *out, Node *tree, const DeriveOptions *options,
+                                ExprStats *expr) {
+    Node *derivative = NULL;
+    uint32_t root = 0;
+    size_t start = out->length;
+    
+    if (expr != NULL) clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+    if (options->flat) {
+        root = flat_derivative(tree, options->var, options->order, expr);
+    } else {
+        derivative = derive_order(tree, options, expr);
+    }
+    
+    if (options->max_output > 0) {
+        /* Un premier passage mesure le texte: trop long, il n'est pas
+         * construit; sinon le tampon est dimensionné d'emblée */
+        StrBuf measure;
+        
+        strbuf_measure(&measure);
+        serialize_derivative(&measure, derivative, root, options);
+        if (measure.length > options->max_output) {
+            if (expr != NULL) expr_lap(expr, &expr->print_ns);
+            return measure.length;
+        }
+        strbuf_reserve(out, measure.length);
+    }
+    serialize_derivative(out, derivative, root, options);
+    if (expr != NULL) {
+        expr_lap(expr, &expr->print_ns);
+        expr->output_bytes = out->length - start;
+    }
+    return out->length - start;
+}
+
+/* Analyse text (en reprenant les groupes inchangés avec reuse); avec expr,
+ * chronomètre l'analyse et mesure l'expression */
+static Node *parse_expression(Parser *parser, const char *text, ParseReuse *reuse,
+                              ExprStats *expr) {
+    Node *tree;
+    
+    if (expr == NULL) return parse_incremental(parser, text, reuse);
+    memset(expr, 0, sizeof(*expr));
+    expr->before = current_arena->stats;
+    clock_gettime(CLOCK_MONOTONIC, &expr->clock);
+    tree = parse_incremental(parser, text, reuse);
+    expr_lap(expr, &expr->parse_ns);
+    if (tree != NULL) expr->depth = tree_shape(tree, &expr->nodes);
+    return tree;
+}
+
+static void json_field(StrBuf *buf, const char *name, uint64_t value) {
+    strbuf_putc(buf, '"');
+    strbuf_puts(buf, name);
+    strbuf_puts(buf, "\":");
+    strbuf_uint(buf, value);
+}
+
+static void json_shape(StrBuf *buf, const char *name, size_t nodes, size_t depth) {
+    strbuf_putc(buf, '"');
+    strbuf_puts(buf, name);
+    strbuf_puts(buf, "\":{");
+    json_field(buf, "noeuds", nodes);
+    strbuf_putc(buf, ',');
+    json_field(buf, "profondeur", depth);
+    strbuf_puts(buf, "},");
+}
+
+/* Ajoute à buf les mesures de l'expression en un objet JSON. Les
+ * compteurs sont les écarts de l'arène depuis parse_expression(); seules
+ * les règles appliquées au moins une fois figurent dans "regles". */
+static void serialize_expr_stats(StrBuf *buf, const ExprStats *expr, int valid) {
+    const ArenaStats *now = &current_arena->stats;
+    const ArenaStats *before = &expr->before;
+    const char *separator = "";
+    int rule;
+    
+    strbuf_puts(buf, valid ? "{\"valide\":true,\"temps_ns\":{" : "{\"valide\":false,\"temps_ns\":{");
+    json_field(buf, "analyse", (uint64_t)expr->parse_ns);
+    strbuf_putc(buf, ',');
+    json_field(buf, "derivation", (uint64_t)expr->derive_ns);
+    strbuf_putc(buf, ',');
+    json_field(buf, "simplification", (uint64_t)expr->simplify_ns);
+    strbuf_putc(buf, ',');
+    json_field(buf, "ecriture", (uint64_t)expr->print_ns);
+    strbuf_puts(buf, "},");
+    json_shape(buf, "expression", expr->nodes, expr->depth);
+    json_shape(buf, "derivee", expr->derivative_nodes, expr->derivative_depth);
+    json_shape(buf, "simplifiee", expr->simplified_nodes, expr->simplified_depth);
+    json_field(buf, "octets_sortie", expr->output_bytes);
+    strbuf_putc(buf, ',');
+    json_field(buf, "create_node", now->allocs - before->allocs);
+    strbuf_putc(buf, ',');
+    json_field(buf, "copy_tree", now->copies - before->copies);
+    strbuf_putc(buf, ',');
+    json_field(buf, "liberes", now->released - before->released);
+    strbuf_putc(buf, ',');
+    json_field(buf, "partages", now->shared - before->shared);
+    strbuf_puts(buf, ",\"regles\":{");
+    for (rule = RULE_NONE + 1; rule < RULE_COUNT; rule++) {
+        if (now->rules[rule] == before->rules[rule]) continue;
+        strbuf_puts(buf, separator);
+        json_field(buf, rule_names[rule], now->rules[rule] - before->rules[rule]);
+        separator = ",";
+    }
+    strbuf_puts(buf, "}}");
+}
+
+/* === BIBLIOTHÈQUE === */
+
+/* Contexte de libderivative: une arène et les textes rendus. Les nœuds de
+ * l'arène sont les DerivExpr de l'appelant. */
+struct DerivContext {
+    Arena arena;
+    int shared;            // DERIV_SHARED: arène en mode DAG
+    int session;           // DERIV_SESSION: l'arène n'est pas vidée après deriv_derive()
+    ParseReuse reuse;      // Groupes de la dernière expression de la session
+    int live;              // Des expressions des étapes séparées sont en vie
+    Symbol var;            // Dernière variable demandée
+    StrBuf output;         // Dernier texte rendu
+    StrBuf stats;          // Mesures JSON du dernier deriv_derive()
+    DerivError error;
+};
+
+#define SESSION_MAX_NODES (1 << 21)    // Nœuds gardés par une session avant de repartir de zéro
+
+/* Arguments d'un appel, passés à son corps par library_run() */
+typedef struct {
+    const char *text;
+    const DerivOptions *options;
+    const char *var;
+    Node *node;
+    Node *result;
+} LibraryCall;
+
+typedef DerivStatus (*LibraryBody)(DerivContext *context, LibraryCall *call);
+
+static DerivStatus library_error(DerivContext *context, DerivStatus status,
+                                 const char *message, size_t position) {
+    context->error.status = status;
+    context->error.message = message;
+    context->error.position = position;
+    context->error.size = 0;
+    return status;
+}
+
+/* Exécute body sur l'arène du contexte. Une erreur fatale (mémoire épuisée)
+ * y revient par fatal(): l'arène est vidée, et les piles de travail de
+ * l'appel interrompu ne sont pas rendues. */
+static DerivStatus library_run(DerivContext *context, LibraryBody body, LibraryCall *call) {
+    Arena *previous = arena_use(&context->arena);
+    jmp_buf *outer = fatal_jump;
+    jmp_buf jump;
+    DerivStatus status;
+    
+    library_error(context, DERIV_OK, "", 0);
+    fatal_jump = &jump;
+    if (setjmp(jump) == 0) {
+        status = body(context, call);
+    } else {
+        arena_reset(&context->arena);
+        arena_set_hash_consing(&context->arena, context->shared);
+        parse_reuse_clear(&context->reuse);
+        context->live = 0;
+        context->output.length = 0;
+        context->stats.length = 0;
+        call->result = NULL;
+        status = library_error(context, DERIV_ERROR_MEMORY, fatal_message, 0);
+    }
+    fatal_jump = outer;
+    arena_use(previous);
+    return status;
+}
+
+/* Termine le texte rendu par '\0' (non compté dans sa longueur) */
+static void library_terminate(StrBuf *buf) {
+    strbuf_putc(buf, '\0');
+    buf->length--;
+}
+
+/* Symbole de la variable name (NULL: x) dans context->var; la dernière
+ * variable est reconnue sans repasser par la table des symboles, tant que
+ * son symbole n'a pas été oublié avec l'arène */
+static int library_variable(DerivContext *context, const char *name) {
+    char letter[2];
+    
+    if (name == NULL) name = "x";
+    if (context->var < symbol_count() && strcmp(symbol_text(context->var, letter), name) == 0) {
+        return 1;
+    }
+    return variable_symbol(name, &context->var);
+}
+
+static DerivStatus call_parse(DerivContext *context, LibraryCall *call) {
+    Parser parser;
+    
+    call->result = parse_string(&parser, call->text);
+    if (call->result == NULL) {
+        return library_error(context, DERIV_ERROR_SYNTAX, parser.error, parser.error_pos);
+    }
+    context->live = 1;
+    return DERIV_OK;
+}
+
+static DerivStatus call_differentiate(DerivContext *context, LibraryCall *call) {
+    if (!library_variable(context, call->var)) {
+        return library_error(context, DERIV_ERROR_VARIABLE, "Erreur: variable invalide", 0);
+    }
+    call->result = differentiate(call->node, context->var);
+    return DERIV_OK;
+}
+
+static DerivStatus call_simplify(DerivContext *context, LibraryCall *call) {
+    (void)context;
+    call->result = simplify(call->node);
+    return DERIV_OK;
+}
+
+static DerivStatus call_print(DerivContext *context, LibraryCall *call) {
+    context->output.length = 0;
+    serialize_tree(&context->output, call->node);
+    library_terminate(&context->output);
+    return DERIV_OK;
+}
+
+/* Analyse, dérivation, simplification et écriture de call->text. L'arène
+ * est vidée après l'appel: au-delà du premier ordre, elle passe en mode DAG
+ * le temps de l'appel. En session, elle est gardée: les nœuds uniques de
+ * l'expression suivante retrouvent ceux des sous-expressions inchangées,
+ * avec leurs dérivées (cache de dérivation) et leurs formes simplifiées. */
+static DerivStatus call_derive(DerivContext *context, LibraryCall *call) {
+    const DerivOptions *options = call->options;
+    DeriveOptions derive;
+    ExprStats expr, *stats = options->stats ? &expr : NULL;
+    DerivStatus status = DERIV_OK;
+    Parser parser;
+    Node *tree;
+    size_t length;
+    
+    if (options->order < 0 || options->order > ORDER_MAX) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: ordre invalide (1 à 16)", 0);
+    }
+    if (options->flat && (options->cse || options->canonical)) {
+        return library_error(context, DERIV_ERROR_ARGUMENT,
+                             "Erreur: --flat ne se combine pas avec --cse ni --canonical", 0);
+    }
+    if (context->live || (context->session && context->arena.stats.nodes > SESSION_MAX_NODES)) {
+        arena_reset(&context->arena);
+        parse_reuse_clear(&context->reuse);
+        context->live = 0;
+    }
+    if (!library_variable(context, options->var)) {
+        return library_error(context, DERIV_ERROR_VARIABLE, "Erreur: variable invalide", 0);
+    }
+    derive.var = context->var;
+    derive.cse = options->cse;
+    derive.canonical = options->canonical;
+    derive.flat = options->flat;
+    derive.max_output = options->max_output;
+    derive.order = options->order > 0 ? options->order : 1;
+    derive.stats = options->stats;
+    
+    if (derive.order > 1) arena_set_hash_consing(&context->arena, 1);
+    context->output.length = 0;
+    context->stats.length = 0;
+    
+    tree = parse_expression(&parser, call->text, context->session ? &context->reuse : NULL, stats);
+    if (tree == NULL) {
+        status = library_error(context, DERIV_ERROR_SYNTAX, parser.error, parser.error_pos);
+    } else {
+        length = render_derivative(&context->output, tree, &derive, stats);
+        if (derive.max_output > 0 && length > derive.max_output) {
+            status = library_error(context, DERIV_ERROR_TOO_LARGE, "Erreur: dérivée trop longue", 0);
+            context->error.size = length;
+        }
+    }
+    if (stats != NULL) serialize_expr_stats(&context->stats, stats, tree != NULL);
+    library_terminate(&context->output);
+    library_terminate(&context->stats);
+    
+    if (!context->session) {
+        arena_reset(&context->arena);
+        arena_set_hash_consing(&context->arena, context->shared);
+    }
+    return status;
+}
+
+/* Contexte avec sa propre table des symboles (own_symbols), ou partageant
+ * celle du processus comme le programme en ligne de commande, dont les
+ * symboles (--var) sont internés avant la création du contexte */
+static DerivContext *context_new(int flags, int own_symbols) {
+    DerivContext *context = (DerivContext *)calloc(1, sizeof(DerivContext));
+    
+    if (context == NULL) return NULL;
+    arena_init(&context->arena);
+    if (own_symbols) {
+        context->arena.symbols = (SymbolTable *)calloc(1, sizeof(SymbolTable));
+        if (context->arena.symbols == NULL) {
+            free(context);
+            return NULL;
+        }
+    }
+    context->session = (flags & DERIV_SESSION) != 0;
+    context->shared = (flags & DERIV_SHARED) != 0 || context->session;
+    arena_set_hash_consing(&context->arena, context->shared);
+    context->var = 'x';
+    strbuf_init(&context->output, NULL, 0);
+    strbuf_init(&context->stats, NULL, 0);
+    library_error(context, DERIV_OK, "", 0);
+    return context;
+}
+
+/* Un contexte de la bibliothèque a sa propre table des symboles: les noms
+ * qu'il reçoit (d'un client du serveur, par exemple) sont oubliés avec son
+ * arène au lieu de s'accumuler dans le processus */
+DerivContext *deriv_context_new(int flags) {
+    return context_new(flags, 1);
+}
+
+void deriv_context_free(DerivContext *context) {
+    if (context == NULL) return;
+    arena_destroy(&context->arena);
+    parse_reuse_free(&context->reuse);
+    strbuf_free(&context->output);
+    strbuf_free(&context->stats);
+    free(context);
+}
+
+void deriv_context_reset(DerivContext *context) {
+    if (context == NULL) return;
+    arena_reset(&context->arena);
+    parse_reuse_clear(&context->reuse);
+    context->live = 0;
+}
+
+const DerivError *deriv_last_error(const DerivContext *context) {
+    return &context->error;
+}
+
+const char *deriv_last_stats(const DerivContext *context) {
+    return context->stats.length > 0 ? context->stats.data : "";
+}
+
+DerivStatus deriv_parse(DerivContext *context, const char *text, DerivExpr **expr) {
+    LibraryCall call = {NULL, NULL, NULL, NULL, NULL};
+    DerivStatus status;
+    
+    if (context == NULL) return DERIV_ERROR_ARGUMENT;
+    if (text == NULL || expr == NULL) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: argument invalide", 0);
+    }
+    call.text = text;
+    status = library_run(context, call_parse, &call);
+    *expr = (DerivExpr *)call.result;
+    return status;
+}
+
+DerivStatus deriv_differentiate(DerivContext *context, const DerivExpr *expr,
+                                const char *var, DerivExpr **derivative) {
+    LibraryCall call = {NULL, NULL, NULL, NULL, NULL};
+    DerivStatus status;
+    
+    if (context == NULL) return DERIV_ERROR_ARGUMENT;
+    if (expr == NULL || derivative == NULL) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: argument invalide", 0);
+    }
+    call.node = (Node *)expr;
+    call.var = var;
+    status = library_run(context, call_differentiate, &call);
+    *derivative = (DerivExpr *)call.result;
+    return status;
+}
+
+DerivStatus deriv_simplify(DerivContext *context, DerivExpr *expr, DerivExpr **simplified) {
+    LibraryCall call = {NULL, NULL, NULL, NULL, NULL};
+    DerivStatus status;
+    
+    if (context == NULL) return DERIV_ERROR_ARGUMENT;
+    if (expr == NULL || simplified == NULL) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: argument invalide", 0);
+    }
+    call.node = (Node *)expr;
+    status = library_run(context, call_simplify, &call);
+    *simplified = (DerivExpr *)call.result;
+    return status;
+}
+
+DerivStatus deriv_print(DerivContext *context, const DerivExpr *expr,
+                        const char **text, size_t *length) {
+    LibraryCall call = {NULL, NULL, NULL, NULL, NULL};
+    DerivStatus status;
+    
+    if (context == NULL) return DERIV_ERROR_ARGUMENT;
+    if (expr == NULL || text == NULL) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: argument invalide", 0);
+    }
+    call.node = (Node *)expr;
+    status = library_run(context, call_print, &call);
+    *text = status == DERIV_OK ? context->output.data : NULL;
+    if (length != NULL) *length = status == DERIV_OK ? context->output.length : 0;
+    return status;
+}
+
+DerivStatus deriv_derive(DerivContext *context, const char *text, const DerivOptions *options,
+                         const char **result, size_t *length) {
+    static const DerivOptions defaults = {NULL, 0, 0, 0, 0, 0, 0};
+    LibraryCall call = {NULL, NULL, NULL, NULL, NULL};
+    DerivStatus status;
+    
+    if (context == NULL) return DERIV_ERROR_ARGUMENT;
+    if (text == NULL || result == NULL) {
+        return library_error(context, DERIV_ERROR_ARGUMENT, "Erreur: argument invalide", 0);
+    }
+    call.text = text;
+    call.options = options != NULL ? options : &defaults;
+    status = library_run(context, call_derive, &call);
+    *result = status == DERIV_OK ? context->output.data : NULL;
+    if (length != NULL) *length = status == DERIV_OK ? context->output.length : 0;
+    return status;
+}
+
+#ifndef DERIVATIVE_LIBRARY
+
+/* === ÉVALUATION (BYTECODE) === */
+
+void program_init(Program *prog) {
+    memset(prog, 0, sizeof(*prog));
+}
+
+void program_free(Program *prog) {
+    free(prog->code);
+    free(prog->constants);
+    program_init(prog);
+}
+
+/* Ajoute une instruction; delta est son effet sur la profondeur de pile */
+static void emit(Program *prog, OpCode op, uint32_t arg, int delta) {
+    if (prog->count == prog->capacity) {
+        prog->capacity = prog->capacity ? 2 * prog->capacity : 64;
+        prog->code = (Instr *)xrealloc(prog->code, prog->capacity * sizeof(Instr));
+    }
+    prog->code[prog->count].op = (uint8_t)op;
+    prog->code[prog->count].arg = arg;
+    prog->count++;
+    
+    prog->depth += delta;
+    if (prog->depth > prog->max_depth) prog->max_depth = prog->depth;
+}
+
+static uint32_t add_constant(Program *prog, double value) {
+    if (prog->const_count == prog->const_capacity) {
+        prog->const_capacity = prog->const_capacity ? 2 * prog->const_capacity : 16;
+        prog->constants = (double *)xrealloc(prog->constants,
+                                             prog->const_capacity * sizeof(double));
+    }
+    prog->constants[prog->const_count] = value;
+    return (uint32_t)prog->const_count++;
+}
+
+/* Puissance à exposant entier constant: multiplications au lieu de pow() */
+static int is_powi(const Node *node) {
+    return node->type == NODE_POW && node->right->type == NODE_NUMBER &&
+           node->right->value == (int)node->right->value && fabs(node->right->value) <= EVAL_POWI_MAX;
+}
+
+/* Compile un arbre en notation postfixe: le résultat est au sommet de la
+ * pile. État 0: empiler les fils; état 1: fils compilés, émettre le nœud. */
+void compile_tree(Program *prog, Node *node) {
+    WorkStack stack;
+    
+    work_init(&stack);
+    work_push(&stack, node, 0);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        
+        node = item.node;
+        if (item.state == 0) {
+            if (node->type == NODE_NUMBER) {
+                emit(prog, OP_CONST, add_constant(prog, node->value), 1);
+            } else if (node->type == NODE_VARIABLE) {
+                emit(prog, OP_VAR, node->variable, 1);
+            } else {
+                work_push(&stack, node, 1);
+                if (node->right != NULL && !is_powi(node)) work_push(&stack, node->right, 0);
+                work_push(&stack, node->left, 0);
+            }
+        } else if (is_powi(node)) {
+            emit(prog, OP_POWI, (uint32_t)(int32_t)node->right->value, 0);
+        } else if (node->right != NULL) {
+            emit(prog, (OpCode)(OP_ADD + (node->type - NODE_ADD)), 0, -1);
+        } else {
+            emit(prog, (OpCode)(OP_SIN + (node->type - NODE_SIN)), 0, 0);
+        }
+    }
+    work_free(&stack);
+}
+
+/* x^n par exponentiation binaire */
+static double powi(double x, int32_t n) {
+    uint32_t m = n < 0 ? 0u - (uint32_t)n : (uint32_t)n;
+    double result = 1;
+    
+    while (m != 0) {
+        if (m & 1) result *= x;
+        x *= x;
+        m >>= 1;
+    }
+    return n < 0 ? 1 / result : result;
+}
+
+/* Interprète le programme sur un bloc de len points (len <= EVAL_BLOCK) à
+ * partir de start; le résultat est dans la première colonne de stack. */
+static void eval_block_scalar(const Program *prog, const double *const *bindings,
+                              size_t start, size_t len, double *stack) {
+    size_t sp = 0;
+    size_t i, j;
+    
+    for (i = 0; i < prog->count; i++) {
+        const Instr *ins = &prog->code[i];
+        double *top = stack + sp * EVAL_BLOCK;      // Première colonne libre
+        double *a = top - EVAL_BLOCK;                // Sommet de pile
+        double *b = top;
+        
+        /* Opération binaire: a = avant-dernière colonne, b = sommet */
+        if (ins->op >= OP_ADD && ins->op <= OP_POW) {
+            a -= EVAL_BLOCK;
+            b -= EVAL_BLOCK;
+            sp--;
+        }
+        
+        switch ((OpCode)ins->op) {
+            case OP_CONST:
+                for (j = 0; j < len; j++) top[j] = prog->constants[ins->arg];
+                sp++;
+                break;
+            case OP_VAR:
+                memcpy(top, bindings[ins->arg] + start, len * sizeof(double));
+                sp++;
+                break;
+            case OP_ADD:
+                for (j = 0; j < len; j++) a[j] += b[j];
+                break;
+            case OP_SUB:
+                for (j = 0; j < len; j++) a[j] -= b[j];
+                break;
+            case OP_MUL:
+                for (j = 0; j < len; j++) a[j] *= b[j];
+                break;
+            case OP_DIV:
+                for (j = 0; j < len; j++) a[j] /= b[j];
+                break;
+            case OP_POW:
+                for (j = 0; j < len; j++) a[j] = pow(a[j], b[j]);
+                break;
+            case OP_SIN:
+                for (j = 0; j < len; j++) a[j] = sin(a[j]);
+                break;
+            case OP_COS:
+                for (j = 0; j < len; j++) a[j] = cos(a[j]);
+                break;
+            case OP_EXP:
+                for (j = 0; j < len; j++) a[j] = exp(a[j]);
+                break;
+            case OP_LN:
+                for (j = 0; j < len; j++) a[j] = log(a[j]);
+                break;
+            case OP_POWI:
+                for (j = 0; j < len; j++) a[j] = powi(a[j], (int32_t)ins->arg);
+                break;
+        }
+    }
+}
+
+/* === ÉVALUATION VECTORIELLE (AVX2) === */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_SIMD 1
+
+/* Les noyaux travaillent sur 4 doubles (extensions vectorielles de GCC). Ils
+ * sont compilés pour AVX2 et ne sont appelés que si le processeur le permet. */
+typedef double v4d __attribute__((vector_size(32)));
+typedef int64_t v4i __attribute__((vector_size(32)));
+typedef uint64_t v4u __attribute__((vector_size(32)));
+
+#define SIMD_INLINE static inline __attribute__((always_inline, target("avx2")))
+#define SIMD_WIDTH 4
+#define SIMD_TRIG_MAX 1e5          // Au-delà, sin/cos passent par la libm
+#define SIMD_MAGIC 0x1.8p52        // x + MAGIC arrondit x à l'entier le plus proche
+
+SIMD_INLINE v4d v4d_splat(double x) {
+    v4d v = {x, x, x, x};
+    return v;
+}
+
+SIMD_INLINE v4i v4i_splat(int64_t x) {
+    v4i v = {x, x, x, x};
+    return v;
+}
+
+/* mask ? a : b, voie par voie (mask vaut 0 ou -1) */
+SIMD_INLINE v4d v4d_select(v4i mask, v4d a, v4d b) {
+    return (v4d)(((v4i)a & mask) | ((v4i)b & ~mask));
+}
+
+SIMD_INLINE int v4i_any(v4i mask) {
+    return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+SIMD_INLINE v4d v4d_abs(v4d x) {
+    return (v4d)((v4i)x & v4i_splat(INT64_MAX));
+}
+
+/* Arrondi à l'entier le plus proche; *n reçoit l'entier (|x| < 2^51) */
+SIMD_INLINE v4d v4d_round(v4d x, v4i *n) {
+    v4d t = x + v4d_splat(SIMD_MAGIC);
+    *n = (v4i)t - (v4i)v4d_splat(SIMD_MAGIC);
+    return t - v4d_splat(SIMD_MAGIC);
+}
+
+/* 2^n pour -1022 <= n <= 1023 */
+SIMD_INLINE v4d v4d_exp2i(v4i n) {
+    return (v4d)((n + 1023) << 52);
+}
+
+/* e^(x+c), c étant une correction de l'ordre de l'ulp de x (0 pour exp):
+ * x = k*ln2 + r, |r| <= ln2/2, e^r par Taylor de degré 13 */
+SIMD_INLINE v4d v4d_expc(v4d x, v4d c) {
+    static const double coeffs[] = {
+        1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0,
+        1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0,
+        1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+    };
+    v4d xc = v4d_select(x > v4d_splat(710), v4d_splat(710), x);
+    v4d k, r, p, y;
+    v4i n, n1;
+    size_t i;
+    
+    xc = v4d_select(xc < v4d_splat(-746), v4d_splat(-746), xc);
+    k = v4d_round(xc * v4d_splat(1.44269504088896338700e+00), &n);
+    r = xc - k * v4d_splat(6.93147180369123816490e-01) - k * v4d_splat(1.90821492927058770002e-10) + c;
+    
+    p = v4d_splat(coeffs[0]);
+    for (i = 1; i < sizeof(coeffs) / sizeof(coeffs[0]); i++) {
+        p = p * r + v4d_splat(coeffs[i]);
+    }
+    
+    /* 2^n en deux facteurs pour couvrir les résultats dénormalisés (sans
+     * décalage arithmétique 64 bits, absent d'AVX2) */
+    v4d_round(k * v4d_splat(0.5), &n1);
+    y = p * v4d_exp2i(n1) * v4d_exp2i(n - n1);
+    y = v4d_select(x > v4d_splat(709.782712893383973096), v4d_splat(INFINITY), y);
+    y = v4d_select(x < v4d_splat(-745.2), v4d_splat(0), y);
+    return v4d_select(x != x, x, y);
+}
+
+SIMD_INLINE v4d v4d_exp(v4d x) {
+    return v4d_expc(x, v4d_splat(0));
+}
+
+/* Réduction de ln: x = 2^e * (1+f), sqrt(2)/2 <= 1+f < sqrt(2). Rend f et
+ * e (en double) dans *dk. */
+SIMD_INLINE v4d v4d_log_reduce(v4d x, v4d *dk) {
+    v4i subnormal = (x < v4d_splat(0x1p-1022)) & (x > v4d_splat(0));
+    v4d xs = v4d_select(subnormal, x * v4d_splat(0x1p54), x);
+    v4i bits = (v4i)xs;
+    v4i e = (v4i)((v4u)bits >> 52) - v4i_splat(1023) - (subnormal & v4i_splat(54));
+    v4d m = (v4d)((bits & v4i_splat(0x000fffffffffffffLL)) | v4i_splat(0x3ff0000000000000LL));
+    v4i big = m > v4d_splat(1.41421356237309504880);
+    
+    m = v4d_select(big, m * v4d_splat(0.5), m);
+    e = e - big;
+    *dk = (v4d)(e + (v4i)v4d_splat(SIMD_MAGIC)) - v4d_splat(SIMD_MAGIC);
+    return m - v4d_splat(1);
+}
+
+/* (ln(1+f) - 2s) / s, s = f/(2+f): polynôme de fdlibm en z = s^2 */
+SIMD_INLINE v4d v4d_log_poly(v4d s) {
+    v4d z = s * s, w = z * z;
+    v4d r = w * (v4d_splat(3.999999999940941908e-01) + w * (v4d_splat(2.222219843214978396e-01) +
+                 w * v4d_splat(1.531383769920937332e-01)));
+    
+    return r + z * (v4d_splat(6.666666666666735130e-01) + w * (v4d_splat(2.857142874366239149e-01) +
+                    w * (v4d_splat(1.818357216161805012e-01) + w * v4d_splat(1.479819860511658591e-01))));
+}
+
+/* ln: polynôme de fdlibm après réduction */
+SIMD_INLINE v4d v4d_log(v4d x) {
+    v4d dk, f = v4d_log_reduce(x, &dk);
+    v4d s = f / (v4d_splat(2) + f);
+    v4d r = v4d_log_poly(s), hfsq, y;
+    
+    hfsq = v4d_splat(0.5) * f * f;
+    y = dk * v4d_splat(6.93147180369123816490e-01) -
+        ((hfsq - (s * (hfsq + r) + dk * v4d_splat(1.90821492927058770002e-10))) - f);
+    
+    y = v4d_select(x == v4d_splat(INFINITY), x, y);
+    y = v4d_select(x == v4d_splat(0), v4d_splat(-INFINITY), y);
+    y = v4d_select(x < v4d_splat(0), v4d_splat(NAN), y);
+    return v4d_select(x != x, x, y);
+}
+
+/* a*b = produit + *lo exactement (découpage de Veltkamp, sans FMA) */
+SIMD_INLINE v4d v4d_two_prod(v4d a, v4d b, v4d *lo) {
+    v4d p = a * b;
+    v4d ca = a * v4d_splat(134217729.0), cb = b * v4d_splat(134217729.0);
+    v4d ah = ca - (ca - a), bh = cb - (cb - b);
+    v4d al = a - ah, bl = b - bh;
+    
+    *lo = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+    return p;
+}
+
+/* ln x = résultat + *lo à 2^-60 près environ (x > 0 fini): ln(1+f) = 2s +
+ * s*R(s^2), avec s = f/(2+f) en double-double */
+SIMD_INLINE v4d v4d_log_dd(v4d x, v4d *lo) {
+    v4d dk, f = v4d_log_reduce(x, &dk);
+    v4d d = v4d_splat(2) + f, dl = f - (d - v4d_splat(2));
+    v4d s = f / d, p, pl, sl, a, h, hi, err, b;
+    
+    p = v4d_two_prod(s, d, &pl);
+    sl = (((f - p) - pl) - s * dl) / d;
+    
+    /* dk*ln2_hi est exact; somme exacte avec 2s, puis les termes de queue */
+    a = dk * v4d_splat(6.93147180369123816490e-01);
+    h = v4d_splat(2) * s;
+    hi = a + h;
+    b = hi - a;
+    err = (a - (hi - b)) + (h - b);
+    err += dk * v4d_splat(1.90821492927058770002e-10) + (v4d_splat(2) * sl + s * v4d_log_poly(s));
+    
+    a = hi + err;
+    *lo = err - (a - hi);
+    return a;
+}
+
+/* sin (cosine = 0) ou cos (cosine = 1): réduction de Cody-Waite modulo pi/2,
+ * polynômes de fdlibm sur [-pi/4, pi/4] */
+SIMD_INLINE v4d v4d_sincos(v4d x, int cosine) {
+    v4d k, r, z, ps, pc, hz, w, y;
+    v4i q, swap;
+    
+    if (v4i_any(v4d_abs(x) > v4d_splat(SIMD_TRIG_MAX))) {
+        int i;
+        for (i = 0; i < SIMD_WIDTH; i++) x[i] = cosine ? cos(x[i]) : sin(x[i]);
+        return x;
+    }
+    
+    k = v4d_round(x * v4d_splat(6.36619772367581382433e-01), &q);
+    r = x - k * v4d_splat(1.57079632673412561417e+00);
+    r = r - k * v4d_splat(6.07710050630396597660e-11);
+    r = r - k * v4d_splat(2.02226624871116645580e-21);
+    q = q + v4i_splat(cosine);
+    
+    z = r * r;
+    ps = r + r * z * (v4d_splat(-1.66666666666666324348e-01) + z * (v4d_splat(8.33333333332248946124e-03) +
+         z * (v4d_splat(-1.98412698298579493134e-04) + z * (v4d_splat(2.75573137070700676789e-06) +
+         z * (v4d_splat(-2.50507602534068634195e-08) + z * v4d_splat(1.58969099521155010221e-10))))));
+    hz = v4d_splat(0.5) * z;
+    w = v4d_splat(1) - hz;
+    pc = w + (((v4d_splat(1) - w) - hz) + z * z * (v4d_splat(4.16666666666666019037e-02) +
+         z * (v4d_splat(-1.38888888888741095749e-03) + z * (v4d_splat(2.48015872894767294178e-05) +
+         z * (v4d_splat(-2.75573143513906633035e-07) + z * (v4d_splat(2.08757232129817482790e-09) +
+         z * v4d_splat(-1.13596475577881948265e-11)))))));
+    
+    /* Quadrant: q impair -> polynôme du cosinus, bit 1 de q -> changement de signe */
+    swap = -(q & v4i_splat(1));
+    y = v4d_select(swap, pc, ps);
+    return (v4d)((v4i)y ^ ((q & v4i_splat(2)) << 62));
+}
+
+/* x^y réel: exp(y * ln x) pour x > 0 fini, libm pour les autres voies.
+ * y * ln x est formé en double-double: arrondi en double, son erreur absolue
+ * (jusqu'à 709 * 2^-53) deviendrait une erreur relative de centaines d'ulp. */
+SIMD_INLINE v4d v4d_pow(v4d x, v4d y) {
+    v4i special = (x <= v4d_splat(0)) | (v4d_abs(x) == v4d_splat(INFINITY)) | (x != x) |
+                  (v4d_abs(y) > v4d_splat(0x1p900)) | (y != y);
+    v4d lo, hi, t, tl;
+    
+    if (v4i_any(special)) {
+        int i;
+        for (i = 0; i < SIMD_WIDTH; i++) x[i] = pow(x[i], y[i]);
+        return x;
+    }
+    hi = v4d_log_dd(x, &lo);
+    t = v4d_two_prod(y, hi, &tl);
+    return v4d_expc(t, tl + y * lo);
+}
+
+SIMD_INLINE v4d v4d_powi(v4d x, int32_t n) {
+    uint32_t m = n < 0 ? 0u - (uint32_t)n : (uint32_t)n;
+    v4d result = v4d_splat(1);
+    
+    while (m != 0) {
+        if (m & 1) result *= x;
+        x *= x;
+        m >>= 1;
+    }
+    return n < 0 ? v4d_splat(1) / result : result;
+}
+
+/* Même interprète que eval_block_scalar, SIMD_WIDTH points par opération. Les
+ * colonnes sont alignées et complétées jusqu'à un multiple de SIMD_WIDTH. */
+SIMD_INLINE void eval_block_vector(const Program *prog, const double *const *bindings,
+                                   size_t start, size_t len, double *stack) {
+    size_t padded = (len + SIMD_WIDTH - 1) & ~(size_t)(SIMD_WIDTH - 1);
+    size_t sp = 0;
+    size_t i, j;
+    
+    for (i = 0; i < prog->count; i++) {
+        const Instr *ins = &prog->code[i];
+        double *top = stack + sp * EVAL_BLOCK;
+        v4d *a = (v4d *)(top - EVAL_BLOCK);
+        v4d *b = (v4d *)top;
+        size_t count = padded / SIMD_WIDTH;
+        
+        if (ins->op >= OP_ADD && ins->op <= OP_POW) {
+            a -= EVAL_BLOCK / SIMD_WIDTH;
+            b -= EVAL_BLOCK / SIMD_WIDTH;
+            sp--;
+        }
+        
+        switch ((OpCode)ins->op) {
+            case OP_CONST:
+                for (j = 0; j < count; j++) b[j] = v4d_splat(prog->constants[ins->arg]);
+                sp++;
+                break;
+            case OP_VAR:
+                memcpy(top, bindings[ins->arg] + start, len * sizeof(double));
+                for (j = len; j < padded; j++) top[j] = 1;
+                sp++;
+                break;
+            case OP_ADD:
+                for (j = 0; j < count; j++) a[j] += b[j];
+                break;
+            case OP_SUB:
+                for (j = 0; j < count; j++) a[j] -= b[j];
+                break;
+            case OP_MUL:
+                for (j = 0; j < count; j++) a[j] *= b[j];
+                break;
+            case OP_DIV:
+                for (j = 0; j < count; j++) a[j] /= b[j];
+                break;
+            case OP_POW:
+                for (j = 0; j < count; j++) a[j] = v4d_pow(a[j], b[j]);
+                break;
+            case OP_SIN:
+                for (j = 0; j < count; j++) a[j] = v4d_sincos(a[j], 0);
+                break;
+            case OP_COS:
+                for (j = 0; j < count; j++) a[j] = v4d_sincos(a[j], 1);
+                break;
+            case OP_EXP:
+                for (j = 0; j < count; j++) a[j] = v4d_exp(a[j]);
+                break;
+            case OP_LN:
+                for (j = 0; j < count; j++) a[j] = v4d_log(a[j]);
+                break;
+            case OP_POWI:
+                for (j = 0; j < count; j++) a[j] = v4d_powi(a[j], (int32_t)ins->arg);
+                break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void eval_block_avx2(const Program *prog, const double *const *bindings,
+                            size_t start, size_t len, double *stack) {
+    eval_block_vector(prog, bindings, start, len, stack);
+}
+#endif
+
+/* Meilleur jeu d'instructions disponible sur le processeur courant */
+EvalIsa eval_detect_isa(void) {
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return EVAL_AVX2;
+#endif
+    return EVAL_SCALAR;
+}
+
+static EvalIsa default_isa;
+static pthread_once_t default_isa_once = PTHREAD_ONCE_INIT;
+
+static void init_default_isa(void) {
+    default_isa = eval_detect_isa();
+}
+
+/* Évalue le programme en n points. bindings[c] donne les n valeurs de la
+ * variable c. Chaque instruction traite EVAL_BLOCK points d'un coup: le coût
+ * de décodage est amorti et les boucles internes sont sans branchement. */
+void program_eval_isa(const Program *prog, const double *const *bindings, size_t n, double *out,
+                      EvalIsa isa) {
+    void (*eval_block)(const Program *, const double *const *, size_t, size_t, double *) =
+        eval_block_scalar;
+    double *stack = NULL;
+    size_t start;
+    
+#ifdef HAVE_SIMD
+    if (isa == EVAL_AVX2) eval_block = eval_block_avx2;
+#else
+    (void)isa;
+#endif
+    
+    /* Colonnes alignées pour les chargements vectoriels */
+    if (posix_memalign((void **)&stack, 64, prog->max_depth * EVAL_BLOCK * sizeof(double)) != 0) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        exit(1);
+    }
+    
+    for (start = 0; start < n; start += EVAL_BLOCK) {
+        size_t len = n - start < EVAL_BLOCK ? n - start : EVAL_BLOCK;
+        eval_block(prog, bindings, start, len, stack);
+        memcpy(out + start, stack, len * sizeof(double));
+    }
+    
+    free(stack);
+}
+
+/* Évaluation avec le jeu d'instructions choisi selon le processeur */
+void program_eval(const Program *prog, const double *const *bindings, size_t n, double *out) {
+    pthread_once(&default_isa_once, init_default_isa);
+    program_eval_isa(prog, bindings, n, out, default_isa);
+}
+
+/* === DIFFÉRENTIATION AUTOMATIQUE (MODE DIRECT) === */
+
+/* Interprète le programme sur des nombres duaux (valeur, dérivée) pour un
+ * bloc de len points: chaque colonne de valeurs de stack a sa colonne de
+ * dérivées au même rang dans deriv. */
+static void eval_block_dual(const Program *prog, const double *const *bindings, Symbol var,
+                            size_t start, size_t len, double *stack, double *deriv) {
+    size_t sp = 0;
+    size_t i, j;
+    
+    for (i = 0; i < prog->count; i++) {
+        const Instr *ins = &prog->code[i];
+        double *top = stack + sp * EVAL_BLOCK;
+        double *dtop = deriv + sp * EVAL_BLOCK;
+        double *a = top - EVAL_BLOCK, *da = dtop - EVAL_BLOCK;
+        double *b = top, *db = dtop;
+        
+        if (ins->op >= OP_ADD && ins->op <= OP_POW) {
+            a -= EVAL_BLOCK;
+            da -= EVAL_BLOCK;
+            b -= EVAL_BLOCK;
+            db -= EVAL_BLOCK;
+            sp--;
+        }
+        
+        switch ((OpCode)ins->op) {
+            case OP_CONST:
+                for (j = 0; j < len; j++) {
+                    top[j] = prog->constants[ins->arg];
+                    dtop[j] = 0;
+                }
+                sp++;
+                break;
+            case OP_VAR:
+                memcpy(top, bindings[ins->arg] + start, len * sizeof(double));
+                for (j = 0; j < len; j++) dtop[j] = ins->arg == var;
+                sp++;
+                break;
+            case OP_ADD:
+                /* (f + g)' = f' + g' */
+                for (j = 0; j < len; j++) {
+                    a[j] += b[j];
+                    da[j] += db[j];
+                }
+                break;
+            case OP_SUB:
+                /* (f - g)' = f' - g' */
+                for (j = 0; j < len; j++) {
+                    a[j] -= b[j];
+                    da[j] -= db[j];
+                }
+                break;
+            case OP_MUL:
+                /* (f * g)' = f' * g + f * g' */
+                for (j = 0; j < len; j++) {
+                    da[j] = da[j] * b[j] + a[j] * db[j];
+                    a[j] *= b[j];
+                }
+                break;
+            case OP_DIV:
+                /* (f / g)' = (f' - (f / g) * g') / g */
+                for (j = 0; j < len; j++) {
+                    a[j] /= b[j];
+                    da[j] = (da[j] - a[j] * db[j]) / b[j];
+                }
+                break;
+            case OP_POW:
+                /* (f^g)' = g * f^(g-1) * f' si g' = 0, sinon f^g * (g' * ln(f) + g * f'/f) */
+                for (j = 0; j < len; j++) {
+                    double value = pow(a[j], b[j]);
+                    if (db[j] == 0) {
+                        da[j] = da[j] == 0 ? 0 : b[j] * pow(a[j], b[j] - 1) * da[j];
+                    } else {
+                        da[j] = value * (db[j] * log(a[j]) + b[j] * da[j] / a[j]);
+                    }
+                    a[j] = value;
+                }
+                break;
+            case OP_SIN:
+                /* sin(f)' = cos(f) * f' */
+                for (j = 0; j < len; j++) {
+                    da[j] *= cos(a[j]);
+                    a[j] = sin(a[j]);
+                }
+                break;
+            case OP_COS:
+                /* cos(f)' = -sin(f) * f' */
+                for (j = 0; j < len; j++) {
+                    da[j] *= -sin(a[j]);
+                    a[j] = cos(a[j]);
+                }
+                break;
+            case OP_EXP:
+                /* exp(f)' = exp(f) * f' */
+                for (j = 0; j < len; j++) {
+                    a[j] = exp(a[j]);
+                    da[j] *= a[j];
+                }
+                break;
+            case OP_LN:
+                /* ln(f)' = f' / f */
+                for (j = 0; j < len; j++) {
+                    da[j] /= a[j];
+                    a[j] = log(a[j]);
+                }
+                break;
+            case OP_POWI:
+                /* (f^n)' = n * f^(n-1) * f' */
+                for (j = 0; j < len; j++) {
+                    int32_t n = (int32_t)ins->arg;
+                    da[j] = n == 0 || da[j] == 0 ? 0 : n * powi(a[j], n - 1) * da[j];
+                    a[j] = powi(a[j], n);
+                }
+                break;
+        }
+    }
+}
+
+/* Évalue f et df/dvar en n points en un seul passage sur le programme de f,
+ * sans construire l'arbre de la dérivée. */
+void program_eval_dual(const Program *prog, const double *const *bindings, Symbol var, size_t n,
+                       double *value, double *derivative) {
+    double *stack = (double *)xcalloc(2 * prog->max_depth * EVAL_BLOCK, sizeof(double));
+    double *deriv = stack + prog->max_depth * EVAL_BLOCK;
+    size_t start;
+    
+    for (start = 0; start < n; start += EVAL_BLOCK) {
+        size_t len = n - start < EVAL_BLOCK ? n - start : EVAL_BLOCK;
+        eval_block_dual(prog, bindings, var, start, len, stack, deriv);
+        memcpy(value + start, stack, len * sizeof(double));
+        memcpy(derivative + start, deriv, len * sizeof(double));
+    }
+    
+    free(stack);
+}
+
+#define GRAD_TAPE_MAX (1 << 21)    // Valeurs conservées par bande (par tableau)
+
+/* Gradient numérique en mode inverse: un passage direct enregistre la valeur
+ * de chaque instruction (la bande), un passage inverse propage les adjoints
+ * des instructions vers leurs opérandes. grads[c], s'il n'est pas NULL,
+ * reçoit les n valeurs de df/dc; value reçoit f. */
+void program_gradient(const Program *prog, const double *const *bindings, size_t n,
+                      double *value, double *const *grads) {
+    uint32_t *left = (uint32_t *)xcalloc(prog->count, sizeof(uint32_t));
+    uint32_t *right = (uint32_t *)xcalloc(prog->count, sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *)xcalloc(prog->max_depth + 1, sizeof(uint32_t));
+    unsigned char *varying = (unsigned char *)xcalloc(prog->count, 1);
+    size_t block = EVAL_BLOCK;
+    double *vals, *adjs;
+    size_t sp = 0;
+    size_t start, i, j;
+    
+    /* Opérandes de chaque instruction (indices dans la bande), et celles dont
+     * la valeur dépend d'une variable */
+    for (i = 0; i < prog->count; i++) {
+        OpCode op = (OpCode)prog->code[i].op;
+        if (op >= OP_ADD && op <= OP_POW) {
+            right[i] = stack[--sp];
+            left[i] = stack[--sp];
+            varying[i] = varying[left[i]] | varying[right[i]];
+        } else if (op == OP_VAR) {
+            varying[i] = 1;
+        } else if (op != OP_CONST) {
+            left[i] = stack[--sp];
+            varying[i] = varying[left[i]];
+        }
+        stack[sp++] = (uint32_t)i;
+    }
+    free(stack);
+    
+    while (block > 1 && prog->count * block > GRAD_TAPE_MAX) block /= 2;
+    vals = (double *)xcalloc(prog->count * block, sizeof(double));
+    adjs = (double *)xcalloc(prog->count * block, sizeof(double));
+    
+    for (start = 0; start < n; start += block) {
+        size_t len = n - start < block ? n - start : block;
+        
+        /* Passage direct */
+        for (i = 0; i < prog->count; i++) {
+            const Instr *ins = &prog->code[i];
+            double *v = vals + i * block;
+            const double *a = vals + left[i] * block;
+            const double *b = vals + right[i] * block;
+            
+            switch ((OpCode)ins->op) {
+                case OP_CONST:
+                    for (j = 0; j < len; j++) v[j] = prog->constants[ins->arg];
+                    break;
+                case OP_VAR:
+                    memcpy(v, bindings[ins->arg] + start, len * sizeof(double));
+                    break;
+                case OP_ADD:
+                    for (j = 0; j < len; j++) v[j] = a[j] + b[j];
+                    break;
+                case OP_SUB:
+                    for (j = 0; j < len; j++) v[j] = a[j] - b[j];
+                    break;
+                case OP_MUL:
+                    for (j = 0; j < len; j++) v[j] = a[j] * b[j];
+                    break;
+                case OP_DIV:
+                    for (j = 0; j < len; j++) v[j] = a[j] / b[j];
+                    break;
+                case OP_POW:
+                    for (j = 0; j < len; j++) v[j] = pow(a[j], b[j]);
+                    break;
+                case OP_SIN:
+                    for (j = 0; j < len; j++) v[j] = sin(a[j]);
+                    break;
+                case OP_COS:
+                    for (j = 0; j < len; j++) v[j] = cos(a[j]);
+                    break;
+                case OP_EXP:
+                    for (j = 0; j < len; j++) v[j] = exp(a[j]);
+                    break;
+                case OP_LN:
+                    for (j = 0; j < len; j++) v[j] = log(a[j]);
+                    break;
+                case OP_POWI:
+                    for (j = 0; j < len; j++) v[j] = powi(a[j], (int32_t)ins->arg);
+                    break;
+            }
+        }
+        memcpy(value + start, vals + (prog->count - 1) * block, len * sizeof(double));
+        
+        /* Passage inverse */
+        memset(adjs, 0, prog->count * block * sizeof(double));
+        for (j = 0; j < len; j++) adjs[(prog->count - 1) * block + j] = 1;
+        for (i = 0; i < EVAL_VARS; i++) {
+            if (grads[i] != NULL) memset(grads[i] + start, 0, len * sizeof(double));
+        }
+        
+        for (i = prog->count; i-- > 0;) {
+            const Instr *ins = &prog->code[i];
+            const double *v = vals + i * block;
+            const double *g = adjs + i * block;
+            const double *a = vals + left[i] * block;
+            const double *b = vals + right[i] * block;
+            double *da = adjs + left[i] * block;
+            double *db = adjs + right[i] * block;
+            
+            switch ((OpCode)ins->op) {
+                case OP_CONST:
+                    break;
+                case OP_VAR:
+                    if (grads[ins->arg] != NULL) {
+                        for (j = 0; j < len; j++) grads[ins->arg][start + j] += g[j];
+                    }
+                    break;
+                case OP_ADD:
+                    for (j = 0; j < len; j++) {
+                        da[j] += g[j];
+                        db[j] += g[j];
+                    }
+                    break;
+                case OP_SUB:
+                    for (j = 0; j < len; j++) {
+                        da[j] += g[j];
+                        db[j] -= g[j];
+                    }
+                    break;
+                case OP_MUL:
+                    for (j = 0; j < len; j++) {
+                        da[j] += g[j] * b[j];
+                        db[j] += g[j] * a[j];
+                    }
+                    break;
+                case OP_DIV:
+                    for (j = 0; j < len; j++) {
+                        da[j] += g[j] / b[j];
+                        db[j] -= g[j] * v[j] / b[j];
+                    }
+                    break;
+                case OP_POW:
+                    for (j = 0; j < len; j++) {
+                        if (g[j] != 0) da[j] += g[j] * b[j] * pow(a[j], b[j] - 1);
+                    }
+                    /* L'adjoint de l'exposant n'est utile que s'il dépend d'une
+                     * variable: pas de log (ni de -inf pour a <= 0) sinon */
+                    if (!varying[right[i]]) break;
+                    for (j = 0; j < len; j++) {
+                        if (g[j] != 0) db[j] += g[j] * v[j] * log(a[j]);
+                    }
+                    break;
+                case OP_SIN:
+                    for (j = 0; j < len; j++) da[j] += g[j] * cos(a[j]);
+                    break;
+                case OP_COS:
+                    for (j = 0; j < len; j++) da[j] -= g[j] * sin(a[j]);
+                    break;
+                case OP_EXP:
+                    for (j = 0; j < len; j++) da[j] += g[j] * v[j];
+                    break;
+                case OP_LN:
+                    for (j = 0; j < len; j++) da[j] += g[j] / a[j];
+                    break;
+                case OP_POWI: {
+                    int32_t m = (int32_t)ins->arg;
+                    for (j = 0; j < len; j++) {
+                        if (m != 0) da[j] += g[j] * m * powi(a[j], m - 1);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    
+    free(left);
+    free(right);
+    free(varying);
+    free(vals);
+    free(adjs);
+}
+
+/* === SÉRIES DE TAYLOR === */
+
+/* Chaque valeur de la pile est une série tronquée de m coefficients: le
+ * coefficient k vaut f^(k)(x0) / k!. Les opérations suivent les récurrences
+ * classiques en O(m²); t et u sont des tableaux de travail de m doubles. */
+
+/* a <- a * b, coefficients calculés du plus haut au plus bas (b peut être a) */
+static void series_mul(double *a, const double *b, size_t m) {
+    size_t k = m, j;
+    
+    while (k-- > 0) {
+        double sum = 0;
+        for (j = 0; j <= k; j++) sum += a[j] * b[k - j];
+        a[k] = sum;
+    }
+}
+
+/* a <- a / b: c_k = (a_k - somme_{j>=1} b_j c_{k-j}) / b_0 */
+static void series_div(double *a, const double *b, size_t m) {
+    size_t k, j;
+    
+    for (k = 0; k < m; k++) {
+        double sum = a[k];
+        for (j = 1; j <= k; j++) sum -= b[j] * a[k - j];
+        a[k] = sum / b[0];
+    }
+}
+
+/* a <- exp(a): e_k = (1/k) somme_{j>=1} j a_j e_{k-j} */
+static void series_exp(double *a, size_t m, double *t) {
+    size_t k, j;
+    
+    memcpy(t, a, m * sizeof(double));
+    a[0] = exp(t[0]);
+    for (k = 1; k < m; k++) {
+        double sum = 0;
+        for (j = 1; j <= k; j++) sum += (double)j * t[j] * a[k - j];
+        a[k] = sum / (double)k;
+    }
+}
+
+/* a <- ln(a): l_k = (a_k - (1/k) somme_{1<=j<k} j l_j a_{k-j}) / a_0 */
+static void series_ln(double *a, size_t m, double *t) {
+    size_t k, j;
+    
+    memcpy(t, a, m * sizeof(double));
+    a[0] = log(t[0]);
+    for (k = 1; k < m; k++) {
+        double sum = 0;
+        for (j = 1; j < k; j++) sum += (double)j * a[j] * t[k - j];
+        a[k] = (t[k] - sum / (double)k) / t[0];
+    }
+}
+
+/* a <- sin(a) ou cos(a): les deux séries se calculent ensemble,
+ * s_k = (1/k) somme j a_j c_{k-j} et c_k = -(1/k) somme j a_j s_{k-j} */
+static void series_sin_cos(double *a, size_t m, int cosine, double *t, double *u) {
+    size_t k, j;
+    
+    t[0] = sin(a[0]);
+    u[0] = cos(a[0]);
+    for (k = 1; k < m; k++) {
+        double s = 0, c = 0;
+        for (j = 1; j <= k; j++) {
+            s += (double)j * a[j] * u[k - j];
+            c -= (double)j * a[j] * t[k - j];
+        }
+        t[k] = s / (double)k;
+        u[k] = c / (double)k;
+    }
+    memcpy(a, cosine ? u : t, m * sizeof(double));
+}
+
+/* a <- a^r pour un exposant constant. Si a_0 != 0, p = a^r vérifie
+ * a p' = r a' p, d'où p_k = (1/(k a_0)) somme_{j>=1} (r j - (k - j)) a_j p_{k-j}.
+ * Si a_0 = 0, seul un exposant entier positif a un développement: il est
+ * calculé par exponentiation binaire (nul au-delà de l'ordre m - 1). */
+static void series_pow_const(double *a, double r, size_t m, double *t, double *u) {
+    size_t k, j;
+    
+    if (a[0] == 0 && r >= 0 && r == floor(r)) {
+        size_t n = r < (double)m ? (size_t)r : m;
+        
+        memcpy(t, a, m * sizeof(double));
+        memset(u, 0, m * sizeof(double));
+        u[0] = n < m ? 1 : 0;
+        while (n != 0 && n < m) {
+            if (n & 1) series_mul(u, t, m);
+            series_mul(t, t, m);
+            n >>= 1;
+        }
+        memcpy(a, u, m * sizeof(double));
+        return;
+    }
+    
+    memcpy(t, a, m * sizeof(double));
+    a[0] = pow(t[0], r);
+    for (k = 1; k < m; k++) {
+        double sum = 0;
+        for (j = 1; j <= k; j++) sum += (r * (double)j - (double)(k - j)) * t[j] * a[k - j];
+        a[k] = sum / ((double)k * t[0]);
+    }
+}
+
+/* Coefficients de Taylor de f en x0 jusqu'à l'ordre m - 1: coeffs[k] reçoit
+ * f^(k)(x0) / k!. Le programme ne doit lire que la variable var. */
+void program_taylor(const Program *prog, Symbol var, double x0, size_t m, double *coeffs) {
+    double *stack = (double *)xcalloc((prog->max_depth + 2) * m, sizeof(double));
+    double *t = stack + prog->max_depth * m;
+    double *u = t + m;
+    size_t sp = 0;
+    size_t i, j;
+    
+    for (i = 0; i < prog->count; i++) {
+        const Instr *ins = &prog->code[i];
+        double *top = stack + sp * m;
+        double *a = top - m;
+        double *b = top;
+        
+        if (ins->op >= OP_ADD && ins->op <= OP_POW) {
+            a -= m;
+            b -= m;
+            sp--;
+        }
+        
+        switch ((OpCode)ins->op) {
+            case OP_CONST:
+                memset(top, 0, m * sizeof(double));
+                top[0] = prog->constants[ins->arg];
+                sp++;
+                break;
+            case OP_VAR:
+                /* La variable vaut x0 + h: série (x0, 1, 0, ...) */
+                memset(top, 0, m * sizeof(double));
+                top[0] = ins->arg == var ? x0 : NAN;
+                if (m > 1) top[1] = ins->arg == var;
+                sp++;
+                break;
+            case OP_ADD:
+                for (j = 0; j < m; j++) a[j] += b[j];
+                break;
+            case OP_SUB:
+                for (j = 0; j < m; j++) a[j] -= b[j];
+                break;
+            case OP_MUL:
+                series_mul(a, b, m);
+                break;
+            case OP_DIV:
+                series_div(a, b, m);
+                break;
+            case OP_POW:
+                /* Exposant variable: f^g = exp(g * ln(f)) */
+                for (j = 1; j < m && b[j] == 0; j++) {}
+                if (j == m) {
+                    series_pow_const(a, b[0], m, t, u);
+                } else {
+                    series_ln(a, m, t);
+                    series_mul(a, b, m);
+                    series_exp(a, m, t);
+                }
+                break;
+            case OP_SIN:
+            case OP_COS:
+                series_sin_cos(a, m, ins->op == OP_COS, t, u);
+                break;
+            case OP_EXP:
+                series_exp(a, m, t);
+                break;
+            case OP_LN:
+                series_ln(a, m, t);
+                break;
+            case OP_POWI:
+                series_pow_const(a, (double)(int32_t)ins->arg, m, t, u);
+                break;
+        }
+    }
+    
+    memcpy(coeffs, stack, m * sizeof(double));
+    free(stack);
+}
+
+/* === CONTRÔLE DES NOYAUX VECTORIELS === */
+
+static const char *const isa_names[] = {"scalar", "avx2"};
+
+/* Évaluation de référence: parcours de l'arbre avec la libm */
+static double eval_tree(const Node *node, Symbol var, double x) {
+    switch (node->type) {
+        case NODE_NUMBER:   return node->value;
+        case NODE_VARIABLE: return node->variable == var ? x : NAN;
+        case NODE_ADD:      return eval_tree(node->left, var, x) + eval_tree(node->right, var, x);
+        case NODE_SUB:      return eval_tree(node->left, var, x) - eval_tree(node->right, var, x);
+        case NODE_MUL:      return eval_tree(node->left, var, x) * eval_tree(node->right, var, x);
+        case NODE_DIV:      return eval_tree(node->left, var, x) / eval_tree(node->right, var, x);
+        case NODE_POW:      return pow(eval_tree(node->left, var, x), eval_tree(node->right, var, x));
+        case NODE_SIN:      return sin(eval_tree(node->left, var, x));
+        case NODE_COS:      return cos(eval_tree(node->left, var, x));
+        case NODE_EXP:      return exp(eval_tree(node->left, var, x));
+        case NODE_LN:       return log(eval_tree(node->left, var, x));
+    }
+    return NAN;
+}
+
+/* Écart entre got et want en unités de dernière place de want */
+static double ulp_error(double got, double want) {
+    double ulp;
+    
+    if (isnan(want)) return isnan(got) ? 0 : INFINITY;
+    if (isinf(want) || isinf(got)) return got == want ? 0 : INFINITY;
+    ulp = nextafter(fabs(want), INFINITY) - fabs(want);
+    return fabs(got - want) / ulp;
+}
+
+#define SIMD_CHECK_POINTS (1 << 20)
+
+/* Précision (écart maximal à la libm, en ulp) et débit de chaque jeu
+ * d'instructions disponible sur quelques expressions. Renvoie 1 si un écart
+ * dépasse la tolérance. */
+static int run_simd_check(void) {
+    static const struct {
+        const char *expression;
+        double from, to;
+        double max_ulp;
+    } checks[] = {
+        {"sin(x)", -100, 100, 2},
+        {"cos(x)", -100, 100, 2},
+        {"sin(x)", -1e6, 1e6, 2},
+        {"exp(x)", -740, 709, 2},
+        {"ln(x)", 1e-300, 1e-290, 2},
+        {"ln(x)", 1e-3, 1e6, 2},
+        {"x^7", -4, 4, 8},
+        {"x^2.5", 1e-3, 100, 4},
+        {"x^50.5", 1, 100, 4},
+        {"x^70", 1, 100, 4},
+        {"1/x^99.75", 1e-3, 1e3, 4},
+        {"x^x", 1, 140, 4},
+        {"x^3*exp(sin(x))/ln(x)+cos(x)^2", 1.5, 20, 16}
+    };
+    const double *bindings[EVAL_VARS] = {NULL};
+    double *xs = (double *)xcalloc(SIMD_CHECK_POINTS, sizeof(double));
+    double *want = (double *)xcalloc(SIMD_CHECK_POINTS, sizeof(double));
+    double *got = (double *)xcalloc(SIMD_CHECK_POINTS, sizeof(double));
+    EvalIsa best = eval_detect_isa();
+    int status = 0;
+    size_t c, i;
+    
+    bindings['x'] = xs;
+    printf("%-42s %-7s %10s %10s %8s\n", "expression [intervalle]", "isa", "ulp max", "ns/point", "gain");
+    
+    for (c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+        Parser parser;
+        Program prog;
+        Node *tree = parse_string(&parser, checks[c].expression);
+        struct timespec t0, t1;
+        double tree_ns, scalar_ns = 0;
+        char label[64];
+        int isa;
+        
+        /* Une même expression peut figurer sur plusieurs intervalles */
+        snprintf(label, sizeof(label), "%s [%g,%g]", checks[c].expression, checks[c].from, checks[c].to);
+        
+        for (i = 0; i < SIMD_CHECK_POINTS; i++) {
+            xs[i] = checks[c].from + (checks[c].to - checks[c].from) * (double)i / (SIMD_CHECK_POINTS - 1);
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < SIMD_CHECK_POINTS; i++) want[i] = eval_tree(tree, 'x', xs[i]);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        tree_ns = elapsed_ns(&t0, &t1) / SIMD_CHECK_POINTS;
+        printf("%-42s %-7s %10s %10.2f %8s\n", label, "arbre", "-", tree_ns, "-");
+        
+        program_init(&prog);
+        compile_tree(&prog, tree);
+        for (isa = EVAL_SCALAR; isa <= (int)best; isa++) {
+            double ns, worst = 0;
+            
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            program_eval_isa(&prog, bindings, SIMD_CHECK_POINTS, got, (EvalIsa)isa);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns = elapsed_ns(&t0, &t1) / SIMD_CHECK_POINTS;
+            if (isa == EVAL_SCALAR) scalar_ns = ns;
+            
+            for (i = 0; i < SIMD_CHECK_POINTS; i++) {
+                double error = ulp_error(got[i], want[i]);
+                if (error > worst) worst = error;
+            }
+            printf("%-42s %-7s %10.2f %10.2f %7.2fx%s\n", "", isa_names[isa], worst, ns,
+                   scalar_ns / ns, worst > checks[c].max_ulp ? "  ÉCHEC" : "");
+            if (worst > checks[c].max_ulp) status = 1;
+        }
+        program_free(&prog);
+        arena_reset(current_arena);
+    }
+    
+    free(xs);
+    free(want);
+    free(got);
+    return status;
+}
+
+/* Compare la dérivée numérique par différentiation automatique à la voie
+ * symbolique (differentiate + simplify, compilation puis évaluation), en
+ * précision et en temps total. Renvoie 1 si un écart relatif dépasse 1e-12. */
+static int run_ad_check(Symbol var) {
+    static const char *const expressions[] = {
+        "x^2*sin(x)",
+        "x^x",
+        "ln(x)/x+exp(x^2)",
+        "x^2*sin(x)/ln(x+2)-cos(exp(x))",
+        "x*sin(x)*exp(x)*sin(x)*cos(x)*ln(x)*x^3",
+        "exp(sin(x)*cos(x))^(x/2)*(x+1)^5"
+    };
+    static const size_t sizes[] = {16, 1 << 16};
+    const double *bindings[EVAL_VARS] = {NULL};
+    size_t max_points = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    double *xs = (double *)xcalloc(max_points, sizeof(double));
+    double *want = (double *)xcalloc(max_points, sizeof(double));
+    double *value = (double *)xcalloc(max_points, sizeof(double));
+    double *got = (double *)xcalloc(max_points, sizeof(double));
+    int status = 0;
+    size_t e, k, i;
+    
+    bindings[var] = xs;
+    printf("%-44s %8s %14s %14s %8s %10s\n", "expression", "points", "symbolique ns", "AD ns", "gain",
+           "écart max");
+    
+    for (e = 0; e < sizeof(expressions) / sizeof(expressions[0]); e++) {
+        for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+            size_t n = sizes[k];
+            struct timespec t0, t1, t2;
+            double worst = 0;
+            Parser parser;
+            Program prog;
+            
+            for (i = 0; i < n; i++) xs[i] = 0.5 + 2.5 * (double)i / (double)n;
+            
+            /* Voie symbolique: arbre de la dérivée, simplification, bytecode */
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            program_init(&prog);
+            compile_tree(&prog, simplify(differentiate(parse_string(&parser, expressions[e]), var)));
+            program_eval_isa(&prog, bindings, n, want, EVAL_SCALAR);
+            program_free(&prog);
+            arena_reset(current_arena);
+            
+            /* Mode direct: un seul programme, celui de f */
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            program_init(&prog);
+            compile_tree(&prog, parse_string(&parser, expressions[e]));
+            program_eval_dual(&prog, bindings, var, n, value, got);
+            program_free(&prog);
+            arena_reset(current_arena);
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            
+            for (i = 0; i < n; i++) {
+                double error = fabs(got[i] - want[i]) / fmax(1, fabs(want[i]));
+                if (!(error <= worst)) worst = error;
+            }
+            printf("%-44s %8zu %14.1f %14.1f %7.2fx %10.1e%s\n", k == 0 ? expressions[e] : "", n,
+                   elapsed_ns(&t0, &t1) / n, elapsed_ns(&t1, &t2) / n,
+                   elapsed_ns(&t0, &t1) / elapsed_ns(&t1, &t2), worst, worst > 1e-12 ? "  ÉCHEC" : "");
+            if (worst > 1e-12) status = 1;
+        }
+    }
+    
+    free(xs);
+    free(want);
+    free(value);
+    free(got);
+    return status;
+}
+
+#define TAYLOR_CHECK_ORDER 6       // Ordre maximal comparé à la voie symbolique
+
+/* Mode --taylor-check: compare les dérivées d'ordre 0 à TAYLOR_CHECK_ORDER
+ * données par les séries de Taylor à celles de la voie symbolique (dérivations
+ * successives simplifiées, évaluées par le bytecode), et le temps des deux. */
+static int run_taylor_check(Symbol var) {
+    static const char *const expressions[] = {
+        "x^2*sin(x)",
+        "x^x",
+        "ln(x)/x+exp(x^2)",
+        "1/(1+x^2)",
+        "x^2*sin(x)/ln(x+2)-cos(exp(x))",
+        "x*sin(x)*exp(x)*sin(x)*cos(x)*ln(x)*x^3",
+        "exp(sin(x)*cos(x))^(x/2)*(x+1)^5"
+    };
+    static const double points[] = {0.7, 1.9};
+    const double *bindings[EVAL_VARS] = {NULL};
+    double want[TAYLOR_CHECK_ORDER + 1], got[TAYLOR_CHECK_ORDER + 1];
+    int status = 0;
+    size_t e, p, k;
+    
+    printf("%-44s %6s %14s %14s %8s %10s\n", "expression", "x0", "symbolique µs", "Taylor µs", "gain",
+           "écart max");
+    
+    for (e = 0; e < sizeof(expressions) / sizeof(expressions[0]); e++) {
+        for (p = 0; p < sizeof(points) / sizeof(points[0]); p++) {
+            struct timespec t0, t1, t2;
+            double worst = 0, factorial = 1;
+            Parser parser;
+            Program prog;
+            Node *tree;
+            
+            /* Voie symbolique: une dérivation simplifiée et un programme par ordre */
+            bindings[var] = &points[p];
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            tree = parse_string(&parser, expressions[e]);
+            for (k = 0; k <= TAYLOR_CHECK_ORDER; k++) {
+                if (k > 0) tree = simplify(differentiate(tree, var));
+                program_init(&prog);
+                compile_tree(&prog, tree);
+                program_eval_isa(&prog, bindings, 1, &want[k], EVAL_SCALAR);
+                program_free(&prog);
+            }
+            arena_reset(current_arena);
+            
+            /* Séries: un seul passage sur le programme de f */
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            program_init(&prog);
+            compile_tree(&prog, parse_string(&parser, expressions[e]));
+            program_taylor(&prog, var, points[p], TAYLOR_CHECK_ORDER + 1, got);
+            program_free(&prog);
+            arena_reset(current_arena);
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            
+            for (k = 0; k <= TAYLOR_CHECK_ORDER; k++) {
+                double error;
+                
+                if (k > 0) factorial *= (double)k;
+                error = fabs(got[k] * factorial - want[k]) / fmax(1, fabs(want[k]));
+                if (!(error <= worst)) worst = error;
+            }
+            printf("%-44s %6.2f %14.1f %14.1f %7.0fx %10.1e%s\n", p == 0 ? expressions[e] : "",
+                   points[p], elapsed_ns(&t0, &t1) / 1e3, elapsed_ns(&t1, &t2) / 1e3,
+                   elapsed_ns(&t0, &t1) / elapsed_ns(&t1, &t2), worst, worst > 1e-10 ? "  ÉCHEC" : "");
+            if (worst > 1e-10) status = 1;
+        }
+    }
+    return status;
+}
+
+/* === BANC D'ESSAI === */
+
+/* Familles d'expressions synthétiques de --bench. La taille est le nombre de
+ * nœuds de l'expression générée (à quelques nœuds près). */
+typedef enum {
+    BENCH_CHAIN,           // chaine: fonctions imbriquées, sin(exp(cos(...(x))))
+    BENCH_SUM,             // somme: longue somme de termes simples
+    BENCH_PRODUCT,         // produit: produits et quotients de facteurs simples
+    BENCH_TOWER,           // puissance: tour de puissances, x^(sin(x)^(...))
+    BENCH_RANDOM,          // aleatoire: arbre aléatoire, profondeur logarithmique
+    BENCH_FAMILY_COUNT
+} BenchFamily;
+
+static const char *const bench_family_names[BENCH_FAMILY_COUNT] = {
+    "chaine", "somme", "produit", "puissance", "aleatoire"
+};
+
+#define BENCH_RUNS 5               // Mesures par expression (on garde la plus rapide)
+
+/* Générateur reproductible (xorshift64*) */
+static uint64_t bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static void bench_digit(StrBuf *buf, uint64_t *state) {
+    strbuf_putc(buf, '1' + (int)(bench_random(state) % 9));
+}
+
+static const char *bench_function(uint64_t *state) {
+    static const char *const names[] = {"sin(", "cos(", "exp(", "ln("};
+    return names[bench_random(state) % 4];
+}
+
+/* Pile du générateur d'arbres aléatoires: chaque élément est soit un texte
+ * à écrire, soit un sous-arbre de size nœuds à générer */
+typedef struct {
+    struct { size_t size; const char *text; } *items;
+    size_t count;
+    size_t capacity;
+} BenchStack;
+
+static void bench_push(BenchStack *stack, size_t size, const char *text) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? 2 * stack->capacity : 64;
+        stack->items = xrealloc(stack->items, stack->capacity * sizeof(*stack->items));
+    }
+    stack->items[stack->count].size = size;
+    stack->items[stack->count++].text = text;
+}
+
+/* Arbre aléatoire de size nœuds: les découpages uniformes donnent une
+ * profondeur logarithmique */
+static void bench_random_tree(StrBuf *buf, size_t size, uint64_t *state) {
+    static const char *const operators[] = {"+", "-", "*", "/", "*", "+", "^"};
+    BenchStack stack = {NULL, 0, 0};
+    
+    bench_push(&stack, size, NULL);
+    while (stack.count > 0) {
+        uint64_t r;
+        
+        stack.count--;
+        if (stack.items[stack.count].text != NULL) {
+            strbuf_puts(buf, stack.items[stack.count].text);
+            continue;
+        }
+        size = stack.items[stack.count].size;
+        r = bench_random(state);
+        if (size == 1) {
+            if (r % 3 == 0) {
+                bench_digit(buf, state);
+            } else {
+                strbuf_putc(buf, 'x');
+            }
+        } else if (size == 2 || r % 5 == 0) {
+            strbuf_puts(buf, bench_function(state));
+            bench_push(&stack, 0, ")");
+            bench_push(&stack, size - 1, NULL);
+        } else {
+            size_t left = 1 + (size_t)(bench_random(state) % (size - 2));
+            
+            strbuf_putc(buf, '(');
+            bench_push(&stack, 0, ")");
+            bench_push(&stack, size - 1 - left, NULL);
+            bench_push(&stack, 0, operators[r % 7]);
+            bench_push(&stack, left, NULL);
+        }
+    }
+    free(stack.items);
+}
+
+/* Écrit dans buf une expression de la famille, d'environ size nœuds */
+static void bench_generate(StrBuf *buf, BenchFamily family, size_t size, uint64_t seed) {
+    uint64_t state = 2 * seed + 1;
+    size_t nodes = 0, i;
+    
+    switch (family) {
+        case BENCH_CHAIN:
+            for (i = 1; i < size; i++) strbuf_puts(buf, bench_function(&state));
+            strbuf_putc(buf, 'x');
+            for (i = 1; i < size; i++) strbuf_putc(buf, ')');
+            break;
+        case BENCH_SUM:
+            while (nodes < size) {
+                if (nodes > 0) {
+                    strbuf_putc(buf, bench_random(&state) % 4 ? '+' : '-');
+                    nodes++;
+                }
+                switch (bench_random(&state) % 3) {
+                    case 0:
+                        bench_digit(buf, &state);
+                        strbuf_puts(buf, "*x^");
+                        bench_digit(buf, &state);
+                        nodes += 5;
+                        break;
+                    case 1:
+                        strbuf_puts(buf, "sin(");
+                        bench_digit(buf, &state);
+                        strbuf_puts(buf, "*x)");
+                        nodes += 4;
+                        break;
+                    default:
+                        strbuf_puts(buf, "exp(x)/");
+                        bench_digit(buf, &state);
+                        nodes += 4;
+                        break;
+                }
+            }
+            break;
+        case BENCH_PRODUCT:
+            while (nodes < size) {
+                if (nodes > 0) {
+                    strbuf_putc(buf, bench_random(&state) % 3 ? '*' : '/');
+                    nodes++;
+                }
+                if (bench_random(&state) % 2) {
+                    strbuf_puts(buf, "(x+");
+                    bench_digit(buf, &state);
+                    strbuf_putc(buf, ')');
+                    nodes += 3;
+                } else {
+                    strbuf_puts(buf, bench_function(&state));
+                    bench_digit(buf, &state);
+                    strbuf_puts(buf, "*x)");
+                    nodes += 4;
+                }
+            }
+            break;
+        case BENCH_TOWER:
+            for (i = 0; nodes + 1 < size; i++) {
+                if (bench_random(&state) % 2) {
+                    strbuf_puts(buf, "(x+");
+                    bench_digit(buf, &state);
+                    strbuf_puts(buf, ")^(");
+                    nodes += 4;
+                } else {
+                    strbuf_puts(buf, bench_function(&state));
+                    strbuf_puts(buf, "x)^(");
+                    nodes += 3;
+                }
+            }
+            strbuf_putc(buf, 'x');
+            for (; i > 0; i--) strbuf_putc(buf, ')');
+            break;
+        default:
+            bench_random_tree(buf, size, &state);
+            break;
+    }
+    strbuf_putc(buf, '\0');
+}
+
+/* Mesures d'une expression: durées minimales de chaque phase sur BENCH_RUNS */
+typedef struct {
+    size_t tokens;         // Lexèmes de l'expression
+    size_t nodes;          // Nœuds distincts de l'expression
+    size_t derivative_nodes; // Nœuds distincts de la dérivée simplifiée
+    size_t output_bytes;   // Taille de la dérivée écrite
+    double lex_ns;         // Lexeur seul
+    double parse_ns;       // parse_string(), lexeur compris
+    double derive_ns, simplify_ns, print_ns;
+    long max_rss_kb;       // Pic de mémoire résidente du processus de la famille
+} BenchResult;
+
+/* Analyse, dérive, simplifie et écrit (en mémoire) la dérivée de text par
+ * rapport à x. Renvoie 0 si l'expression ne s'analyse pas. */
+static int bench_expression(const char *text, BenchResult *result) {
+    int run;
+    
+    result->lex_ns = result->parse_ns = result->derive_ns = INFINITY;
+    result->simplify_ns = result->print_ns = INFINITY;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        struct timespec t0, t1, t2, t3, t4, t5;
+        Parser parser;
+        Node *tree, *derivative;
+        size_t tokens = 0;
+        StrBuf out;
+        
+        /* Lexeur seul */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        parser.input = text;
+        parser.pos = 0;
+        while (get_next_token(&parser).type != TOKEN_END) tokens++;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        
+        tree = parse_string(&parser, text);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        if (tree == NULL) {
+            fprintf(stderr, "%s\n", parser.error);
+            arena_reset(current_arena);
+            return 0;
+        }
+        derivative = differentiate(tree, 'x');
+        clock_gettime(CLOCK_MONOTONIC, &t3);
+        derivative = simplify(derivative);
+        clock_gettime(CLOCK_MONOTONIC, &t4);
+        strbuf_init(&out, NULL, 0);
+        serialize_tree(&out, derivative);
+        clock_gettime(CLOCK_MONOTONIC, &t5);
+        
+        if (run == 0) {
+            result->tokens = tokens;
+            result->nodes = count_nodes(tree);
+            result->derivative_nodes = count_nodes(derivative);
+            result->output_bytes = out.length;
+        }
+        strbuf_free(&out);
+        arena_reset(current_arena);
+        
+        result->lex_ns = fmin(result->lex_ns, elapsed_ns(&t0, &t1));
+        result->parse_ns = fmin(result->parse_ns, elapsed_ns(&t1, &t2));
+        result->derive_ns = fmin(result->derive_ns, elapsed_ns(&t2, &t3));
+        result->simplify_ns = fmin(result->simplify_ns, elapsed_ns(&t3, &t4));
+        result->print_ns = fmin(result->print_ns, elapsed_ns(&t4, &t5));
+    }
+    return 1;
+}
+
+/* Génère et mesure une famille dans un processus fils, pour que max_rss_kb
+ * soit le pic de cette famille seule et non celui des familles précédentes.
+ * Renvoie 0 si l'expression ne s'analyse pas ou si le fils échoue. */
+static int bench_family(BenchFamily family, size_t size, uint64_t seed, BenchResult *result) {
+    int channel[2], status;
+    size_t got = 0;
+    pid_t pid;
+    
+    fflush(stdout);
+    if (pipe(channel) != 0 || (pid = fork()) < 0) {
+        fprintf(stderr, "Erreur: banc d'essai: %s\n", strerror(errno));
+        return 0;
+    }
+    if (pid == 0) {
+        struct rusage usage;
+        StrBuf text;
+        int ok;
+        
+        close(channel[0]);
+        strbuf_init(&text, NULL, 0);
+        bench_generate(&text, family, size, seed);
+        ok = bench_expression(text.data, result);
+        strbuf_free(&text);
+        getrusage(RUSAGE_SELF, &usage);
+        result->max_rss_kb = usage.ru_maxrss;
+        if (ok && write(channel[1], result, sizeof(*result)) != (ssize_t)sizeof(*result)) ok = 0;
+        _exit(ok ? 0 : 1);
+    }
+    
+    close(channel[1]);
+    while (got < sizeof(*result)) {
+        ssize_t n = read(channel[0], (char *)result + got, sizeof(*result) - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(channel[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return got == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Banc d'essai: spec est une liste famille:taille séparée par des virgules.
+ * Écrit une ligne CSV par famille. Renvoie 1 si spec est invalide. */
+static int run_bench(const char *spec, uint64_t seed) {
+    struct { BenchFamily family; size_t size; } items[64];
+    size_t count = 0, i;
+    const char *p = spec;
+    
+    while (*p != '\0') {
+        size_t length = strcspn(p, ":");
+        BenchFamily family;
+        char *end;
+        
+        for (family = 0; family < BENCH_FAMILY_COUNT; family++) {
+            if (strlen(bench_family_names[family]) == length &&
+                strncmp(p, bench_family_names[family], length) == 0) break;
+        }
+        if (family == BENCH_FAMILY_COUNT || p[length] != ':' || count == 64) {
+            fprintf(stderr, "Erreur: banc d'essai invalide '%s' (attendu famille:taille,...)\n", spec);
+            return 1;
+        }
+        items[count].family = family;
+        items[count].size = (size_t)strtoul(p + length + 1, &end, 10);
+        if (items[count].size == 0 || (*end != '\0' && *end != ',')) {
+            fprintf(stderr, "Erreur: banc d'essai invalide '%s' (attendu famille:taille,...)\n", spec);
+            return 1;
+        }
+        count++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    
+    printf("famille,taille,graine,noeuds,lexemes,noeuds_derivee,octets_sortie,"
+           "lex_ns,parse_ns,derive_ns,simplify_ns,print_ns,ns_par_noeud,rss_max_ko\n");
+    for (i = 0; i < count; i++) {
+        BenchResult result;
+        double total;
+        
+        if (!bench_family(items[i].family, items[i].size, seed, &result)) return 1;
+        
+        /* Temps par nœud traité: l'expression et sa dérivée */
+        total = result.parse_ns + result.derive_ns + result.simplify_ns + result.print_ns;
+        printf("%s,%zu,%llu,%zu,%zu,%zu,%zu,%.0f,%.0f,%.0f,%.0f,%.0f,%.2f,%ld\n",
+               bench_family_names[items[i].family], items[i].size, (unsigned long long)seed,
+               result.nodes, result.tokens, result.derivative_nodes, result.output_bytes,
+               result.lex_ns, result.parse_ns, result.derive_ns, result.simplify_ns,
+               result.print_ns, total / (double)(result.nodes + result.derivative_nodes),
+               result.max_rss_kb);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/* === GÉNÉRATION DE CODE C === */
+
+/* Variables d'une lettre présentes dans l'arbre (used[c] != 0 pour la
+ * variable c). Le bytecode et le code C n'indexent que celles-là: renvoie
+ * une variable de plusieurs lettres rencontrée, 0 si aucune. */
+static Symbol collect_variables(const Node *node, unsigned char *used) {
+    NodeMap seen;
+    WorkStack stack;
+    Symbol other = 0;
+    
+    memset(&seen, 0, sizeof(seen));
+    work_init(&stack);
+    work_push(&stack, (Node *)node, 0);
+    while (stack.count > 0 && other == 0) {
+        Node *current = work_pop(&stack).node;
+        
+        if (current == NULL || node_map_get(&seen, current) != NULL) continue;
+        node_map_put(&seen, current, current);
+        if (current->type == NODE_VARIABLE) {
+            if (current->variable >= SYMBOL_FIRST) {
+                other = current->variable;
+            } else {
+                used[current->variable] = 1;
+            }
+        }
+        work_push(&stack, current->right, 0);
+        work_push(&stack, current->left, 0);
+    }
+    work_free(&stack);
+    node_map_free(&seen);
+    return other;
+}
+
+/* Refuse (avec un message) un arbre contenant une variable de plusieurs
+ * lettres; renvoie 1 si l'arbre est accepté */
+static int check_short_variables(const Node *tree, unsigned char *used) {
+    Symbol symbol = collect_variables(tree, used);
+    char letter[2];
+    
+    if (symbol == 0) return 1;
+    fprintf(stderr, "Erreur: variable '%s': ce mode n'accepte que des variables d'une lettre\n",
+            symbol_text(symbol, letter));
+    return 0;
+}
+
+/* Écrit une constante sous forme de littéral double */
+static void emit_c_number(FILE *out, double value) {
+    char text[32];
+    
+    if (isnan(value)) {
+        fputs("NAN", out);
+        return;
+    }
+    if (isinf(value)) {
+        fputs(value > 0 ? "HUGE_VAL" : "-HUGE_VAL", out);
+        return;
+    }
+    snprintf(text, sizeof(text), "%.17g", value);
+    fputs(text, out);
+    if (strpbrk(text, ".e") == NULL) fputs(".0", out);
+}
+
+/* x^n, n entier constant: exponentiation binaire déroulée à partir du
+ * temporaire left; renvoie le temporaire du résultat */
+static size_t emit_c_powi(FILE *out, size_t left, int n, size_t *temps) {
+    unsigned m = (unsigned)(n < 0 ? -n : n);
+    size_t square = left, result = 0;
+    int have = 0;
+    
+    while (m != 0) {
+        if (m & 1) {
+            if (have) {
+                fprintf(out, "    const double t%zu = t%zu * t%zu;\n", *temps, result, square);
+                result = (*temps)++;
+            } else {
+                result = square;
+                have = 1;
+            }
+        }
+        m >>= 1;
+        if (m != 0) {
+            fprintf(out, "    const double t%zu = t%zu * t%zu;\n", *temps, square, square);
+            square = (*temps)++;
+        }
+    }
+    if (!have) {
+        result = (*temps)++;
+        fprintf(out, "    const double t%zu = 1.0;\n", result);
+    } else if (n < 0) {
+        fprintf(out, "    const double t%zu = 1.0 / t%zu;\n", *temps, result);
+        result = (*temps)++;
+    }
+    return result;
+}
+
+/* Écrit une affectation par nœud distinct (forme SSA: t0, t1, ...) et
+ * renvoie le numéro du temporaire qui contient la valeur du nœud. Parcours
+ * postfixe: les temporaires des fils s'accumulent sur values; emitted
+ * associe à chaque nœud déjà écrit son temporaire (plus 1), si bien qu'un
+ * nœud partagé (--dag) n'est écrit qu'une fois. */
+static size_t emit_c_node(FILE *out, const Node *node, size_t *temps) {
+    static const char *const operators[] = {"+", "-", "*", "/"};
+    static const char *const functions[] = {"sin", "cos", "exp", "log"};
+    NodeMap emitted;
+    WorkStack stack;
+    size_t *values = NULL;
+    size_t count = 0, capacity = 0, result;
+    
+    memset(&emitted, 0, sizeof(emitted));
+    work_init(&stack);
+    work_push(&stack, (Node *)node, 0);
+    while (stack.count > 0) {
+        WorkItem item = work_pop(&stack);
+        size_t left, right;
+        Node *known;
+        
+        node = item.node;
+        if (item.state == 0 && (known = node_map_get(&emitted, node)) != NULL) {
+            values = (size_t *)grow_array(values, &capacity, count, sizeof(size_t));
+            values[count++] = (size_t)(uintptr_t)known - 1;
+            continue;
+        }
+        if (item.state == 0 && node->left != NULL) {
+            work_push(&stack, (Node *)node, 1);
+            if (node->right != NULL && !is_powi(node)) work_push(&stack, node->right, 0);
+            work_push(&stack, node->left, 0);
+            continue;
+        }
+        
+        switch (node->type) {
+            case NODE_NUMBER:
+                result = (*temps)++;
+                fprintf(out, "    const double t%zu = ", result);
+                emit_c_number(out, node->value);
+                fputs(";\n", out);
+                break;
+                
+            case NODE_VARIABLE:
+                result = (*temps)++;
+                fprintf(out, "    const double t%zu = %c;\n", result, (int)node->variable);
+                break;
+                
+            case NODE_POW:
+                if (is_powi(node)) {
+                    result = emit_c_powi(out, values[--count], (int)node->right->value, temps);
+                    break;
+                }
+                right = values[--count];
+                left = values[--count];
+                result = (*temps)++;
+                fprintf(out, "    const double t%zu = pow(t%zu, t%zu);\n", result, left, right);
+                break;
+                
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+                right = values[--count];
+                left = values[--count];
+                result = (*temps)++;
+                fprintf(out, "    const double t%zu = t%zu %s t%zu;\n", result, left,
+                        operators[node->type - NODE_ADD], right);
+                break;
+                
+            default:
+                left = values[--count];
+                result = (*temps)++;
+                fprintf(out, "    const double t%zu = %s(t%zu);\n", result,
+                        functions[node->type - NODE_SIN], left);
+                break;
+        }
+        node_map_put(&emitted, (Node *)node, (Node *)(uintptr_t)(result + 1));
+        values = (size_t *)grow_array(values, &capacity, count, sizeof(size_t));
+        values[count++] = result;
+    }
+    
+    result = values[0];
+    work_free(&stack);
+    node_map_free(&emitted);
+    free(values);
+    return result;
+}
+
+/* Écrit "double name(double v, ...)" calculant node. Les paramètres sont
+ * la variable de dérivation puis les autres variables de used, dans l'ordre. */
+static void emit_c_function(FILE *out, const char *name, const Node *node,
+                            Symbol var, const unsigned char *used) {
+    size_t temps = 0;
+    size_t result;
+    int c;
+    
+    fprintf(out, "double %s(double %c", name, (int)var);
+    for (c = 0; c < EVAL_VARS; c++) {
+        if (used[c] && (Symbol)c != var) fprintf(out, ", double %c", c);
+    }
+    fputs(") {\n", out);
+    result = emit_c_node(out, node, &temps);
+    fprintf(out, "    return t%zu;\n}\n", result);
+}
+
+/* Fichier C autonome définissant f (l'expression) et df (sa dérivée) */
+void emit_c_source(FILE *out, Node *tree, Node *derivative, Symbol var) {
+    unsigned char used[EVAL_VARS] = {0};
+    
+    collect_variables(tree, used);
+    fputs("/* Généré par derivative\n * f(x)  = ", out);
+    fprint_tree(out, tree);
+    fprintf(out, "\n * df(x) = d/d%c: ", (int)var);
+    fprint_tree(out, derivative);
+    fputs("\n */\n#include <math.h>\n\n", out);
+    emit_c_function(out, "f", tree, var, used);
+    fputc('\n', out);
+    emit_c_function(out, "df", derivative, var, used);
+}
+
+/* Compile f et df avec le compilateur C local ($CC, gcc par défaut) en une
+ * bibliothèque partagée et la charge. Seule la variable de dérivation peut
+ * apparaître dans l'expression. Renvoie 0 en cas de succès. */
+int native_load(NativeModule *module, Node *tree, Node *derivative, Symbol var) {
+    char dir[] = "/tmp/derivative-XXXXXX";
+    char source[64], library[64], command[256];
+    const char *cc = getenv("CC");
+    FILE *out;
+    int status;
+    
+    memset(module, 0, sizeof(*module));
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "Erreur: impossible de créer un répertoire temporaire\n");
+        return 1;
+    }
+    snprintf(source, sizeof(source), "%s/f.c", dir);
+    snprintf(library, sizeof(library), "%s/f.so", dir);
+    
+    if ((out = fopen(source, "w")) == NULL) {
+        fprintf(stderr, "Erreur: impossible d'ouvrir '%s'\n", source);
+        rmdir(dir);
+        return 1;
+    }
+    emit_c_source(out, tree, derivative, var);
+    fclose(out);
+    
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o %s %s -lm",
+             cc != NULL && cc[0] != '\0' ? cc : "gcc", library, source);
+    status = system(command);
+    if (status != 0) {
+        fprintf(stderr, "Erreur: échec de la compilation (%s)\n", command);
+    } else if ((module->handle = dlopen(library, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        fprintf(stderr, "Erreur: %s\n", dlerror());
+        status = 1;
+    } else {
+        /* Conversion void * -> pointeur de fonction recommandée par POSIX */
+        *(void **)(&module->f) = dlsym(module->handle, "f");
+        *(void **)(&module->df) = dlsym(module->handle, "df");
+        if (module->f == NULL || module->df == NULL) {
+            fprintf(stderr, "Erreur: symboles f/df introuvables\n");
+            native_unload(module);
+            status = 1;
+        }
+    }
+    
+    /* La bibliothèque reste chargée après la suppression des fichiers */
+    unlink(library);
+    unlink(source);
+    rmdir(dir);
+    return status != 0;
+}
+
+void native_unload(NativeModule *module) {
+    if (module->handle != NULL) dlclose(module->handle);
+    memset(module, 0, sizeof(*module));
+}
+
+/* === CACHE PERSISTANT === */
+
+/* Dérivées des lignes déjà vues, dans un fichier projeté en mémoire partagé
+ * entre exécutions et processus (--cache). Une entrée est adressée par son
+ * contenu: la clé est la suite des tokens de la ligne (espaces ignorés,
+ * nombres par valeur), précédée de la variable et des options qui changent
+ * la dérivée. Le fichier, de taille fixe, contient un en-tête, une table
+ * d'adressage ouvert et une zone de données remplie séquentiellement; quand
+ * la zone ou la table est pleine, seules les entrées les plus récemment
+ * utilisées sont gardées, dans la moitié de la place.
+ * Les écritures se font sous verrou exclusif (flock); chaque thread ouvre le
+ * fichier de son côté, car les verrous flock appartiennent au fichier
+ * ouvert: ils séparent donc aussi les threads. Les consultations ne prennent
+ * pas de verrou: comme un seqlock, l'écrivain rend la génération impaire le
+ * temps de son écriture, et un lecteur ne garde que ce qu'il a copié sous
+ * une même génération paire. */
+#define CACHE_MAGIC "DERIVC01"
+#define CACHE_DEFAULT_MB 64
+#define CACHE_BYTES_PER_SLOT 512   // Une case de table pour 512 octets de fichier
+
+typedef struct {
+    char magic[8];
+    uint64_t size;             // Taille du fichier
+    uint64_t slots;            // Cases de la table (puissance de deux)
+    uint64_t data_offset;      // Début de la zone de données
+    uint64_t data_capacity;
+    uint64_t data_used;
+    uint64_t entries;
+    uint64_t clock;            // Horloge LRU, avancée à chaque accès
+    uint64_t generation;       // Impaire pendant une écriture (et si l'écrivain meurt)
+} CacheHeader;
+
+typedef struct {
+    uint64_t hash;             // 0: case libre
+    uint64_t last_used;        // Horloge du dernier accès
+    uint64_t offset;           // Clé puis dérivée, dans la zone de données
+    uint32_t key_length;
+    uint32_t text_length;      // Octets de la dérivée rangés
+    uint64_t output_length;    // Longueur de la dérivée (omise si > text_length)
+} CacheSlot;
+
+typedef struct {
+    uint64_t lookups, hits, stores, evictions;
+    double lookup_ns;
+} CacheStats;
+
+typedef struct {
+    const char *path;
+    int fd;
+    unsigned char *map;
+    size_t size;
+    StrBuf key;                // Clé de la dernière ligne consultée
+    StrBuf text;               // Dérivée copiée par la consultation
+    uint64_t hash;
+    int keyed;                 // key est valide (ligne sans caractère invalide)
+    CacheStats stats;
+} PersistentCache;
+
+static CacheHeader *cache_header(const PersistentCache *cache) {
+    return (CacheHeader *)cache->map;
+}
+
+static CacheSlot *cache_slots(const PersistentCache *cache) {
+    return (CacheSlot *)(cache->map + sizeof(CacheHeader));
+}
+
+static void cache_clear(PersistentCache *cache) {
+    CacheHeader *header = cache_header(cache);
+    
+    memset(cache_slots(cache), 0, header->slots * sizeof(CacheSlot));
+    header->data_used = 0;
+    header->entries = 0;
+    header->clock = 0;
+    header->generation += header->generation & 1;
+}
+
+/* En-tête d'un fichier neuf: la table prend une case par CACHE_BYTES_PER_SLOT
+ * octets (arrondi à une puissance de deux), la zone de données le reste */
+static void cache_format(PersistentCache *cache) {
+    CacheHeader *header = cache_header(cache);
+    uint64_t slots = 16;
+    
+    while (2 * slots <= cache->size / CACHE_BYTES_PER_SLOT) slots *= 2;
+    header->size = cache->size;
+    header->slots = slots;
+    header->data_offset = sizeof(CacheHeader) + slots * sizeof(CacheSlot);
+    header->data_capacity = cache->size - header->data_offset;
+    cache_clear(cache);
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+}
+
+static int cache_valid(const PersistentCache *cache) {
+    const CacheHeader *header = cache_header(cache);
+    
+    return cache->size >= sizeof(CacheHeader) &&
+           memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->size == cache->size && header->slots >= 16 &&
+           (header->slots & (header->slots - 1)) == 0 &&
+           header->data_offset == sizeof(CacheHeader) + header->slots * sizeof(CacheSlot) &&
+           header->data_offset + header->data_capacity == cache->size;
+}
+
+/* Ouvre (ou crée, de size octets) le cache path. Un cache existant garde sa
+ * taille; s'il a été laissé au milieu d'une écriture, il est vidé. */
+static int cache_open(PersistentCache *cache, const char *path, size_t size) {
+    struct stat st;
+    int created = 0;
+    
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    cache->map = MAP_FAILED;
+    strbuf_init(&cache->key, NULL, 0);
+    strbuf_init(&cache->text, NULL, 0);
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0 || flock(cache->fd, LOCK_EX) != 0 || fstat(cache->fd, &st) != 0) {
+        fprintf(stderr, "Erreur: impossible d'ouvrir le cache '%s'\n", path);
+        if (cache->fd >= 0) close(cache->fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        if (ftruncate(cache->fd, (off_t)size) != 0) {
+            fprintf(stderr, "Erreur: impossible de créer le cache '%s'\n", path);
+            close(cache->fd);
+            return -1;
+        }
+        st.st_size = (off_t)size;
+        created = 1;
+    }
+    cache->size = (size_t)st.st_size;
+    if (cache->size >= sizeof(CacheHeader)) {
+        cache->map = (unsigned char *)mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           cache->fd, 0);
+    }
+    if (cache->map != MAP_FAILED && created) cache_format(cache);
+    if (cache->map == MAP_FAILED || !cache_valid(cache)) {
+        fprintf(stderr, "Erreur: '%s' n'est pas un cache de dérivées\n", path);
+        if (cache->map != MAP_FAILED) munmap(cache->map, cache->size);
+        close(cache->fd);
+        return -1;
+    }
+    if (cache_header(cache)->generation & 1) cache_clear(cache);
+    flock(cache->fd, LOCK_UN);
+    return 0;
+}
+
+static void cache_close(PersistentCache *cache) {
+    munmap(cache->map, cache->size);
+    close(cache->fd);
+    strbuf_free(&cache->key);
+    strbuf_free(&cache->text);
+}
+
+/* Calcule la clé de line. Renvoie 0 si la ligne contient un caractère
+ * invalide: elle n'est alors ni cherchée ni rangée. */
+static int cache_key(PersistentCache *cache, const char *line, const DerivOptions *options) {
+    StrBuf *key = &cache->key;
+    uint64_t h = 14695981039346656037ULL;
+    char letter[2];
+    Parser parser;
+    Token token;
+    size_t i;
+    
+    key->length = 0;
+    strbuf_puts(key, options->var != NULL ? options->var : "x");
+    strbuf_putc(key, '\0');
+    strbuf_putc(key, options->order > 1 ? options->order : 1);
+    strbuf_putc(key, (options->canonical != 0) | (options->cse != 0) << 1 | (options->flat != 0) << 2);
+    parser.input = line;
+    parser.pos = 0;
+    do {
+        token = get_next_token(&parser);
+        if (token.type == TOKEN_ERROR) return cache->keyed = 0;
+        strbuf_putc(key, token.type);
+        if (token.type == TOKEN_NUMBER) {
+            strbuf_write(key, (const char *)&token.value, sizeof(token.value));
+        } else if (token.type == TOKEN_VARIABLE) {
+            strbuf_puts(key, symbol_text(token.symbol, letter));
+            strbuf_putc(key, '\0');
+        }
+    } while (token.type != TOKEN_END);
+    
+    for (i = 0; i < key->length; i++) h = (h ^ (unsigned char)key->data[i]) * 1099511628211ULL;
+    cache->hash = hash_pointer((const void *)(uintptr_t)h) | 1;
+    return cache->keyed = 1;
+}
+
+/* Message d'une dérivée de length caractères, trop longue pour --max-output */
+static void write_omitted(FILE *out, size_t length, size_t max_output) {
+    fprintf(out, "Dérivée omise: %zu caractères (--max-output %zu)", length, max_output);
+}
+
+/* Copie dans cache->text l'entrée de la clé courante sous la génération
+ * lue; renvoie sa case, ou NULL si la clé est absente. Les champs de la case
+ * sont bornés avant usage: une écriture concurrente peut les rendre
+ * incohérents, et la génération relue ensuite invalide alors la copie. */
+static CacheSlot *cache_probe(PersistentCache *cache, CacheSlot *found) {
+    const CacheHeader *header = cache_header(cache);
+    CacheSlot *slots = cache_slots(cache);
+    const unsigned char *data = cache->map + header->data_offset;
+    uint64_t mask = header->slots - 1;
+    uint64_t i, probes;
+    
+    for (i = cache->hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        CacheSlot slot = slots[i];
+        
+        if (slot.hash == 0) return NULL;
+        if (slot.hash != cache->hash || slot.key_length != cache->key.length ||
+            slot.offset > header->data_capacity ||
+            slot.key_length + (uint64_t)slot.text_length > header->data_capacity - slot.offset ||
+            memcmp(data + slot.offset, cache->key.data, slot.key_length) != 0) {
+            continue;
+        }
+        cache->text.length = 0;
+        strbuf_write(&cache->text, (const char *)data + slot.offset + slot.key_length,
+                     slot.text_length);
+        *found = slot;
+        return &slots[i];
+    }
+    return NULL;
+}
+
+/* Cherche la clé calculée par cache_key(); si elle est connue, écrit la
+ * dérivée (ou son omission) sur out et renvoie 1 */
+static int cache_lookup(PersistentCache *cache, const DerivOptions *options, FILE *out) {
+    CacheHeader *header = cache_header(cache);
+    CacheSlot *slot = NULL;
+    CacheSlot found;
+    struct timespec start, end;
+    int attempt, hit = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (attempt = 0; attempt < 4; attempt++) {
+        uint64_t generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+        
+        if (generation & 1) {
+            sched_yield();
+            continue;
+        }
+        slot = cache_probe(cache, &found);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->generation, __ATOMIC_RELAXED) == generation) break;
+        slot = NULL;
+    }
+    if (slot != NULL) {
+        if (options->max_output > 0 && found.output_length > options->max_output) {
+            write_omitted(out, (size_t)found.output_length, options->max_output);
+            hit = 1;
+        } else if (found.text_length == found.output_length) {
+            strbuf_write_to(&cache->text, out);
+            hit = 1;
+        }
+        if (hit) {
+            __atomic_store_n(&slot->last_used, __atomic_add_fetch(&header->clock, 1, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    cache->stats.lookups++;
+    cache->stats.hits += hit;
+    cache->stats.lookup_ns += elapsed_ns(&start, &end);
+    return hit;
+}
+
+static int compare_slots_recent(const void *a, const void *b) {
+    uint64_t x = ((const CacheSlot *)a)->last_used, y = ((const CacheSlot *)b)->last_used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void cache_insert_slot(PersistentCache *cache, const CacheSlot *entry) {
+    CacheSlot *slots = cache_slots(cache);
+    uint64_t mask = cache_header(cache)->slots - 1;
+    uint64_t i;
+    
+    for (i = entry->hash & mask; slots[i].hash != 0; i = (i + 1) & mask) {
+    }
+    slots[i] = *entry;
+}
+
+/* Éviction LRU: garde les entrées les plus récemment utilisées dans la
+ * moitié de la zone de données et de la table, compactées en tête de zone */
+static void cache_evict(PersistentCache *cache) {
+    CacheHeader *header = cache_header(cache);
+    CacheSlot *slots = cache_slots(cache);
+    unsigned char *data = cache->map + header->data_offset;
+    CacheSlot *kept = (CacheSlot *)xcalloc(header->entries + 1, sizeof(CacheSlot));
+    unsigned char *copy;
+    size_t count = 0, keep = 0, bytes = 0, i;
+    
+    for (i = 0; i < header->slots; i++) {
+        if (slots[i].hash != 0) kept[count++] = slots[i];
+    }
+    qsort(kept, count, sizeof(CacheSlot), compare_slots_recent);
+    while (keep < count && 8 * (keep + 1) <= 3 * header->slots &&
+           2 * (bytes + kept[keep].key_length + kept[keep].text_length) <= header->data_capacity) {
+        bytes += kept[keep].key_length + kept[keep].text_length;
+        keep++;
+    }
+    
+    copy = (unsigned char *)xcalloc(bytes + 1, 1);
+    bytes = 0;
+    for (i = 0; i < keep; i++) {
+        size_t length = kept[i].key_length + kept[i].text_length;
+        
+        memcpy(copy + bytes, data + kept[i].offset, length);
+        kept[i].offset = bytes;
+        bytes += length;
+    }
+    memcpy(data, copy, bytes);
+    memset(slots, 0, header->slots * sizeof(CacheSlot));
+    for (i = 0; i < keep; i++) cache_insert_slot(cache, &kept[i]);
+    header->entries = keep;
+    header->data_used = bytes;
+    cache->stats.evictions += count - keep;
+    free(copy);
+    free(kept);
+}
+
+/* Range la dérivée de la ligne dont la clé vient d'être calculée: son texte
+ * (text_length octets), ou seulement sa longueur output_length si elle a
+ * été omise. Une entrée plus grande que le huitième de la zone est ignorée. */
+static void cache_store(PersistentCache *cache, const char *text, size_t text_length,
+                        size_t output_length) {
+    CacheHeader *header = cache_header(cache);
+    CacheSlot *slots = cache_slots(cache);
+    uint64_t need = cache->key.length + text_length;
+    uint64_t mask = header->slots - 1;
+    CacheSlot entry;
+    uint64_t i;
+    
+    if (!cache->keyed || need > header->data_capacity / 8) return;
+    
+    flock(cache->fd, LOCK_EX);
+    if (header->generation & 1) cache_clear(cache);
+    __atomic_store_n(&header->generation, header->generation + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (header->data_used + need > header->data_capacity ||
+        4 * (header->entries + 1) > 3 * header->slots) {
+        cache_evict(cache);
+    }
+    
+    /* Une entrée de même clé (dérivée omise auparavant) est remplacée */
+    for (i = cache->hash & mask; slots[i].hash != 0; i = (i + 1) & mask) {
+        if (slots[i].hash == cache->hash && slots[i].key_length == cache->key.length &&
+            memcmp(cache->map + header->data_offset + slots[i].offset, cache->key.data,
+                   cache->key.length) == 0) {
+            break;
+        }
+    }
+    if (slots[i].hash == 0) header->entries++;
+    entry.hash = cache->hash;
+    entry.last_used = ++header->clock;
+    entry.offset = header->data_used;
+    entry.key_length = (uint32_t)cache->key.length;
+    entry.text_length = (uint32_t)text_length;
+    entry.output_length = output_length;
+    memcpy(cache->map + header->data_offset + entry.offset, cache->key.data, cache->key.length);
+    if (text_length > 0) {
+        memcpy(cache->map + header->data_offset + entry.offset + cache->key.length, text, text_length);
+    }
+    header->data_used += need;
+    slots[i] = entry;
+    __atomic_store_n(&header->generation, header->generation + 1, __ATOMIC_RELEASE);
+    flock(cache->fd, LOCK_UN);
+    cache->stats.stores++;
+}
+
+static void cache_stats_add(CacheStats *total, const CacheStats *stats) {
+    total->lookups += stats->lookups;
+    total->hits += stats->hits;
+    total->stores += stats->stores;
+    total->evictions += stats->evictions;
+    total->lookup_ns += stats->lookup_ns;
+}
+
+static void print_cache_stats(const PersistentCache *cache) {
+    const CacheStats *stats = &cache->stats;
+    const CacheHeader *header = cache_header(cache);
+    
+    fprintf(stderr, "Cache persistant: %llu consultations, %llu succès (%.1f%%), "
+            "%.0f ns par consultation, %llu ajouts, %llu évincées, %llu entrées\n",
+            (unsigned long long)stats->lookups, (unsigned long long)stats->hits,
+            stats->lookups > 0 ? 100.0 * (double)stats->hits / (double)stats->lookups : 0.0,
+            stats->lookups > 0 ? stats->lookup_ns / (double)stats->lookups : 0.0,
+            (unsigned long long)stats->stores, (unsigned long long)stats->evictions,
+            (unsigned long long)header->entries);
+}
+
+/* === PROGRAMME PRINCIPAL === */
+
+#define BATCH_BUFFER_SIZE (1 << 16)
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --batch [FICHIER]  une expression par ligne (stdin par défaut), une dérivée par ligne\n");
+    fprintf(stderr, "  --mmap             avec --batch FICHIER, lire le fichier projeté en mémoire\n");
+    fprintf(stderr, "  --jobs N           threads du mode batch (défaut: nombre de cœurs)\n");
+    fprintf(stderr, "  --var NOM          variable de dérivation (défaut: x)\n");
+    fprintf(stderr, "  --cse              nommer les sous-expressions répétées (t1 = ...; result = ...)\n");
+    fprintf(stderr, "  --order N          dérivée N-ième (1 à 16), simplifiée à chaque ordre\n");
+    fprintf(stderr, "  --dag              partager les sous-expressions identiques (hash-consing)\n");
+    fprintf(stderr, "  --session          une expression par ligne; seuls les termes modifiés sont redérivés\n");
+    fprintf(stderr, "  --canonical        forme canonique: termes semblables regroupés et triés\n");
+    fprintf(stderr, "  --flat             dériver sur un arbre compact (tableaux, indices 32 bits)\n");
+    fprintf(stderr, "  --max-output N     remplacer les dérivées de plus de N caractères par leur taille\n");
+    fprintf(stderr, "  --stats            mesures de chaque expression en JSON sur la sortie d'erreur\n");
+    fprintf(stderr, "  --memo-stats       afficher les compteurs du cache de dérivation\n");
+    fprintf(stderr, "  --cache FICHIER    avec --batch, garder les dérivées dans un cache sur disque\n");
+    fprintf(stderr, "  --cache-size MO    taille d'un nouveau cache en Mo (défaut: %d)\n", CACHE_DEFAULT_MB);
+    fprintf(stderr, "  --serve SOCKET     serveur sur un socket Unix (--jobs workers)\n");
+    fprintf(stderr, "  --client SOCKET    envoyer au serveur les lignes de l'entrée, écrire les dérivées\n");
+    fprintf(stderr, "  --load N           avec --client, N requêtes en boucle: débit et latences\n");
+    fprintf(stderr, "  --connections N    connexions de --load (défaut: 4)\n");
+    fprintf(stderr, "  --pipeline N       requêtes en vol par connexion du client (défaut: 16)\n");
+    fprintf(stderr, "  --eval A:B:N       évaluer f et f' en N points de [A, B] (colonnes x, f, f')\n");
+    fprintf(stderr, "  --dump FICHIER     avec --eval, écrire les triplets (x, f, f') en binaire\n");
+    fprintf(stderr, "  --simd MODE        jeu d'instructions de --eval: auto, avx2, scalar\n");
+    fprintf(stderr, "  --native           avec --eval, compiler f et f' en C (gcc) et les charger (dlopen)\n");
+    fprintf(stderr, "  --ad               avec --eval, f' par différentiation automatique (nombres duaux)\n");
+    fprintf(stderr, "  --ad-check         comparer la différentiation automatique à la voie symbolique\n");
+    fprintf(stderr, "  --taylor X0:N      dérivées d'ordre 0 à N en X0 par séries de Taylor (N <= %d)\n",
+            TAYLOR_MAX);
+    fprintf(stderr, "  --taylor-check     comparer les séries de Taylor à la voie symbolique\n");
+    fprintf(stderr, "  --grad             dérivées partielles par rapport à toutes les variables\n");
+    fprintf(stderr, "  --grad-eval        gradient numérique aux points lus après l'expression\n");
+    fprintf(stderr, "  --emit-c           écrire le code C de f et f' sur la sortie standard\n");
+    fprintf(stderr, "  --simd-check       précision et débit des noyaux vectoriels face à la libm\n");
+    fprintf(stderr, "  --bench SPEC       banc d'essai CSV, SPEC = famille:taille,... (chaine, somme,\n");
+    fprintf(stderr, "                     produit, puissance, aleatoire)\n");
+    fprintf(stderr, "  --seed N           graine des expressions de --bench (1 par défaut)\n");
+}
+
+static void print_memo_stats(void) {
+    fprintf(stderr, "Cache de dérivation: %zu succès, %zu échecs\n",
+            current_arena->stats.memo_hits, current_arena->stats.memo_misses);
+    if (current_arena->stats.canon_calls > 0) {
+        const ArenaStats *stats = &current_arena->stats;
+        fprintf(stderr, "Forme canonique: %zu -> %zu nœuds (%.1f%% de moins), %zu passes\n",
+                stats->canon_nodes_in, stats->canon_nodes_out,
+                100.0 * (1.0 - (double)stats->canon_nodes_out / (double)stats->canon_nodes_in),
+                stats->canon_passes);
+    }
+    if (current_arena->stats.flat_nodes > 0) {
+        const ArenaStats *stats = &current_arena->stats;
+        fprintf(stderr, "Arbres compacts: %zu nœuds, %.1f octets par nœud (Node: %zu)\n",
+                stats->flat_nodes, (double)stats->flat_bytes / (double)stats->flat_nodes,
+                sizeof(Node));
+    }
+    if (current_arena->stats.order_runs > 0) {
+        const ArenaStats *stats = &current_arena->stats;
+        int k;
+        
+        fprintf(stderr, "Dérivées successives: %zu expression(s), nœuds distincts par ordre:",
+                stats->order_runs);
+        for (k = 1; k <= ORDER_MAX && stats->order_nodes[k] > 0; k++) {
+            fprintf(stderr, " %d:%zu", k, stats->order_nodes[k]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/* Écrit le motif d'une dérivation refusée: dérivée trop longue ou erreur */
+static void write_deriv_error(FILE *out, const DerivError *error, const DerivOptions *options) {
+    if (error->status == DERIV_ERROR_TOO_LARGE) {
+        write_omitted(out, error->size, options->max_output);
+    } else {
+        fputs(error->message, out);
+    }
+}
+
+/* Mode interactif: une seule expression, avec bannière et invite */
+static int run_interactive(DerivContext *context, const DerivOptions *options) {
+    const char *var = options->var != NULL ? options->var : "x";
+    const char *result, *text;
+    DerivExpr *tree;
+    char *input = NULL;
+    char *derivative = NULL;
+    size_t capacity = 0;
+    DerivStatus derived;
+    DerivError error;
+    int status = 0;
+    
+    printf("=== Calculateur de dérivées symboliques ===\n");
+    printf("Opérateurs supportés: +, -, *, /, ^\n");
+    printf("Fonctions supportées: sin, cos, exp, ln\n");
+    printf("Exemple: x^2*sin(x)\n\n");
+    
+    /* Ligne de longueur quelconque */
+    printf("Entrez une fonction: ");
+    if (getline(&input, &capacity, stdin) == -1) {
+        fprintf(stderr, "Erreur de lecture\n");
+        free(input);
+        return 1;
+    }
+    
+    /* Supprimer le retour à la ligne */
+    input[strcspn(input, "\n")] = 0;
+    
+    /* Dériver d'abord (les mesures ne portent que sur ce cycle), puis
+     * relire l'expression pour l'afficher: la dérivée et l'erreur sont
+     * copiées avant */
+    derived = deriv_derive(context, input, options, &result, NULL);
+    if (derived == DERIV_OK) derivative = strdup(result);
+    error = *deriv_last_error(context);
+    
+    if (derived != DERIV_OK && derived != DERIV_ERROR_TOO_LARGE) {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", error.message);
+        status = 1;
+    } else {
+        /* Afficher l'expression originale */
+        printf("\nExpression: ");
+        if (deriv_parse(context, input, &tree) == DERIV_OK &&
+            deriv_print(context, tree, &text, NULL) == DERIV_OK) {
+            fputs(text, stdout);
+        }
+        printf("\n");
+        
+        /* Afficher la dérivée simplifiée */
+        if (options->order > 1) {
+            printf("Dérivée d^%d/d%s^%d: ", options->order, var, options->order);
+        } else {
+            printf("Dérivée d/d%s: ", var);
+        }
+        if (derivative != NULL) {
+            fputs(derivative, stdout);
+        } else {
+            write_deriv_error(stdout, &error, options);
+        }
+        printf("\n");
+        deriv_context_reset(context);
+    }
+    if (options->stats) {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", deriv_last_stats(context));
+    }
+    
+    free(derivative);
+    free(input);
+    return status;
+}
+
+/* Dérive une ligne et écrit la dérivée (ou le message d'erreur) suivie d'un
+ * retour à la ligne, et ses mesures JSON sur stats (NULL sans --stats).
+ * Avec un cache (NULL sinon), une ligne déjà vue n'est pas recalculée.
+ * Renvoie 0 si la ligne est valide. */
+static int derive_line(DerivContext *context, PersistentCache *cache, const char *line,
+                       const DerivOptions *options, FILE *out, FILE *stats) {
+    const char *result;
+    size_t length;
+    DerivStatus status;
+    
+    if (cache != NULL && cache_key(cache, line, options) && cache_lookup(cache, options, out)) {
+        fputc('\n', out);
+        return 0;
+    }
+    status = deriv_derive(context, line, options, &result, &length);
+    if (status == DERIV_OK) {
+        fwrite(result, 1, length, out);
+        if (cache != NULL) cache_store(cache, result, length, length);
+    } else {
+        write_deriv_error(out, deriv_last_error(context), options);
+        if (cache != NULL && status == DERIV_ERROR_TOO_LARGE) {
+            cache_store(cache, NULL, 0, deriv_last_error(context)->size);
+        }
+    }
+    fputc('\n', out);
+    if (stats != NULL) fprintf(stats, "%s\n", deriv_last_stats(context));
+    return status != DERIV_OK && status != DERIV_ERROR_TOO_LARGE;
+}
+
+/* Supprime le retour à la ligne final (\n ou \r\n) */
+static size_t chomp(char *line, size_t length) {
+    if (length > 0 && line[length - 1] == '\n') line[--length] = '\0';
+    if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+    return length;
+}
+
+/* Mode batch: une expression par ligne jusqu'à EOF, sans invite. Une ligne
+ * invalide produit son message d'erreur à la place de la dérivée. */
+static int run_batch(DerivContext *context, PersistentCache *cache, FILE *in,
+                     const DerivOptions *options) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = 0;
+    
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    
+    while ((length = getline(&line, &capacity, in)) != -1) {
+        chomp(line, (size_t)length);
+        status |= derive_line(context, cache, line, options, stdout, options->stats ? stderr : NULL);
+    }
+    
+    free(line);
+    if (ferror(in)) {
+        fprintf(stderr, "Erreur de lecture\n");
+        status = 1;
+    }
+    return status;
+}
+
+/* Mode --session: une expression par ligne jusqu'à EOF, chacune dérivée
+ * dans la session du contexte (DERIV_SESSION): après la modification d'un
+ * terme, seul le chemin de ce terme à la racine est redérivé et resimplifié.
+ * L'invite n'est affichée que sur un terminal. */
+static int run_session(DerivContext *context, const DerivOptions *options) {
+    int prompt = isatty(STDIN_FILENO);
+    const char *result;
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t length;
+    ssize_t read;
+    DerivStatus derived;
+    int status = 0;
+    
+    if (prompt) {
+        printf("=== Session de dérivation ===\n");
+        printf("Une expression par ligne; les sous-expressions déjà vues ne sont pas redérivées.\n\n");
+    }
+    for (;;) {
+        if (prompt) {
+            printf("> ");
+            fflush(stdout);
+        }
+        if ((read = getline(&line, &capacity, stdin)) == -1) break;
+        if (chomp(line, (size_t)read) == 0) continue;
+        
+        derived = deriv_derive(context, line, options, &result, &length);
+        if (derived == DERIV_OK) {
+            fwrite(result, 1, length, stdout);
+        } else {
+            write_deriv_error(stdout, deriv_last_error(context), options);
+            if (derived != DERIV_ERROR_TOO_LARGE) status = 1;
+        }
+        fputc('\n', stdout);
+        if (options->stats) {
+            fflush(stdout);
+            fprintf(stderr, "%s\n", deriv_last_stats(context));
+        }
+    }
+    if (prompt) printf("\n");
+    
+    free(line);
+    return status;
+}
+
+/* Grille d'évaluation: n points régulièrement espacés de from à to */
+typedef struct {
+    double from;
+    double to;
+    size_t n;
+} EvalGrid;
+
+static int parse_grid(const char *text, EvalGrid *grid) {
+    char *end;
+    
+    grid->from = strtod(text, &end);
+    if (end == text || *end != ':') return 0;
+    text = end + 1;
+    grid->to = strtod(text, &end);
+    if (end == text || *end != ':') return 0;
+    text = end + 1;
+    grid->n = (size_t)strtoul(text, &end, 10);
+    return end != text && *end == '\0' && grid->n > 0;
+}
+
+/* Point et ordre de --taylor: "X0:N" */
+static int parse_taylor(const char *text, double *x0, size_t *order) {
+    char *end;
+    
+    *x0 = strtod(text, &end);
+    if (end == text || *end != ':') return 0;
+    text = end + 1;
+    *order = (size_t)strtoul(text, &end, 10);
+    return end != text && *end == '\0' && *order <= TAYLOR_MAX;
+}
+
+/* Lit et analyse une expression sur une ligne de stdin. En cas d'erreur le
+ * message est affiché et NULL est renvoyé; *line est à libérer par l'appelant. */
+static Node *read_expression(Parser *parser, char **line) {
+    size_t capacity = 0;
+    ssize_t length;
+    Node *tree;
+    
+    *line = NULL;
+    if ((length = getline(line, &capacity, stdin)) == -1) {
+        fprintf(stderr, "Erreur de lecture\n");
+        return NULL;
+    }
+    chomp(*line, (size_t)length);
+    
+    tree = parse_string(parser, *line);
+    if (tree == NULL) fprintf(stderr, "%s\n", parser->error);
+    return tree;
+}
+
+/* Mode --emit-c: écrit sur stdout le code C de f et de sa dérivée */
+static int run_emit_c(Symbol var) {
+    unsigned char used[EVAL_VARS] = {0};
+    Parser parser;
+    char *line;
+    Node *tree = read_expression(&parser, &line);
+    int status = tree == NULL || !check_short_variables(tree, used);
+    
+    if (status == 0) emit_c_source(stdout, tree, simplify(differentiate(tree, var)), var);
+    free(line);
+    return status;
+}
+
+/* Mode --grad: dérivées partielles par rapport à toutes les variables, une
+ * ligne "d/dc: ..." par variable, dans l'ordre alphabétique */
+static int run_grad(void) {
+    Parser parser;
+    char *line;
+    Node *tree = read_expression(&parser, &line);
+    Node **grads;
+    Symbol *vars;
+    size_t count, nvars = 0, c;
+    
+    free(line);
+    if (tree == NULL) return 1;
+    
+    count = symbol_count();
+    grads = (Node **)xcalloc(count, sizeof(Node *));
+    vars = (Symbol *)xcalloc(count, sizeof(Symbol));
+    gradient(tree, grads, count);
+    for (c = 0; c < count; c++) {
+        if (grads[c] != NULL) vars[nvars++] = (Symbol)c;
+    }
+    qsort(vars, nvars, sizeof(Symbol), compare_symbols);
+    for (c = 0; c < nvars; c++) {
+        char letter[2];
+        
+        printf("d/d%s: ", symbol_text(vars[c], letter));
+        print_tree(simplify(grads[vars[c]]));
+        printf("\n");
+    }
+    free(grads);
+    free(vars);
+    return 0;
+}
+
+/* Mode --grad-eval: la première ligne est l'expression, chaque ligne suivante
+ * un point (valeurs des variables dans l'ordre alphabétique). Écrit pour
+ * chaque point f puis les dérivées partielles, dans le même ordre. */
+static int run_grad_eval(void) {
+    unsigned char used[EVAL_VARS] = {0};
+    double *columns[EVAL_VARS] = {NULL};
+    double *grads[EVAL_VARS] = {NULL};
+    char vars[EVAL_VARS];
+    size_t nvars = 0, n = 0, capacity = 0;
+    double *value = NULL;
+    Program prog;
+    Parser parser;
+    char *line;
+    size_t line_capacity = 0;
+    Node *tree = read_expression(&parser, &line);
+    size_t i, v;
+    int status = 0;
+    int c;
+    
+    if (tree == NULL || !check_short_variables(tree, used)) {
+        free(line);
+        return 1;
+    }
+    for (c = 0; c < EVAL_VARS; c++) {
+        if (used[c]) vars[nvars++] = (char)c;
+    }
+    program_init(&prog);
+    compile_tree(&prog, tree);
+    arena_reset(current_arena);
+    
+    /* Lecture des points: une colonne par variable */
+    while (getline(&line, &line_capacity, stdin) != -1) {
+        const char *text = line;
+        char *end;
+        
+        if (n == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            for (v = 0; v < nvars; v++) {
+                unsigned char var = (unsigned char)vars[v];
+                columns[var] = (double *)xrealloc(columns[var], capacity * sizeof(double));
+            }
+        }
+        for (v = 0; v < nvars; v++) {
+            columns[(unsigned char)vars[v]][n] = strtod(text, &end);
+            if (end == text) break;
+            text = end;
+        }
+        if (v < nvars) {
+            fprintf(stderr, "Erreur: point %zu: %zu valeurs attendues\n", n + 1, nvars);
+            status = 1;
+            break;
+        }
+        n++;
+    }
+    free(line);
+    
+    if (status == 0 && n > 0) {
+        value = (double *)xcalloc(n, sizeof(double));
+        for (v = 0; v < nvars; v++) {
+            grads[(unsigned char)vars[v]] = (double *)xcalloc(n, sizeof(double));
+        }
+        program_gradient(&prog, (const double *const *)columns, n, value, grads);
+        
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+        for (i = 0; i < n; i++) {
+            printf("%.17g", value[i]);
+            for (v = 0; v < nvars; v++) printf(" %.17g", grads[(unsigned char)vars[v]][i]);
+            printf("\n");
+        }
+    }
+    
+    for (v = 0; v < nvars; v++) {
+        free(columns[(unsigned char)vars[v]]);
+        free(grads[(unsigned char)vars[v]]);
+    }
+    free(value);
+    program_free(&prog);
+    return status;
+}
+
+/* Mode --eval: lit une expression, compile f et f' (en bytecode, ou en code
+ * natif avec --native) et les évalue sur la grille. Avec --ad, seul f est
+ * compilé et f' est obtenue par différentiation automatique. Sortie texte
+ * (x f f') ou binaire (--dump). */
+static int run_eval(Symbol var, const EvalGrid *grid, const char *dump_file, EvalIsa isa, int native,
+                    int ad) {
+    const double *bindings[EVAL_VARS] = {NULL};
+    unsigned char used[EVAL_VARS] = {0};
+    Program prog_f, prog_df;
+    NativeModule module;
+    Parser parser;
+    Node *tree;
+    double *xs, *fs, *dfs;
+    char *line;
+    char letter[2];
+    Symbol unbound;
+    size_t i;
+    int status = 0;
+    int c;
+    
+    tree = read_expression(&parser, &line);
+    free(line);
+    if (tree == NULL) return 1;
+    
+    unbound = collect_variables(tree, used);
+    for (c = 0; c < EVAL_VARS && unbound == 0; c++) {
+        if (used[c] && (Symbol)c != var) unbound = (Symbol)c;
+    }
+    if (unbound != 0) {
+        fprintf(stderr, "Erreur: la variable '%s' n'a pas de valeur\n", symbol_text(unbound, letter));
+        return 1;
+    }
+    
+    program_init(&prog_f);
+    program_init(&prog_df);
+    if (native) {
+        status = native_load(&module, tree, simplify(differentiate(tree, var)), var);
+    } else if (ad) {
+        compile_tree(&prog_f, tree);
+    } else {
+        compile_tree(&prog_f, tree);
+        compile_tree(&prog_df, simplify(differentiate(tree, var)));
+    }
+    arena_reset(current_arena);
+    if (status != 0) return status;
+    
+    xs = (double *)xcalloc(grid->n, sizeof(double));
+    fs = (double *)xcalloc(grid->n, sizeof(double));
+    dfs = (double *)xcalloc(grid->n, sizeof(double));
+    for (i = 0; i < grid->n; i++) {
+        xs[i] = grid->n == 1 ? grid->from
+                             : grid->from + (grid->to - grid->from) * (double)i / (double)(grid->n - 1);
+    }
+    bindings[var] = xs;
+    
+    if (native) {
+        for (i = 0; i < grid->n; i++) {
+            fs[i] = module.f(xs[i]);
+            dfs[i] = module.df(xs[i]);
+        }
+        native_unload(&module);
+    } else if (ad) {
+        program_eval_dual(&prog_f, bindings, var, grid->n, fs, dfs);
+    } else {
+        program_eval_isa(&prog_f, bindings, grid->n, fs, isa);
+        program_eval_isa(&prog_df, bindings, grid->n, dfs, isa);
+    }
+    
+    if (dump_file != NULL) {
+        FILE *out = fopen(dump_file, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Erreur: impossible d'ouvrir '%s'\n", dump_file);
+            status = 1;
+        } else {
+            for (i = 0; i < grid->n; i++) {
+                double row[3];
+                row[0] = xs[i];
+                row[1] = fs[i];
+                row[2] = dfs[i];
+                fwrite(row, sizeof(double), 3, out);
+            }
+            if (fclose(out) != 0) {
+                fprintf(stderr, "Erreur d'écriture dans '%s'\n", dump_file);
+                status = 1;
+            }
+        }
+    } else {
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+        for (i = 0; i < grid->n; i++) {
+            printf("%.17g %.17g %.17g\n", xs[i], fs[i], dfs[i]);
+        }
+    }
+    
+    program_free(&prog_f);
+    program_free(&prog_df);
+    free(xs);
+    free(fs);
+    free(dfs);
+    return status;
+}
+
+/* Mode --taylor: lit une expression et écrit, pour k de 0 à order, la ligne
+ * "k f^(k)(x0) f^(k)(x0)/k!" obtenue par les séries de Taylor, sans
+ * construire l'arbre d'aucune dérivée */
+static int run_taylor(Symbol var, double x0, size_t order) {
+    unsigned char used[EVAL_VARS] = {0};
+    Program prog;
+    Parser parser;
+    Node *tree;
+    double *coeffs;
+    double factorial = 1;
+    char *line;
+    char letter[2];
+    Symbol unbound;
+    size_t k;
+    int c;
+    
+    tree = read_expression(&parser, &line);
+    free(line);
+    if (tree == NULL) return 1;
+    
+    unbound = collect_variables(tree, used);
+    for (c = 0; c < EVAL_VARS && unbound == 0; c++) {
+        if (used[c] && (Symbol)c != var) unbound = (Symbol)c;
+    }
+    if (unbound != 0) {
+        fprintf(stderr, "Erreur: la variable '%s' n'a pas de valeur\n", symbol_text(unbound, letter));
+        return 1;
+    }
+    
+    program_init(&prog);
+    compile_tree(&prog, tree);
+    arena_reset(current_arena);
+    coeffs = (double *)xcalloc(order + 1, sizeof(double));
+    program_taylor(&prog, var, x0, order + 1, coeffs);
+    
+    for (k = 0; k <= order; k++) {
+        if (k > 0) factorial *= (double)k;
+        printf("%zu %.17g %.17g\n", k, coeffs[k] * factorial, coeffs[k]);
+    }
+    
+    program_free(&prog);
+    free(coeffs);
+    return 0;
+}
+
+/* === ENTRÉE PROJETÉE EN MÉMOIRE === */
+
+/* Fichier d'expressions projeté en lecture (--mmap): le lexeur lit les lignes
+ * directement dans la projection, '\n' terminant chaque expression. Seule
+ * une dernière ligne sans '\n' est copiée, pour que strtod ne lise pas au-delà
+ * de la projection. */
+typedef struct {
+    const char *data;      // Projection (NULL si le fichier est vide)
+    size_t mapped;         // Taille de la projection
+    size_t size;           // Octets jusqu'au dernier '\n' inclus
+    char *tail;            // Copie de la ligne finale sans '\n' (NULL si aucune)
+} MappedInput;
+
+/* Projette path; renvoie 0 si c'est fait, 1 si le fichier n'est pas
+ * projetable (tube, terminal: lire le flux), -1 en cas d'erreur */
+static int map_input(MappedInput *map, const char *path) {
+    struct stat info;
+    const char *last;
+    void *data;
+    int fd;
+    
+    memset(map, 0, sizeof(*map));
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        fprintf(stderr, "Erreur: impossible d'ouvrir '%s'\n", path);
+        return -1;
+    }
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return 1;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    
+    data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 1;
+    posix_madvise(data, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+    
+    map->data = (const char *)data;
+    map->mapped = (size_t)info.st_size;
+    for (last = map->data + map->mapped; last > map->data && last[-1] != '\n'; last--) {
+    }
+    map->size = (size_t)(last - map->data);
+    if (map->size < map->mapped) {
+        size_t length = map->mapped - map->size;
+        
+        map->tail = (char *)xcalloc(length + 1, 1);
+        memcpy(map->tail, last, length);
+    }
+    return 0;
+}
+
+static void unmap_input(MappedInput *map) {
+    if (map->data != NULL) munmap((void *)map->data, map->mapped);
+    free(map->tail);
+    memset(map, 0, sizeof(*map));
+}
+
+/* Mode batch séquentiel sur un fichier projeté */
+static int run_batch_mapped(DerivContext *context, PersistentCache *cache,
+                            const MappedInput *map, const DerivOptions *options) {
+    size_t offset = 0;
+    int status = 0;
+    
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    
+    while (offset < map->size) {
+        const char *line = map->data + offset;
+        const char *end = (const char *)memchr(line, '\n', map->size - offset);
+        
+        status |= derive_line(context, cache, line, options, stdout, options->stats ? stderr : NULL);
+        offset = (size_t)(end - map->data) + 1;
+    }
+    if (map->tail != NULL) {
+        status |= derive_line(context, cache, map->tail, options, stdout,
+                              options->stats ? stderr : NULL);
+    }
+    return status;
+}
+
+/* === BATCH PARALLÈLE === */
+
+#define POOL_BLOCK_LINES 8192   // Lignes lues avant distribution aux workers
+#define POOL_CHUNK_LINES 64     // Lignes traitées d'un coup par un worker
+
+/* Bloc de lignes: textes contigus séparés par des '\0' (copiés depuis un
+ * flux), ou lignes d'un fichier projeté terminées par '\n' (sans copie) */
+typedef struct {
+    const char *lines;     // text, ou la projection du fichier
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+    size_t *starts;        // Début de chaque ligne dans lines
+    size_t count;
+    size_t capacity;
+} LineBlock;
+
+/* Sortie d'un morceau de lignes, écrite par un worker */
+typedef struct {
+    char *data;
+    size_t size;
+    char *stats;           // Mesures JSON des lignes (--stats)
+    size_t stats_size;
+    int status;
+} ChunkOutput;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    const LineBlock *block;
+    ChunkOutput *outputs;
+    size_t chunks;         // Morceaux du bloc courant
+    size_t next_chunk;     // Prochain morceau à distribuer
+    size_t done_chunks;    // Morceaux terminés
+    int stop;
+    DerivOptions options;
+    int flags;             // Options des contextes des workers
+    const PersistentCache *cache; // Cache ouvert à nouveau par chaque worker (NULL sans --cache)
+    ArenaStats stats;      // Cumul des arènes des workers
+    CacheStats cache_stats;
+} BatchPool;
+
+static void arena_stats_add(ArenaStats *total, const ArenaStats *stats) {
+    size_t i;
+    
+    total->bytes += stats->bytes;
+    total->allocs += stats->allocs;
+    total->released += stats->released;
+    total->copies += stats->copies;
+    total->shared += stats->shared;
+    total->memo_hits += stats->memo_hits;
+    total->memo_misses += stats->memo_misses;
+    total->canon_calls += stats->canon_calls;
+    total->canon_passes += stats->canon_passes;
+    total->canon_nodes_in += stats->canon_nodes_in;
+    total->canon_nodes_out += stats->canon_nodes_out;
+    total->flat_nodes += stats->flat_nodes;
+    total->flat_bytes += stats->flat_bytes;
+    total->order_runs += stats->order_runs;
+    for (i = 0; i <= ORDER_MAX; i++) total->order_nodes[i] += stats->order_nodes[i];
+    for (i = 0; i < RULE_COUNT; i++) total->rules[i] += stats->rules[i];
+    if (stats->high_water > total->high_water) total->high_water = stats->high_water;
+}
+
+static void pool_run_chunk(BatchPool *pool, DerivContext *context, PersistentCache *cache,
+                           size_t chunk) {
+    const LineBlock *block = pool->block;
+    ChunkOutput *output = &pool->outputs[chunk];
+    size_t first = chunk * POOL_CHUNK_LINES;
+    size_t last = first + POOL_CHUNK_LINES;
+    FILE *out = open_memstream(&output->data, &output->size);
+    FILE *stats = NULL;
+    size_t i;
+    
+    if (pool->options.stats) stats = open_memstream(&output->stats, &output->stats_size);
+    if (out == NULL || (pool->options.stats && stats == NULL)) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        exit(1);
+    }
+    if (last > block->count) last = block->count;
+    for (i = first; i < last; i++) {
+        output->status |= derive_line(context, cache, block->lines + block->starts[i],
+                                      &pool->options, out, stats);
+    }
+    fclose(out);
+    if (stats != NULL) fclose(stats);
+}
+
+/* Chaque worker possède son contexte, réutilisé d'une ligne à l'autre, et
+ * sa propre ouverture du cache (donc son propre verrou) */
+static void *pool_worker(void *arg) {
+    BatchPool *pool = (BatchPool *)arg;
+    DerivContext *context = deriv_context_new(pool->flags);
+    PersistentCache cache;
+    
+    if (context == NULL) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        exit(1);
+    }
+    if (pool->cache != NULL && cache_open(&cache, pool->cache->path, pool->cache->size) != 0) {
+        exit(1);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        size_t chunk;
+        
+        while (!pool->stop && pool->next_chunk >= pool->chunks) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->next_chunk >= pool->chunks) break;
+        
+        chunk = pool->next_chunk++;
+        pthread_mutex_unlock(&pool->lock);
+        pool_run_chunk(pool, context, pool->cache != NULL ? &cache : NULL, chunk);
+        pthread_mutex_lock(&pool->lock);
+        
+        if (++pool->done_chunks == pool->chunks) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    arena_stats_add(&pool->stats, &context->arena.stats);
+    if (pool->cache != NULL) cache_stats_add(&pool->cache_stats, &cache.stats);
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (pool->cache != NULL) cache_close(&cache);
+    deriv_context_free(context);
+    return NULL;
+}
+
+/* Lit jusqu'à POOL_BLOCK_LINES lignes; renvoie le nombre de lignes lues */
+static size_t read_block(FILE *in, LineBlock *block, char **line, size_t *capacity) {
+    ssize_t length;
+    
+    block->count = 0;
+    block->text_size = 0;
+    while (block->count < POOL_BLOCK_LINES &&
+           (length = getline(line, capacity, in)) != -1) {
+        size_t size = chomp(*line, (size_t)length) + 1;
+        
+        if (block->text_size + size > block->text_capacity) {
+            block->text_capacity = 2 * (block->text_size + size);
+            block->text = (char *)realloc(block->text, block->text_capacity);
+        }
+        if (block->count == block->capacity) {
+            block->capacity = block->capacity ? 2 * block->capacity : 1024;
+            block->starts = (size_t *)realloc(block->starts, block->capacity * sizeof(size_t));
+        }
+        if (block->text == NULL || block->starts == NULL) {
+            fprintf(stderr, "Erreur: mémoire insuffisante\n");
+            exit(1);
+        }
+        memcpy(block->text + block->text_size, *line, size);
+        block->starts[block->count++] = block->text_size;
+        block->text_size += size;
+    }
+    block->lines = block->text;
+    return block->count;
+}
+
+/* Source des blocs: un flux (lignes copiées dans le bloc) ou un fichier
+ * projeté (le bloc désigne ses lignes dans la projection) */
+typedef struct {
+    FILE *in;
+    char *line;            // Tampon de getline
+    size_t capacity;
+    const MappedInput *map;    // NULL pour un flux
+    size_t offset;         // Début du prochain bloc dans la projection
+} BlockReader;
+
+/* Découpe le bloc suivant de la projection, aligné sur les fins de ligne:
+ * seuls les débuts de ligne sont calculés, les textes ne sont pas copiés */
+static size_t map_block(BlockReader *reader, LineBlock *block) {
+    const MappedInput *map = reader->map;
+    size_t first = reader->offset;
+    
+    block->count = 0;
+    block->lines = map->data + first;
+    while (block->count < POOL_BLOCK_LINES && reader->offset < map->size) {
+        const char *end = (const char *)memchr(map->data + reader->offset, '\n',
+                                               map->size - reader->offset);
+        
+        if (block->count == block->capacity) {
+            block->capacity = block->capacity ? 2 * block->capacity : 1024;
+            block->starts = (size_t *)xrealloc(block->starts, block->capacity * sizeof(size_t));
+        }
+        block->starts[block->count++] = reader->offset - first;
+        reader->offset = (size_t)(end - map->data) + 1;
+    }
+    return block->count;
+}
+
+static size_t next_block(BlockReader *reader, LineBlock *block) {
+    if (reader->map != NULL) return map_block(reader, block);
+    return read_block(reader->in, block, &reader->line, &reader->capacity);
+}
+
+/* Mode batch multi-thread: les lignes sont lues par blocs, découpées en
+ * morceaux répartis entre les workers, puis écrites dans l'ordre d'entrée.
+ * Avec map, les blocs sont pris dans le fichier projeté, sinon lus dans in. */
+static int run_batch_parallel(DerivContext *context, PersistentCache *cache, FILE *in,
+                              const MappedInput *map, const DerivOptions *options, int jobs) {
+    BatchPool pool;
+    LineBlock block;
+    BlockReader reader;
+    pthread_t *threads;
+    ChunkOutput *outputs;
+    int status = 0;
+    int i;
+    
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    
+    memset(&pool, 0, sizeof(pool));
+    memset(&block, 0, sizeof(block));
+    memset(&reader, 0, sizeof(reader));
+    reader.in = in;
+    reader.map = map;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.work_done, NULL);
+    pool.options = *options;
+    pool.flags = context->shared ? DERIV_SHARED : 0;
+    pool.cache = cache;
+    pool.block = &block;
+    
+    threads = (pthread_t *)xcalloc((size_t)jobs, sizeof(pthread_t));
+    outputs = (ChunkOutput *)xcalloc(POOL_BLOCK_LINES / POOL_CHUNK_LINES, sizeof(ChunkOutput));
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, pool_worker, &pool) != 0) {
+            fprintf(stderr, "Erreur: impossible de créer un thread\n");
+            exit(1);
+        }
+    }
+    
+    while (next_block(&reader, &block) > 0) {
+        size_t chunks = (block.count + POOL_CHUNK_LINES - 1) / POOL_CHUNK_LINES;
+        size_t c;
+        
+        memset(outputs, 0, chunks * sizeof(ChunkOutput));
+        pthread_mutex_lock(&pool.lock);
+        pool.outputs = outputs;
+        pool.chunks = chunks;
+        pool.next_chunk = 0;
+        pool.done_chunks = 0;
+        pthread_cond_broadcast(&pool.work_ready);
+        while (pool.done_chunks < pool.chunks) {
+            pthread_cond_wait(&pool.work_done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        
+        for (c = 0; c < chunks; c++) {
+            fwrite(outputs[c].data, 1, outputs[c].size, stdout);
+            if (outputs[c].stats != NULL) fwrite(outputs[c].stats, 1, outputs[c].stats_size, stderr);
+            status |= outputs[c].status;
+            free(outputs[c].data);
+            free(outputs[c].stats);
+        }
+    }
+    
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    arena_stats_add(&current_arena->stats, &pool.stats);
+    if (cache != NULL) cache_stats_add(&cache->stats, &pool.cache_stats);
+    
+    /* Ligne finale sans '\n' du fichier projeté, après toutes les autres */
+    if (map != NULL && map->tail != NULL) {
+        status |= derive_line(context, cache, map->tail, options, stdout,
+                              options->stats ? stderr : NULL);
+    }
+    if (map == NULL && ferror(in)) {
+        fprintf(stderr, "Erreur de lecture\n");
+        status = 1;
+    }
+    
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_cond_destroy(&pool.work_done);
+    free(threads);
+    free(outputs);
+    free(block.text);
+    free(block.starts);
+    free(reader.line);
+    return status;
+}
+
+/* === SERVEUR (SOCKET UNIX) === */
+
+/* Protocole de --serve: des trames préfixées par leur longueur (32 bits,
+ * gros-boutiste). Un client peut envoyer plusieurs requêtes sans attendre
+ * (pipelining): les réponses reviennent dans l'ordre des requêtes.
+ *   requête: ordre (1 octet, 0 = 1), options (1 octet: 1 canonical, 2 cse,
+ *            4 flat), max_output (32 bits, 0 = sans limite), longueur de
+ *            la variable (1 octet, 0 = x), variable, puis l'expression
+ *   réponse: statut (DerivStatus, 1 octet), détail (32 bits: position
+ *            d'une erreur de syntaxe, longueur d'une dérivée omise), puis
+ *            la dérivée ou le message d'erreur
+ * Un répartiteur surveille (poll) le socket d'écoute et les connexions
+ * inactives; une connexion lisible est confiée à un worker, qui sert les
+ * requêtes arrivées avec son contexte (l'arène reste chaude d'une requête
+ * et d'une connexion à l'autre) puis la rend. Une connexion inactive
+ * n'occupe donc aucun worker. */
+#define SERVE_REQUEST_HEADER 7          // Ordre, options, max_output, longueur de la variable
+#define SERVE_RESPONSE_HEADER 5         // Statut, détail
+#define SERVE_MAX_FRAME (16u << 20)     // Au-delà, la connexion est fermée
+#define SERVE_FLUSH 65536               // Octets de réponses (ou de requêtes) accumulés avant écriture
+#define SERVE_VAR_MAX 64
+#define SERVE_PIPELINE 16               // Requêtes en vol par connexion côté client (défaut)
+#define SERVE_TURN 64                   // Requêtes servies avant de laisser passer les autres connexions
+#define SERVE_WRITE_TIMEOUT 10000       // ms: un client qui ne lit plus ses réponses est déconnecté
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Écrit les size octets de data, en reprenant après une écriture partielle.
+ * Sur un socket non bloquant (serveur), attend au plus SERVE_WRITE_TIMEOUT
+ * que le client lise. */
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd writable;
+            
+            writable.fd = fd;
+            writable.events = POLLOUT;
+            if (poll(&writable, 1, SERVE_WRITE_TIMEOUT) > 0) continue;
+            return -1;
+        }
+        if (written <= 0) return -1;
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+/* Écrit puis vide le tampon des trames en attente */
+static int flush_frames(int fd, StrBuf *pending) {
+    int status = write_all(fd, pending->data, pending->length);
+    
+    pending->length = 0;
+    return status;
+}
+
+/* Lecture des trames d'une connexion: data[start, end) reste à traiter */
+typedef struct {
+    int fd;
+    unsigned char *data;
+    size_t start, end, capacity;
+} FrameReader;
+
+/* Rend dans *frame la trame suivante (sans son préfixe), suivie d'un octet
+ * modifiable. Avant de bloquer sur une lecture, les trames en attente dans
+ * pending sont écrites. Renvoie 1, 0 en fin de connexion, -1 en erreur, 2
+ * si un socket non bloquant n'a plus rien à lire. */
+static int read_frame(FrameReader *reader, StrBuf *pending, unsigned char **frame, uint32_t *length) {
+    for (;;) {
+        size_t available = reader->end - reader->start;
+        size_t need = 4;
+        ssize_t got;
+        
+        if (available >= 4) {
+            *length = get_u32(reader->data + reader->start);
+            if (*length > SERVE_MAX_FRAME) return -1;
+            need = 4 + (size_t)*length;
+            if (available >= need) {
+                *frame = reader->data + reader->start + 4;
+                reader->start += need;
+                return 1;
+            }
+        }
+        
+        /* Place pour la trame entière et l'octet qui la suit */
+        if (reader->start > 0) {
+            memmove(reader->data, reader->data + reader->start, available);
+            reader->start = 0;
+            reader->end = available;
+        }
+        if (need + 1 > reader->capacity) {
+            reader->capacity = need + 1 > 2 * reader->capacity ? need + 1 : 2 * reader->capacity;
+            if (reader->capacity < SERVE_FLUSH) reader->capacity = SERVE_FLUSH;
+            reader->data = (unsigned char *)xrealloc(reader->data, reader->capacity);
+        }
+        if (pending->length > 0 && flush_frames(reader->fd, pending) != 0) return -1;
+        got = read(reader->fd, reader->data + reader->end, reader->capacity - 1 - reader->end);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 2 : -1;
+        if (got == 0) return available == 0 ? 0 : -1;
+        reader->end += (size_t)got;
+    }
+}
+
+/* Ajoute à out une trame: préfixe, en-tête de header_length octets, texte */
+static void put_frame(StrBuf *out, const unsigned char *header, size_t header_length,
+                      const char *text, size_t text_length) {
+    unsigned char prefix[4];
+    
+    put_u32(prefix, (uint32_t)(header_length + text_length));
+    strbuf_write(out, (const char *)prefix, sizeof(prefix));
+    strbuf_write(out, (const char *)header, header_length);
+    strbuf_write(out, text, text_length);
+}
+
+/* Traite une requête et ajoute sa réponse à out */
+static void serve_request(DerivContext *context, unsigned char *frame, uint32_t length,
+                          StrBuf *out) {
+    DerivOptions options = {NULL, 0, 0, 0, 0, 0, 0};
+    unsigned char header[SERVE_RESPONSE_HEADER];
+    char var[SERVE_VAR_MAX + 1];
+    const char *text = "Erreur: requête invalide";
+    size_t text_length = 0, var_length = length >= SERVE_REQUEST_HEADER ? frame[6] : 0;
+    DerivStatus status = DERIV_ERROR_ARGUMENT;
+    uint32_t detail = 0;
+    
+    if (length >= SERVE_REQUEST_HEADER && var_length <= SERVE_VAR_MAX &&
+        SERVE_REQUEST_HEADER + var_length <= length) {
+        char *expression = (char *)frame + SERVE_REQUEST_HEADER + var_length;
+        size_t expression_length = length - SERVE_REQUEST_HEADER - var_length;
+        char saved = expression[expression_length];
+        
+        options.order = frame[0];
+        options.canonical = (frame[1] & 1) != 0;
+        options.cse = (frame[1] & 2) != 0;
+        options.flat = (frame[1] & 4) != 0;
+        options.max_output = get_u32(frame + 2);
+        if (var_length > 0) {
+            memcpy(var, frame + SERVE_REQUEST_HEADER, var_length);
+            var[var_length] = '\0';
+            options.var = var;
+        }
+        
+        /* L'expression est terminée sur place le temps de l'appel (l'octet
+         * suivant appartient à la trame d'après) */
+        expression[expression_length] = '\0';
+        if (strlen(expression) != expression_length || strpbrk(expression, "\n\r") != NULL) {
+            text = "Erreur: une expression tient sur une ligne";
+        } else {
+            status = deriv_derive(context, expression, &options, &text, &text_length);
+            if (status != DERIV_OK) {
+                const DerivError *error = deriv_last_error(context);
+                
+                text = status == DERIV_ERROR_TOO_LARGE ? "" : error->message;
+                detail = (uint32_t)(status == DERIV_ERROR_SYNTAX ? error->position : error->size);
+            }
+        }
+        expression[expression_length] = saved;
     }
+    if (status != DERIV_OK) text_length = strlen(text);
+    if (text_length > SERVE_MAX_FRAME - SERVE_RESPONSE_HEADER) {
+        status = DERIV_ERROR_TOO_LARGE;
+        detail = text_length > UINT32_MAX ? UINT32_MAX : (uint32_t)text_length;
+        text = "";
+        text_length = 0;
+    }
+    header[0] = (unsigned char)status;
+    put_u32(header + 1, detail);
+    put_frame(out, header, sizeof(header), text, text_length);
+}
+
+/* Issue du traitement d'une connexion par un worker */
+enum {
+    SERVE_CLOSE,           // Fin de connexion ou erreur: fermer
+    SERVE_IDLE,            // Plus rien à lire: rendre au répartiteur
+    SERVE_AGAIN            // Tour terminé, trames peut-être en attente: remettre en file
+};
+
+/* Connexion cliente: les trames incomplètes et les réponses non écrites
+ * passent d'un worker à l'autre avec elle */
+typedef struct Connection {
+    FrameReader reader;
+    StrBuf out;
+    struct Connection *next;   // File des connexions prêtes, ou liste des connexions rendues
+} Connection;
+
+/* Sert les requêtes déjà arrivées sur la connexion, au plus SERVE_TURN */
+static int serve_connection(DerivContext *context, Connection *connection) {
+    unsigned char *frame;
+    uint32_t length;
+    int served, status = 1;
     
-    return NULL;
+    for (served = 0; served < SERVE_TURN && (status = read_frame(&connection->reader, &connection->out,
+                                                                  &frame, &length)) == 1; served++) {
+        serve_request(context, frame, length, &connection->out);
+        if (connection->out.length >= SERVE_FLUSH &&
+            flush_frames(connection->reader.fd, &connection->out) != 0) {
+            return SERVE_CLOSE;
+        }
+    }
+    if (status < 0 || flush_frames(connection->reader.fd, &connection->out) != 0) return SERVE_CLOSE;
+    if (status == 0) return SERVE_CLOSE;
+    return status == 1 ? SERVE_AGAIN : SERVE_IDLE;
 }
 
-/* === SIMPLIFICATION === */
+static void connection_close(Connection *connection) {
+    close(connection->reader.fd);
+    strbuf_free(&connection->out);
+    free(connection->reader.data);
+    free(connection);
+}
 
-Node *simplify(Node *node) {
-    if (node == NULL) return NULL;
+typedef struct {
+    int listener;
+    int flags;                 // Options des contextes des workers
+    int wake[2];               // Tube qui réveille le répartiteur quand une connexion est rendue ou fermée
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    Connection *ready, *ready_tail;    // Connexions lisibles, en attente d'un worker
+    Connection *returned;              // Connexions rendues par les workers
+} ServeShared;
+
+/* Socket supprimé à l'arrêt du serveur (SIGINT, SIGTERM) */
+static const char *serve_path;
+
+static void serve_stop(int signal_number) {
+    (void)signal_number;
+    unlink(serve_path);
+    _exit(0);
+}
+
+/* À appeler sous shared->lock */
+static void serve_enqueue(ServeShared *shared, Connection *connection) {
+    connection->next = NULL;
+    if (shared->ready_tail != NULL) {
+        shared->ready_tail->next = connection;
+    } else {
+        shared->ready = connection;
+    }
+    shared->ready_tail = connection;
+    pthread_cond_signal(&shared->ready_cond);
+}
+
+/* Réveille le répartiteur (tube plein: un réveil est déjà en attente) */
+static void serve_wake(ServeShared *shared) {
+    char byte = 0;
+    
+    if (write(shared->wake[1], &byte, 1) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Erreur: réveil du répartiteur: %s\n", strerror(errno));
+    }
+}
+
+/* Chaque worker prend une connexion prête, sert ses requêtes avec son
+ * contexte, puis la rend au répartiteur (ou la remet en file si elle a
+ * encore des requêtes) */
+static void *serve_worker(void *arg) {
+    ServeShared *shared = (ServeShared *)arg;
+    DerivContext *context = deriv_context_new(shared->flags);
     
-    /* Simplifier récursivement les sous-arbres */
-    node->left = simplify(node->left);
-    node->right = simplify(node->right);
+    if (context == NULL) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        exit(1);
+    }
+    for (;;) {
+        Connection *connection;
+        int status;
+        
+        pthread_mutex_lock(&shared->lock);
+        while (shared->ready == NULL) pthread_cond_wait(&shared->ready_cond, &shared->lock);
+        connection = shared->ready;
+        shared->ready = connection->next;
+        if (shared->ready == NULL) shared->ready_tail = NULL;
+        pthread_mutex_unlock(&shared->lock);
+        
+        status = serve_connection(context, connection);
+        if (status == SERVE_CLOSE) {
+            /* Un descripteur se libère: le répartiteur peut reprendre accept */
+            connection_close(connection);
+            serve_wake(shared);
+            continue;
+        }
+        
+        pthread_mutex_lock(&shared->lock);
+        if (status == SERVE_AGAIN) {
+            serve_enqueue(shared, connection);
+        } else {
+            connection->next = shared->returned;
+            shared->returned = connection;
+        }
+        pthread_mutex_unlock(&shared->lock);
+        if (status == SERVE_IDLE) serve_wake(shared);
+    }
+    return NULL;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
     
-    switch (node->type) {
-        case NODE_ADD:
-            /* 0 + x = x */
-            if (is_zero(node->left)) {
-                Node *result = node->right;
-                free(node->left);
-                free(node);
-                return result;
-            }
-            /* x + 0 = x */
-            if (is_zero(node->right)) {
-                Node *result = node->left;
-                free(node->right);
-                free(node);
-                return result;
-            }
-            /* c1 + c2 = c3 */
-            if (node->left->type == NODE_NUMBER && node->right->type == NODE_NUMBER) {
-                node->value = node->left->value + node->right->value;
-                free(node->left);
-                free(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-            }
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Répartiteur: surveille le socket d'écoute et les connexions inactives, et
+ * confie aux workers celles qui ont des données. Faute de descripteurs, le
+ * socket d'écoute (qui resterait lisible) sort de poll jusqu'au prochain
+ * réveil. Ne rend la main qu'en cas d'erreur. */
+static int serve_dispatch(ServeShared *shared) {
+    Connection **idle = NULL;
+    struct pollfd *fds = NULL;
+    size_t count = 0, capacity = 0, fds_capacity = 0, i;
+    int accept_paused = 0, accept_failing = 0;
+    
+    for (;;) {
+        Connection *returned;
+        
+        /* Connexions rendues par les workers: de nouveau surveillées */
+        pthread_mutex_lock(&shared->lock);
+        returned = shared->returned;
+        shared->returned = NULL;
+        pthread_mutex_unlock(&shared->lock);
+        while (returned != NULL) {
+            idle = (Connection **)grow_array(idle, &capacity, count, sizeof(Connection *));
+            idle[count++] = returned;
+            returned = returned->next;
+        }
+        
+        if (count + 2 > fds_capacity) {
+            fds_capacity = 2 * (count + 2);
+            fds = (struct pollfd *)xrealloc(fds, fds_capacity * sizeof(struct pollfd));
+        }
+        fds[0].fd = accept_paused ? -1 : shared->listener;
+        fds[1].fd = shared->wake[0];
+        for (i = 0; i < count; i++) fds[i + 2].fd = idle[i]->reader.fd;
+        for (i = 0; i < count + 2; i++) fds[i].events = POLLIN;
+        
+        if (poll(fds, (nfds_t)(count + 2), -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Erreur: poll: %s\n", strerror(errno));
             break;
+        }
+        
+        /* Connexions lisibles (ou fermées): aux workers. Parcours à rebours:
+         * une connexion retirée est remplacée par la dernière. */
+        pthread_mutex_lock(&shared->lock);
+        for (i = count; i-- > 0; ) {
+            if (fds[i + 2].revents == 0) continue;
+            serve_enqueue(shared, idle[i]);
+            idle[i] = idle[--count];
+        }
+        pthread_mutex_unlock(&shared->lock);
+        
+        if (fds[1].revents != 0) {
+            char drain[256];
             
-        case NODE_SUB:
-            /* x - 0 = x */
-            if (is_zero(node->right)) {
-                Node *result = node->left;
-                free(node->right);
-                free(node);
-                return result;
+            while (read(shared->wake[0], drain, sizeof(drain)) > 0) {
             }
-            /* 0 - x = -x */
-            if (is_zero(node->left)) {
-                Node *result = create_binary(NODE_MUL, create_number(-1), node->right);
-                free(node->left);
-                free(node);
-                return simplify(result);
-            }
-            /* c1 - c2 = c3 */
-            if (node->left->type == NODE_NUMBER && node->right->type == NODE_NUMBER) {
-                node->value = node->left->value - node->right->value;
-                free(node->left);
-                free(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
+            accept_paused = 0;
+        }
+        
+        while (fds[0].revents != 0) {
+            Connection *connection;
+            int fd = accept(shared->listener, NULL, NULL);
+            
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                /* Trop de descripteurs: on réessaie quand une connexion se ferme */
+                if (errno == EMFILE || errno == ENFILE) {
+                    if (!accept_failing) fprintf(stderr, "Erreur: accept: %s\n", strerror(errno));
+                    accept_paused = accept_failing = 1;
+                    break;
+                }
+                fprintf(stderr, "Erreur: accept: %s\n", strerror(errno));
+                free(idle);
+                free(fds);
+                return 1;
             }
+            accept_failing = 0;
+            set_nonblocking(fd);
+            connection = (Connection *)xcalloc(1, sizeof(Connection));
+            connection->reader.fd = fd;
+            strbuf_init(&connection->out, NULL, 0);
+            idle = (Connection **)grow_array(idle, &capacity, count, sizeof(Connection *));
+            idle[count++] = connection;
+        }
+    }
+    free(idle);
+    free(fds);
+    return 1;
+}
+
+static int unix_address(const char *path, struct sockaddr_un *address) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Erreur: chemin de socket trop long '%s'\n", path);
+        return -1;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/* Mode --serve: écoute sur le socket path avec jobs workers; ne rend la main
+ * qu'en cas d'erreur */
+static int run_serve(const char *path, int jobs, int flags) {
+    struct sockaddr_un address;
+    ServeShared shared;
+    pthread_t thread;
+    struct stat st;
+    int i;
+    
+    if (unix_address(path, &address) != 0) return 1;
+    /* Un socket laissé par un serveur précédent est remplacé, pas un fichier */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Erreur: '%s' existe et n'est pas un socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    memset(&shared, 0, sizeof(shared));
+    shared.flags = flags;
+    shared.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (shared.listener < 0 || bind(shared.listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(shared.listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Erreur: impossible d'écouter sur '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (pipe(shared.wake) != 0 || set_nonblocking(shared.listener) != 0 ||
+        set_nonblocking(shared.wake[0]) != 0 || set_nonblocking(shared.wake[1]) != 0) {
+        fprintf(stderr, "Erreur: %s\n", strerror(errno));
+        return 1;
+    }
+    pthread_mutex_init(&shared.lock, NULL);
+    pthread_cond_init(&shared.ready_cond, NULL);
+    serve_path = path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+    fprintf(stderr, "Serveur: %s, %d worker(s)\n", path, jobs);
+    
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&thread, NULL, serve_worker, &shared) != 0) {
+            fprintf(stderr, "Erreur: impossible de créer un thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    serve_dispatch(&shared);
+    close(shared.listener);
+    unlink(path);
+    return 1;
+}
+
+/* Connexion au serveur path; -1 en cas d'erreur (message écrit) */
+static int serve_connect(const char *path) {
+    struct sockaddr_un address;
+    int fd;
+    
+    if (unix_address(path, &address) != 0) return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Erreur: connexion à '%s' impossible: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Ajoute à out la requête de la ligne line */
+static void put_request(StrBuf *out, const char *line, const DerivOptions *options) {
+    unsigned char header[SERVE_REQUEST_HEADER + SERVE_VAR_MAX];
+    size_t var_length = options->var != NULL ? strlen(options->var) : 0;
+    
+    header[0] = (unsigned char)options->order;
+    header[1] = (unsigned char)((options->canonical != 0) | (options->cse != 0) << 1 |
+                                (options->flat != 0) << 2);
+    put_u32(header + 2, options->max_output > UINT32_MAX ? UINT32_MAX : (uint32_t)options->max_output);
+    header[6] = (unsigned char)var_length;
+    memcpy(header + SERVE_REQUEST_HEADER, options->var, var_length);
+    put_frame(out, header, SERVE_REQUEST_HEADER + var_length, line, strlen(line));
+}
+
+/* Lignes de l'entrée du client, découpées sur place */
+typedef struct {
+    char *text;
+    char **lines;
+    size_t count;
+} ClientInput;
+
+static int read_client_input(FILE *in, ClientInput *input) {
+    size_t size = 0, capacity = 65536, lines = 0, i;
+    char *line;
+    size_t got;
+    
+    input->text = (char *)xcalloc(capacity, 1);
+    while ((got = fread(input->text + size, 1, capacity - size - 1, in)) > 0) {
+        size += got;
+        if (capacity - size - 1 == 0) {
+            input->text = (char *)xrealloc(input->text, 2 * capacity);
+            capacity *= 2;
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Erreur de lecture\n");
+        return -1;
+    }
+    if (size > 0 && input->text[size - 1] != '\n') input->text[size++] = '\n';
+    for (i = 0; i < size; i++) lines += input->text[i] == '\n';
+    input->lines = (char **)xcalloc(lines + 1, sizeof(char *));
+    input->count = 0;
+    for (line = input->text; line < input->text + size; ) {
+        char *end = (char *)memchr(line, '\n', (size_t)(input->text + size - line));
+        
+        *end = '\0';
+        chomp(line, (size_t)(end - line));
+        input->lines[input->count++] = line;
+        line = end + 1;
+    }
+    return 0;
+}
+
+/* Mode --client: chaque ligne de in est envoyée au serveur, au plus
+ * pipeline requêtes en vol; les réponses sont écrites comme en mode batch */
+static int run_client(const char *path, FILE *in, const DerivOptions *options, int pipeline) {
+    ClientInput input;
+    FrameReader reader;
+    StrBuf pending;
+    size_t next = 0, done = 0;
+    int status = 0;
+    int fd;
+    
+    if (read_client_input(in, &input) != 0 || (fd = serve_connect(path)) < 0) return 1;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    strbuf_init(&pending, NULL, 0);
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    
+    while (done < input.count) {
+        unsigned char *frame;
+        uint32_t length;
+        
+        while (next < input.count && next - done < (size_t)pipeline && pending.length < SERVE_FLUSH) {
+            put_request(&pending, input.lines[next++], options);
+        }
+        if (read_frame(&reader, &pending, &frame, &length) != 1 || length < SERVE_RESPONSE_HEADER) {
+            fprintf(stderr, "Erreur: connexion interrompue\n");
+            status = 1;
             break;
+        }
+        if (frame[0] == DERIV_ERROR_TOO_LARGE) {
+            write_omitted(stdout, get_u32(frame + 1), options->max_output);
+        } else {
+            fwrite(frame + SERVE_RESPONSE_HEADER, 1, length - SERVE_RESPONSE_HEADER, stdout);
+            if (frame[0] != DERIV_OK) status = 1;
+        }
+        fputc('\n', stdout);
+        done++;
+    }
+    
+    close(fd);
+    strbuf_free(&pending);
+    free(reader.data);
+    free(input.lines);
+    free(input.text);
+    return status;
+}
+
+/* Générateur de charge: une connexion par thread */
+typedef struct {
+    const char *path;
+    const ClientInput *input;
+    const DerivOptions *options;
+    size_t first;          // Requêtes first, first + 1, ... (lignes prises en boucle)
+    size_t count;
+    int pipeline;
+    double *latencies;     // Latence de chaque requête, en nanosecondes
+    size_t errors;
+    int failed;
+} LoadWorker;
+
+static void *load_worker(void *arg) {
+    LoadWorker *worker = (LoadWorker *)arg;
+    struct timespec *sent = (struct timespec *)xcalloc((size_t)worker->pipeline, sizeof(struct timespec));
+    FrameReader reader;
+    StrBuf pending;
+    size_t next = 0, done = 0;
+    int fd = serve_connect(worker->path);
+    
+    if (fd < 0) {
+        worker->failed = 1;
+        free(sent);
+        return NULL;
+    }
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    strbuf_init(&pending, NULL, 0);
+    
+    while (done < worker->count) {
+        struct timespec now;
+        unsigned char *frame;
+        uint32_t length;
+        
+        while (next < worker->count && next - done < (size_t)worker->pipeline &&
+               pending.length < SERVE_FLUSH) {
+            const char *line = worker->input->lines[(worker->first + next) % worker->input->count];
             
-        case NODE_MUL:
-            /* 0 * x = 0 */
-            if (is_zero(node->left) || is_zero(node->right)) {
-                free_tree(node->left);
-                free_tree(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-                node->value = 0;
-            }
-            /* 1 * x = x */
-            else if (is_one(node->left)) {
-                Node *result = node->right;
-                free(node->left);
-                free(node);
-                return result;
-            }
-            /* x * 1 = x */
-            else if (is_one(node->right)) {
-                Node *result = node->left;
-                free(node->right);
-                free(node);
-                return result;
+            put_request(&pending, line, worker->options);
+            clock_gettime(CLOCK_MONOTONIC, &sent[next % (size_t)worker->pipeline]);
+            next++;
+        }
+        if (read_frame(&reader, &pending, &frame, &length) != 1 || length < SERVE_RESPONSE_HEADER) {
+            worker->failed = 1;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        worker->latencies[done] = elapsed_ns(&sent[done % (size_t)worker->pipeline], &now);
+        if (frame[0] != DERIV_OK && frame[0] != DERIV_ERROR_TOO_LARGE) worker->errors++;
+        done++;
+    }
+    
+    close(fd);
+    strbuf_free(&pending);
+    free(reader.data);
+    free(sent);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Mode --client --load: requests requêtes réparties sur connections
+ * connexions, les lignes de in prises en boucle; écrit le débit et les
+ * latences (p50, p99, max) */
+static int run_load(const char *path, FILE *in, const DerivOptions *options, size_t requests,
+                    int connections, int pipeline) {
+    LoadWorker *workers = (LoadWorker *)xcalloc((size_t)connections, sizeof(LoadWorker));
+    pthread_t *threads = (pthread_t *)xcalloc((size_t)connections, sizeof(pthread_t));
+    double *latencies = (double *)xcalloc(requests + 1, sizeof(double));
+    struct timespec start, end;
+    ClientInput input;
+    size_t errors = 0, first = 0;
+    double seconds;
+    int failed = 0;
+    int i;
+    
+    if (read_client_input(in, &input) != 0) return 1;
+    if (input.count == 0) {
+        fprintf(stderr, "Erreur: aucune expression à envoyer\n");
+        return 1;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < connections; i++) {
+        LoadWorker *worker = &workers[i];
+        
+        worker->path = path;
+        worker->input = &input;
+        worker->options = options;
+        worker->first = first;
+        worker->count = requests / (size_t)connections + ((size_t)i < requests % (size_t)connections);
+        worker->pipeline = pipeline;
+        worker->latencies = latencies + first;
+        first += worker->count;
+        if (pthread_create(&threads[i], NULL, load_worker, worker) != 0) {
+            fprintf(stderr, "Erreur: impossible de créer un thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        errors += workers[i].errors;
+        failed |= workers[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    if (failed) {
+        fprintf(stderr, "Erreur: connexion interrompue\n");
+    } else {
+        seconds = elapsed_ns(&start, &end) * 1e-9;
+        qsort(latencies, requests, sizeof(double), compare_doubles);
+        printf("Charge: %zu requêtes, %d connexion(s), %d en vol par connexion, %zu erreur(s)\n",
+               requests, connections, pipeline, errors);
+        printf("Débit: %.0f requêtes/s (%.3f s)\n", (double)requests / seconds, seconds);
+        printf("Latence: p50 %.1f µs, p99 %.1f µs, max %.1f µs\n",
+               latencies[requests / 2] * 1e-3, latencies[requests - 1 - requests / 100] * 1e-3,
+               latencies[requests - 1] * 1e-3);
+    }
+    
+    free(latencies);
+    free(threads);
+    free(workers);
+    free(input.lines);
+    free(input.text);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    const char *batch_file = NULL;
+    const char *dump_file = NULL;
+    EvalGrid grid = {0.0, 0.0, 0};
+    int batch = 0;
+    int use_mmap = 0;
+    int eval = 0;
+    int simd_check = 0;
+    int native = 0;
+    int emit_c = 0;
+    int ad = 0;
+    int ad_check = 0;
+    int taylor = 0;
+    int taylor_check = 0;
+    double taylor_x0 = 0;
+    size_t taylor_order = 0;
+    int grad = 0;
+    int grad_eval = 0;
+    EvalIsa isa = eval_detect_isa();
+    int memo_stats = 0;
+    const char *bench = NULL;
+    uint64_t seed = 1;
+    DeriveOptions options = {'x', 0, 0, 0, 0, 1, 0};
+    DerivOptions derive;
+    DerivContext *context;
+    const char *var_name = NULL;
+    const char *cache_file = NULL;
+    const char *serve = NULL;
+    const char *client = NULL;
+    size_t load = 0;
+    long connections = 4;
+    long pipeline = SERVE_PIPELINE;
+    size_t cache_mb = CACHE_DEFAULT_MB;
+    PersistentCache cache, *cached = NULL;
+    int dag = 0;
+    int session = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int status;
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') batch_file = argv[++i];
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atol(argv[++i]);
+            if (jobs < 1) {
+                fprintf(stderr, "Erreur: nombre de threads invalide '%s'\n", argv[i]);
+                return 1;
             }
-            /* c1 * c2 = c3 */
-            else if (node->left->type == NODE_NUMBER && node->right->type == NODE_NUMBER) {
-                node->value = node->left->value * node->right->value;
-                free(node->left);
-                free(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
+        } else if (strcmp(argv[i], "--var") == 0 && i + 1 < argc) {
+            var_name = argv[++i];
+            if (!variable_symbol(var_name, &options.var)) {
+                fprintf(stderr, "Erreur: variable invalide '%s'\n", var_name);
+                return 1;
             }
-            break;
+        } else if (strcmp(argv[i], "--cse") == 0) {
+            options.cse = 1;
+        } else if (strcmp(argv[i], "--canonical") == 0) {
+            options.canonical = 1;
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            options.flat = 1;
+        } else if (strcmp(argv[i], "--max-output") == 0 && i + 1 < argc) {
+            char *end;
             
-        case NODE_DIV:
-            /* 0 / x = 0 */
-            if (is_zero(node->left)) {
-                free_tree(node->right);
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-                node->value = 0;
+            options.max_output = (size_t)strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || options.max_output == 0) {
+                fprintf(stderr, "Erreur: taille maximale invalide '%s'\n", argv[i]);
+                return 1;
             }
-            /* x / 1 = x */
-            else if (is_one(node->right)) {
-                Node *result = node->left;
-                free(node->right);
-                free(node);
-                return result;
+        } else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) {
+            char *end;
+            long order = strtol(argv[++i], &end, 10);
+            
+            if (*end != '\0' || order < 1 || order > ORDER_MAX) {
+                fprintf(stderr, "Erreur: ordre invalide '%s' (1 à %d)\n", argv[i], ORDER_MAX);
+                return 1;
             }
-            /* c1 / c2 = c3 */
-            else if (node->left->type == NODE_NUMBER && node->right->type == NODE_NUMBER) {
-                if (node->right->value != 0) {
-                    node->value = node->left->value / node->right->value;
-                    free(node->left);
-                    free(node->right);
-                    node->left = NULL;
-                    node->right = NULL;
-                    node->type = NODE_NUMBER;
-                }
+            options.order = (int)order;
+        } else if (strcmp(argv[i], "--dag") == 0) {
+            dag = 1;
+        } else if (strcmp(argv[i], "--session") == 0) {
+            session = 1;
+        } else if (strcmp(argv[i], "--eval") == 0 && i + 1 < argc) {
+            if (!parse_grid(argv[++i], &grid)) {
+                fprintf(stderr, "Erreur: grille invalide '%s' (attendu A:B:N)\n", argv[i]);
+                return 1;
             }
-            break;
+            eval = 1;
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            EvalIsa best = eval_detect_isa();
             
-        case NODE_POW:
-            /* x ^ 0 = 1 */
-            if (is_zero(node->right)) {
-                free_tree(node->left);
-                free_tree(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-                node->value = 1;
+            if (strcmp(mode, "auto") == 0) {
+                isa = best;
+            } else if (strcmp(mode, "scalar") == 0) {
+                isa = EVAL_SCALAR;
+            } else if (strcmp(mode, "avx2") == 0 && best >= EVAL_AVX2) {
+                isa = EVAL_AVX2;
+            } else {
+                fprintf(stderr, "Erreur: jeu d'instructions '%s' indisponible\n", mode);
+                return 1;
             }
-            /* x ^ 1 = x */
-            else if (is_one(node->right)) {
-                Node *result = node->left;
-                free(node->right);
-                free(node);
-                return result;
+        } else if (strcmp(argv[i], "--native") == 0) {
+            native = 1;
+        } else if (strcmp(argv[i], "--ad") == 0) {
+            ad = 1;
+        } else if (strcmp(argv[i], "--ad-check") == 0) {
+            ad_check = 1;
+        } else if (strcmp(argv[i], "--taylor") == 0 && i + 1 < argc) {
+            if (!parse_taylor(argv[++i], &taylor_x0, &taylor_order)) {
+                fprintf(stderr, "Erreur: point invalide '%s' (attendu X0:N, N de 0 à %d)\n", argv[i],
+                        TAYLOR_MAX);
+                return 1;
             }
-            /* 0 ^ x = 0 (si x != 0) */
-            else if (is_zero(node->left) && !is_zero(node->right)) {
-                free_tree(node->right);
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-                node->value = 0;
+            taylor = 1;
+        } else if (strcmp(argv[i], "--taylor-check") == 0) {
+            taylor_check = 1;
+        } else if (strcmp(argv[i], "--grad") == 0) {
+            grad = 1;
+        } else if (strcmp(argv[i], "--grad-eval") == 0) {
+            grad_eval = 1;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = 1;
+        } else if (strcmp(argv[i], "--simd-check") == 0) {
+            simd_check = 1;
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dump_file = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (uint64_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = 1;
+        } else if (strcmp(argv[i], "--memo-stats") == 0) {
+            memo_stats = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load = (size_t)strtoul(argv[++i], NULL, 10);
+            if (load == 0) {
+                fprintf(stderr, "Erreur: nombre de requêtes invalide '%s'\n", argv[i]);
+                return 1;
             }
-            /* 1 ^ x = 1 */
-            else if (is_one(node->left)) {
-                free_tree(node->right);
-                node->right = NULL;
-                node->type = NODE_NUMBER;
-                node->value = 1;
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = atol(argv[++i]);
+            if (connections < 1 || connections > 1024) {
+                fprintf(stderr, "Erreur: nombre de connexions invalide '%s'\n", argv[i]);
+                return 1;
             }
-            /* c1 ^ c2 = c3 */
-            else if (node->left->type == NODE_NUMBER && node->right->type == NODE_NUMBER) {
-                node->value = pow(node->left->value, node->right->value);
-                free(node->left);
-                free(node->right);
-                node->left = NULL;
-                node->right = NULL;
-                node->type = NODE_NUMBER;
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            pipeline = atol(argv[++i]);
+            if (pipeline < 1 || pipeline > 65536) {
+                fprintf(stderr, "Erreur: profondeur de pipeline invalide '%s'\n", argv[i]);
+                return 1;
             }
-            break;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_file = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            char *end;
             
-        default:
-            break;
+            cache_mb = (size_t)strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || cache_mb == 0 || cache_mb > 65536) {
+                fprintf(stderr, "Erreur: taille de cache invalide '%s' (1 à 65536 Mo)\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
     }
     
-    return node;
-}
-
-/* === PROGRAMME PRINCIPAL === */
-
-int main(void) {
-    char input[256];
-    
-    printf("=== Calculateur de dérivées symboliques ===\n");
-    printf("Opérateurs supportés: +, -, *, /, ^\n");
-    printf("Fonctions supportées: sin, cos, exp, ln\n");
-    printf("Exemple: x^2*sin(x)\n\n");
-    
-    printf("Entrez une fonction: ");
-    if (fgets(input, sizeof(input), stdin) == NULL) {
-        fprintf(stderr, "Erreur de lecture\n");
+    if (options.var >= SYMBOL_FIRST && (eval || ad_check || emit_c || taylor || taylor_check)) {
+        fprintf(stderr, "Erreur: --eval, --ad-check, --taylor et --emit-c demandent une variable "
+                        "d'une lettre\n");
         return 1;
     }
-    
-    /* Supprimer le retour à la ligne */
-    input[strcspn(input, "\n")] = 0;
-    
-    /* Initialiser le parseur */
-    input_str = input;
-    pos = 0;
-    current_token = get_next_token();
-    
-    /* Parser l'expression */
-    Node *tree = parse_expression();
-    
-    if (current_token.type != TOKEN_END) {
-        fprintf(stderr, "Erreur: caractères inattendus à la fin\n");
-        free_tree(tree);
+    if (use_mmap && (!batch || batch_file == NULL)) {
+        fprintf(stderr, "Erreur: --mmap demande --batch FICHIER\n");
+        return 1;
+    }
+    if (options.flat && (options.cse || options.canonical)) {
+        fprintf(stderr, "Erreur: --flat ne se combine pas avec --cse ni --canonical\n");
+        return 1;
+    }
+    if (options.order > 1 && (eval || ad_check || grad || grad_eval || emit_c || simd_check || taylor ||
+                              taylor_check)) {
+        fprintf(stderr, "Erreur: --order ne s'applique qu'aux modes interactif et batch\n");
+        return 1;
+    }
+    if (cache_file != NULL && (!batch || eval || ad_check || grad || grad_eval || emit_c ||
+                               simd_check || taylor || taylor_check || bench != NULL)) {
+        fprintf(stderr, "Erreur: --cache ne s'applique qu'au mode batch\n");
+        return 1;
+    }
+    /* Une dérivée lue dans le cache n'a pas de phases à mesurer */
+    if (cache_file != NULL && options.stats) {
+        fprintf(stderr, "Erreur: --stats ne se combine pas avec --cache\n");
+        return 1;
+    }
+    if ((serve != NULL || client != NULL) &&
+        ((serve != NULL && client != NULL) || batch || eval || ad_check || grad || grad_eval ||
+         emit_c || simd_check || taylor || taylor_check || bench != NULL || cache_file != NULL ||
+         options.stats)) {
+        fprintf(stderr, "Erreur: --serve et --client ne se combinent pas avec les autres modes\n");
+        return 1;
+    }
+    if (session && (batch || eval || ad_check || grad || grad_eval || emit_c || simd_check || taylor ||
+                    taylor_check || bench != NULL || serve != NULL || client != NULL)) {
+        fprintf(stderr, "Erreur: --session ne se combine pas avec les autres modes\n");
+        return 1;
+    }
+    if (client == NULL && load > 0) {
+        fprintf(stderr, "Erreur: --load demande --client SOCKET\n");
+        return 1;
+    }
+    if (client != NULL && var_name != NULL && strlen(var_name) > SERVE_VAR_MAX) {
+        fprintf(stderr, "Erreur: variable trop longue pour le serveur (%d caractères au plus)\n",
+                SERVE_VAR_MAX);
         return 1;
     }
     
-    /* Afficher l'expression originale */
-    printf("\nExpression: ");
-    print_tree(tree);
-    printf("\n");
-    
-    /* Calculer la dérivée par rapport à 'x' (ou première variable trouvée) */
-    char var = 'x';
-    Node *derivative = differentiate(tree, var);
+    /* Les modes interactif et batch passent par la bibliothèque; les modes
+     * numériques travaillent aussi dans l'arène de son contexte */
+    context = context_new((dag ? DERIV_SHARED : 0) | (session ? DERIV_SESSION : 0), 0);
+    if (context == NULL) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        return 1;
+    }
+    arena_use(&context->arena);
+    derive.var = var_name;
+    derive.order = options.order;
+    derive.canonical = options.canonical;
+    derive.cse = options.cse;
+    derive.flat = options.flat;
+    derive.max_output = options.max_output;
+    derive.stats = options.stats;
     
-    /* Simplifier la dérivée */
-    derivative = simplify(derivative);
+    if (bench != NULL) {
+        status = run_bench(bench, seed);
+    } else if (serve != NULL) {
+        status = run_serve(serve, (int)jobs, dag ? DERIV_SHARED : 0);
+    } else if (client != NULL && load > 0) {
+        status = run_load(client, stdin, &derive, load, (int)connections, (int)pipeline);
+    } else if (client != NULL) {
+        status = run_client(client, stdin, &derive, (int)pipeline);
+    } else if (simd_check) {
+        status = run_simd_check();
+    } else if (ad_check) {
+        status = run_ad_check(options.var);
+    } else if (taylor_check) {
+        status = run_taylor_check(options.var);
+    } else if (taylor) {
+        status = run_taylor(options.var, taylor_x0, taylor_order);
+    } else if (eval) {
+        status = run_eval(options.var, &grid, dump_file, isa, native, ad);
+    } else if (grad) {
+        status = run_grad();
+    } else if (grad_eval) {
+        status = run_grad_eval();
+    } else if (emit_c) {
+        status = run_emit_c(options.var);
+    } else if (batch) {
+        FILE *in = stdin;
+        MappedInput map;
+        int mapped;
+        
+        if (cache_file != NULL) {
+            if (cache_open(&cache, cache_file, cache_mb << 20) != 0) return 1;
+            cached = &cache;
+        }
+        mapped = use_mmap ? map_input(&map, batch_file) : 1;
+        if (mapped < 0) return 1;
+        if (mapped == 0) {
+            if (jobs > 1) {
+                status = run_batch_parallel(context, cached, NULL, &map, &derive, (int)jobs);
+            } else {
+                status = run_batch_mapped(context, cached, &map, &derive);
+            }
+            unmap_input(&map);
+        } else {
+            /* Pas de projection (ou fichier non projetable): lecture du flux */
+            if (batch_file != NULL && (in = fopen(batch_file, "r")) == NULL) {
+                fprintf(stderr, "Erreur: impossible d'ouvrir '%s'\n", batch_file);
+                return 1;
+            }
+            if (jobs > 1) {
+                status = run_batch_parallel(context, cached, in, NULL, &derive, (int)jobs);
+            } else {
+                status = run_batch(context, cached, in, &derive);
+            }
+            if (in != stdin) fclose(in);
+        }
+    } else if (session) {
+        status = run_session(context, &derive);
+    } else {
+        status = run_interactive(context, &derive);
+    }
     
-    /* Afficher la dérivée */
-    printf("Dérivée d/d%c: ", var);
-    print_tree(derivative);
-    printf("\n");
+    fflush(stdout);
+    if (memo_stats) print_memo_stats();
+    if (cached != NULL) {
+        if (memo_stats) print_cache_stats(cached);
+        cache_close(cached);
+    }
     
-    /* Libérer la mémoire */
-    free_tree(tree);
-    free_tree(derivative);
+    /* Libérer la mémoire: le contexte et son arène d'un coup */
+    arena_use(&default_arena);
+    deriv_context_free(context);
     
-    return 0;
+    return status;
 }
+
+#endif /* DERIVATIVE_LIBRARY */
@@ -0,0 +1,101 @@
+/*
+ * libderivative: calculateur de dérivées symboliques embarquable
+ *
+ * Toute la mémoire des expressions appartient à un contexte (DerivContext):
+ * elle est rendue d'un coup par deriv_context_reset() ou deriv_context_free().
+ * Un contexte ne sert qu'à un thread à la fois; des contextes distincts
+ * s'utilisent en parallèle. Aucune fonction ne termine le processus: chaque
+ * appel renvoie un DerivStatus, et deriv_last_error() en donne le détail.
+ *
+ * Les textes rendus (deriv_print, deriv_derive, deriv_last_stats) sont
+ * terminés par '\0' et restent valides jusqu'à l'appel suivant sur le même
+ * contexte. Une expression s'arrête au premier '\0', '\n' ou '\r'.
+ */
+
+#ifndef DERIVATIVE_H
+#define DERIVATIVE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __GNUC__
+#define DERIV_API __attribute__((visibility("default")))
+#else
+#define DERIV_API
+#endif
+
+typedef enum {
+    DERIV_OK = 0,
+    DERIV_ERROR_SYNTAX,        // Expression invalide (position de l'erreur dans DerivError)
+    DERIV_ERROR_VARIABLE,      // Nom de variable invalide ou nom de fonction
+    DERIV_ERROR_ARGUMENT,      // Argument NULL, option hors limites ou options incompatibles
+    DERIV_ERROR_TOO_LARGE,     // Dérivée plus longue que max_output (taille dans DerivError)
+    DERIV_ERROR_MEMORY         // Mémoire épuisée: les expressions du contexte sont perdues
+} DerivStatus;
+
+typedef struct {
+    DerivStatus status;
+    const char *message;       // Message en français ("" si DERIV_OK)
+    size_t position;           // Octet fautif du texte analysé (DERIV_ERROR_SYNTAX)
+    size_t size;               // Longueur de la dérivée refusée (DERIV_ERROR_TOO_LARGE)
+} DerivError;
+
+/* Options de deriv_derive(); un DerivOptions mis à zéro donne la dérivée
+ * première par rapport à x, simplifiée, sans limite de taille */
+typedef struct {
+    const char *var;           // Variable de dérivation (NULL: "x")
+    int order;                 // Ordre de dérivation, 1 à 16 (0: 1)
+    int canonical;             // Forme canonique après chaque ordre
+    int cse;                   // Sous-expressions répétées nommées: t1 = ...; result = ...
+    int flat;                  // Arbres compacts (incompatible avec cse et canonical)
+    size_t max_output;         // Longueur maximale de la dérivée (0: sans limite)
+    int stats;                 // Mesures de l'appel en JSON (deriv_last_stats)
+} DerivOptions;
+
+/* Options de deriv_context_new() */
+#define DERIV_SHARED 1         // Sous-expressions identiques partagées (hash-consing)
+#define DERIV_SESSION 2        // deriv_derive() garde ses expressions (implique DERIV_SHARED)
+
+typedef struct DerivContext DerivContext;
+typedef struct DerivExpr DerivExpr;    // Expression d'un contexte
+
+/* Contexte vide; NULL si la mémoire manque */
+DERIV_API DerivContext *deriv_context_new(int flags);
+DERIV_API void deriv_context_free(DerivContext *context);
+
+/* Libère toutes les expressions du contexte (la mémoire est gardée), y
+ * compris celles d'une session */
+DERIV_API void deriv_context_reset(DerivContext *context);
+
+/* Erreur du dernier appel sur le contexte */
+DERIV_API const DerivError *deriv_last_error(const DerivContext *context);
+
+/* Étapes séparées. Sans DERIV_SHARED, deriv_simplify() transforme son
+ * argument sur place: seule l'expression rendue reste utilisable. */
+DERIV_API DerivStatus deriv_parse(DerivContext *context, const char *text, DerivExpr **expr);
+DERIV_API DerivStatus deriv_differentiate(DerivContext *context, const DerivExpr *expr,
+                                         const char *var, DerivExpr **derivative);
+DERIV_API DerivStatus deriv_simplify(DerivContext *context, DerivExpr *expr,
+                                     DerivExpr **simplified);
+DERIV_API DerivStatus deriv_print(DerivContext *context, const DerivExpr *expr,
+                                  const char **text, size_t *length);
+
+/* Tout le cycle: analyse, dérivation, simplification et écriture de la
+ * dérivée de text. Libère les expressions du contexte, sauf avec
+ * DERIV_SESSION: les sous-expressions déjà vues par un appel précédent ne
+ * sont alors ni redérivées ni resimplifiées. */
+DERIV_API DerivStatus deriv_derive(DerivContext *context, const char *text,
+                                   const DerivOptions *options, const char **result,
+                                   size_t *length);
+
+/* Mesures JSON du dernier deriv_derive() avec stats ("" sinon) */
+DERIV_API const char *deriv_last_stats(const DerivContext *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DERIVATIVE_H */
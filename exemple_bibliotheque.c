@@ -0,0 +1,56 @@
+/*
+ * Exemple de client de libderivative: dérive chaque argument par rapport
+ * à x, puis calcule d/dy pas à pas avec les étapes séparées.
+ * Compilation: make lib && gcc exemple_bibliotheque.c libderivative.a -lm -pthread
+ */
+
+#include <stdio.h>
+
+#include "derivative.h"
+
+int main(int argc, char **argv) {
+    DerivContext *context = deriv_context_new(0);
+    DerivOptions options = {0};
+    DerivExpr *expr, *derivative;
+    const char *result;
+    int status = 0;
+    int i;
+    
+    if (context == NULL) {
+        fprintf(stderr, "Erreur: mémoire insuffisante\n");
+        return 1;
+    }
+    
+    /* Tout le cycle en un appel; une erreur donne son message et sa position */
+    for (i = 1; i < argc; i++) {
+        if (deriv_derive(context, argv[i], &options, &result, NULL) == DERIV_OK) {
+            printf("d/dx %s = %s\n", argv[i], result);
+        } else {
+            const DerivError *error = deriv_last_error(context);
+            
+            printf("%s: %s (position %zu)\n", argv[i], error->message, error->position);
+            status = 1;
+        }
+    }
+    
+    /* Étapes séparées: les expressions vivent jusqu'au reset du contexte */
+    if (deriv_parse(context, "x*y^2+sin(y)", &expr) != DERIV_OK ||
+        deriv_differentiate(context, expr, "y", &derivative) != DERIV_OK ||
+        deriv_simplify(context, derivative, &derivative) != DERIV_OK ||
+        deriv_print(context, derivative, &result, NULL) != DERIV_OK) {
+        fprintf(stderr, "%s\n", deriv_last_error(context)->message);
+        status = 1;
+    } else {
+        printf("d/dy x*y^2+sin(y) = %s\n", result);
+    }
+    deriv_context_reset(context);
+    
+    /* Les erreurs ne terminent pas le programme */
+    options.var = "sin";
+    if (deriv_derive(context, "x", &options, &result, NULL) == DERIV_ERROR_VARIABLE) {
+        printf("--var sin: %s\n", deriv_last_error(context)->message);
+    }
+    
+    deriv_context_free(context);
+    return status;
+}